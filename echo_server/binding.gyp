@@ -2,7 +2,7 @@
   "targets": [
     {
       "target_name": "echo_server",
-      "sources": [ "echo_server.cc" ]
+      "sources": [ "echo_server.cc", "http.cc", "kv_shards.cc", "kv_store.cc", "resp.cc", "ws.cc" ]
     }
   ]
 }
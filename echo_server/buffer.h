@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace echo_server {
+
+//
+// Growable byte buffer allocated with malloc. A zero initialized buffer is
+// empty and owns no memory. Ownership of [data] may be taken over by setting
+// it to NULL (as is done when it is handed to [write_connection]).
+//
+struct buffer
+{
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+
+inline bool buffer_reserve(buffer *b, size_t extra)
+{
+  // Makes room for at least [extra] more bytes. Returns false if out of
+  // memory.
+
+  if (b->cap - b->len >= extra) return true;
+
+  size_t cap = b->cap ? b->cap : 256;
+  while (cap - b->len < extra) cap *= 2;
+
+  char *data = reinterpret_cast<char *>(::realloc(b->data, cap));
+  if (!data) return false;
+
+  b->data = data;
+  b->cap = cap;
+  return true;
+}
+
+
+inline bool buffer_append(buffer *b, const char *data, size_t len)
+{
+  if (!buffer_reserve(b, len)) return false;
+
+  ::memcpy(b->data + b->len, data, len);
+  b->len += len;
+  return true;
+}
+
+
+inline void buffer_consume(buffer *b, size_t len)
+{
+  // Drops the first [len] bytes.
+
+  ::memmove(b->data, b->data + len, b->len - len);
+  b->len -= len;
+}
+
+
+inline void buffer_free(buffer *b)
+{
+  ::free(b->data);
+  b->data = NULL;
+  b->len = 0;
+  b->cap = 0;
+}
+
+
+//
+// Immutable bytes shared by several writes, possibly on several threads, and
+// freed when the last reference is released.
+//
+struct shared_buffer
+{
+  size_t refs;
+  char *data;
+  size_t len;
+};
+
+// Shared buffers not freed yet, on all threads.
+inline size_t shared_buffer_count = 0;
+
+
+inline shared_buffer *shared_buffer_new(buffer *b)
+{
+  // Takes over the data of [b], which is left empty, with one reference.
+  // Returns NULL if out of memory, [b] then being unchanged.
+
+  shared_buffer *sb =
+    reinterpret_cast<shared_buffer *>(::malloc(sizeof(shared_buffer)));
+  if (!sb) return NULL;
+
+  sb->refs = 1;
+  sb->data = b->data;
+  sb->len = b->len;
+  __atomic_add_fetch(&shared_buffer_count, 1, __ATOMIC_RELAXED);
+
+  b->data = NULL;
+  b->len = 0;
+  b->cap = 0;
+  return sb;
+}
+
+
+inline void shared_buffer_ref(shared_buffer *sb)
+{
+  __atomic_add_fetch(&sb->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+inline void shared_buffer_unref(shared_buffer *sb)
+{
+  if (__atomic_sub_fetch(&sb->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+  ::free(sb->data);
+  ::free(sb);
+  __atomic_sub_fetch(&shared_buffer_count, 1, __ATOMIC_RELAXED);
+}
+
+} // namespace echo_server
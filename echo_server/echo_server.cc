@@ -1,250 +1,4917 @@
 
 #include <node.h>
+#include <node_buffer.h>
 #include <uv.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "http.h"
+#include "kv_shards.h"
+#include "resp.h"
+#include "ws.h"
 
 
 namespace echo_server {
 
 
-static uv_tcp_t server_;
+//
+// What the server does with the data it reads.
+//
+//   MODE_ECHO: Writes it back.
+//   MODE_RESP: Executes it as RESP (Redis protocol) commands against the
+//     in-memory key-value store [store_] shared by all workers, see resp.h.
+//   MODE_HTTP: Answers it as HTTP/1.1 GET requests with the responses set
+//     by [set_response], see http.h.
+//   MODE_WS: Reads it as WebSocket frames and passes the messages to
+//     JavaScript, see ws.h.
+//   MODE_PROXY: Relays it to and from an upstream server, see [upstream].
+//
+enum
+{
+  MODE_ECHO,
+  MODE_RESP,
+  MODE_HTTP,
+  MODE_WS,
+  MODE_PROXY,
+};
+
+static const char *const modes[] = {
+  "echo", "resp", "http", "ws", "proxy", NULL
+};
+
+static int mode_ = MODE_ECHO;
+
+static kv_shards store_;
+
+static kv_shards responses_; // Formatted HTTP responses by path.
+
+//
+// Largest incomplete request kept for a connection in modes that parse what
+// is read. A connection sending a larger request is shut down.
+//
+static const size_t max_request_size = 64 * 1024 * 1024;
+
+
+//
+// Error log.
+//
+// [error] is called from the callbacks of all workers, so it must not block
+// on stderr, and a burst of failing connections must not turn into a burst
+// of writes. It only queues the message, under [log_mutex_], and
+// [log_thread_] writes the queue out in the background, a batch at a time.
+//
+// Messages are rate limited by prefix and error code: at most [log_burst]
+// messages with the same key are queued per [log_interval]. The others are
+// only counted, and the count is queued as a summary once the interval is
+// over. Keys are kept in the fixed [log_keys_], where a key replaces the one
+// in its slot after queuing its summary.
+//
+// With a log listener registered, see [on], the batches are passed to
+// JavaScript through [log_async_] instead of being written to stderr.
+//
+
+static const size_t log_burst = 10;
+static const uint64_t log_interval = 1000000000; // Nanoseconds.
+static const size_t log_key_count = 64;
+static const size_t log_capacity = 1024; // Messages queued; more are dropped.
+
+struct log_key
+{
+  const char *prefix;
+  int status;
+  uint64_t interval_start; // uv_hrtime() in nanoseconds.
+  size_t count;            // Messages queued during the interval.
+  uint64_t suppressed;     // Messages not queued during the interval.
+};
+
+struct log_message
+{
+  const char *prefix; // A string literal.
+  int status;
+  uint64_t suppressed; // 0, or a summary of that many messages.
+};
+
+struct log_batch
+{
+  log_batch *next;
+  uint64_t dropped; // Messages dropped before the batch was taken.
+  size_t len;
+  log_message messages[log_capacity];
+};
+
+static uv_mutex_t log_mutex_; // Guards everything below.
+static uv_cond_t log_cond_;   // Signals that the queue is not empty.
+static log_key log_keys_[log_key_count];
+static log_message log_queue_[log_capacity]; // Ring.
+static size_t log_head_ = 0;
+static size_t log_len_ = 0;
+static uint64_t log_dropped_ = 0;
+static bool log_to_js_ = false;        // A log listener is registered.
+static log_batch *log_batches_ = NULL; // For JavaScript, newest first.
+
+static bool log_stopping_ = false;     // [stop_log] was called.
+
+static uv_thread_t log_thread_;
+static bool log_started_ = false; // Only used on the Node.js thread.
+static uv_async_t log_async_;
+
+
+static void queue_log(const char *prefix, int status, uint64_t suppressed)
+{
+  if (log_len_ == log_capacity)
+  {
+    ++log_dropped_;
+    return;
+  }
+
+  log_message *m = &log_queue_[(log_head_ + log_len_) % log_capacity];
+  m->prefix = prefix;
+  m->status = status;
+  m->suppressed = suppressed;
+
+  if (log_len_++ == 0) uv_cond_signal(&log_cond_);
+}
+
+
+static void end_log_interval(log_key *k)
+{
+  if (k->suppressed != 0)
+  {
+    queue_log(k->prefix, k->status, k->suppressed);
+    k->suppressed = 0;
+  }
+
+  k->count = 0;
+}
+
+
+static void error(const char *prefix, int status)
+{
+  // Logs [prefix] and the description of the libuv error [status]. [prefix]
+  // must be a string literal.
+
+  uint64_t now = uv_hrtime();
+  size_t slot =
+    ((reinterpret_cast<uintptr_t>(prefix) >> 3) * 31 +
+     static_cast<unsigned>(status)) % log_key_count;
+
+  uv_mutex_lock(&log_mutex_);
+
+  log_key *k = &log_keys_[slot];
+  if (k->prefix != prefix || k->status != status ||
+      now - k->interval_start >= log_interval)
+  {
+    end_log_interval(k);
+    k->prefix = prefix;
+    k->status = status;
+    k->interval_start = now;
+  }
+
+  if (k->count < log_burst)
+  {
+    ++k->count;
+    queue_log(prefix, status, 0);
+  }
+  else
+  {
+    ++k->suppressed;
+  }
+
+  uv_mutex_unlock(&log_mutex_);
+}
+
+
+static int format_log(const log_message *m, char *out, size_t size)
+{
+  if (m->suppressed == 0)
+    return ::snprintf(out, size, "%s: %s.", m->prefix, uv_strerror(m->status));
+
+  return ::snprintf(
+    out, size, "%s: %s (%llu more suppressed).", m->prefix,
+    uv_strerror(m->status), static_cast<unsigned long long>(m->suppressed));
+}
+
+
+static int format_dropped(uint64_t dropped, char *out, size_t size)
+{
+  return ::snprintf(
+    out, size, "Error log: %llu messages dropped.",
+    static_cast<unsigned long long>(dropped));
+}
+
+
+static void write_log(const log_batch *b)
+{
+  // Writes [b] to stderr with as few writes as fit.
+
+  char text[16 * 1024];
+  size_t len = 0;
+
+  for (size_t i = 0; i <= b->len; ++i)
+  {
+    if (i == b->len && b->dropped == 0) break;
+
+    char line[512];
+    int n = i < b->len
+      ? format_log(&b->messages[i], line, sizeof(line) - 1)
+      : format_dropped(b->dropped, line, sizeof(line) - 1);
+    if (n < 0) continue;
+    if (static_cast<size_t>(n) > sizeof(line) - 2) n = sizeof(line) - 2;
+    line[n++] = '\n';
+
+    if (len + n > sizeof(text))
+    {
+      ::fwrite(text, 1, len, stderr);
+      len = 0;
+    }
+
+    ::memcpy(text + len, line, n);
+    len += n;
+  }
+
+  if (len != 0) ::fwrite(text, 1, len, stderr);
+}
+
+
+static bool take_log(log_batch *b)
+{
+  // Moves the queue to [b], first queuing the summaries of the intervals
+  // that are over. Returns false if there is nothing to log.
+
+  uint64_t now = uv_hrtime();
+  for (size_t i = 0; i < log_key_count; ++i)
+  {
+    log_key *k = &log_keys_[i];
+    if (k->suppressed != 0 && now - k->interval_start >= log_interval)
+      end_log_interval(k);
+  }
+
+  b->next = NULL;
+  b->dropped = log_dropped_;
+  b->len = log_len_;
+  for (size_t i = 0; i < log_len_; ++i)
+    b->messages[i] = log_queue_[(log_head_ + i) % log_capacity];
+
+  log_head_ = (log_head_ + log_len_) % log_capacity;
+  log_len_ = 0;
+  log_dropped_ = 0;
+
+  return b->len != 0 || b->dropped != 0;
+}
+
+
+static void log_thread_cb(void *arg)
+{
+  // Runs until [stop_log]. Wakes up when messages are queued and once per
+  // [log_interval] for the summaries.
+
+  log_batch *b = NULL;
+
+  uv_mutex_lock(&log_mutex_);
+
+  while (!log_stopping_)
+  {
+    if (!b) b = reinterpret_cast<log_batch *>(::malloc(sizeof(log_batch)));
+
+    if (log_len_ == 0 || !b)
+      uv_cond_timedwait(&log_cond_, &log_mutex_, log_interval);
+
+    if (log_stopping_ || !b || !take_log(b)) continue;
+
+    if (log_to_js_)
+    {
+      b->next = log_batches_;
+      log_batches_ = b;
+      b = NULL;
+      uv_async_send(&log_async_);
+      continue;
+    }
+
+    uv_mutex_unlock(&log_mutex_);
+    write_log(b);
+    uv_mutex_lock(&log_mutex_);
+  }
+
+  uv_mutex_unlock(&log_mutex_);
+  ::free(b);
+}
+
+
+static int start_log()
+{
+  // Called by [start]. Messages logged before stay queued until then.
+
+  if (log_started_) return 0;
+
+  int r = uv_thread_create(&log_thread_, log_thread_cb, NULL);
+  log_started_ = r == 0;
+  return r;
+}
+
+
+static log_batch *take_log_batches()
+{
+  // Takes the batches queued for JavaScript, oldest first.
+
+  uv_mutex_lock(&log_mutex_);
+  log_batch *newest = log_batches_;
+  log_batches_ = NULL;
+  uv_mutex_unlock(&log_mutex_);
+
+  log_batch *oldest = NULL;
+  while (newest)
+  {
+    log_batch *b = newest;
+    newest = b->next;
+    b->next = oldest;
+    oldest = b;
+  }
+
+  return oldest;
+}
+
+
+static void stop_log(void *arg)
+{
+  // Environment cleanup hook. Stops [log_thread_] and writes out what is
+  // still queued, as JavaScript can no longer be called.
+
+  uv_mutex_lock(&log_mutex_);
+  log_stopping_ = true;
+  uv_cond_signal(&log_cond_);
+  uv_mutex_unlock(&log_mutex_);
+
+  if (log_started_) uv_thread_join(&log_thread_);
+  log_started_ = false;
+
+  for (log_batch *b = take_log_batches(); b; )
+  {
+    log_batch *next = b->next;
+    write_log(b);
+    ::free(b);
+    b = next;
+  }
+
+  uv_mutex_lock(&log_mutex_);
+
+  log_batch *b = reinterpret_cast<log_batch *>(::malloc(sizeof(log_batch)));
+  if (b && take_log(b)) write_log(b);
+  ::free(b);
+
+  uv_mutex_unlock(&log_mutex_);
+}
+
+
+//
+// Minimal intrusive doubly linked list. A [list_node] is embedded in the
+// structure that is linked and [container_of] is used to get back to the
+// structure. The list head is a [list_node] that links to itself when empty.
+//
+
+struct list_node
+{
+  list_node *prev;
+  list_node *next;
+};
+
+#define container_of(ptr, type, member) \
+  reinterpret_cast<type *>( \
+    reinterpret_cast<char *>(ptr) - offsetof(type, member))
+
+
+static void list_init(list_node *head)
+{
+  head->prev = head;
+  head->next = head;
+}
+
+
+static bool list_empty(const list_node *head)
+{
+  return head->next == head;
+}
+
+
+static void list_push_back(list_node *head, list_node *node)
+{
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+
+static void list_remove(list_node *node)
+{
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  list_init(node);
+}
+
+
+//
+// Read fairness.
+//
+// libuv keeps reading from a readable connection until the socket would block
+// (or it has done a fixed number of reads), so a single client uploading in
+// bulk can hold on to a whole loop iteration while other clients wait. Each
+// connection is therefore given a budget of [limits_.read_budget] bytes per
+// loop iteration. A connection that has used up its budget stops reading and
+// is put last in [worker::throttled]. [worker::check] runs once per iteration,
+// after I/O has been polled, and resumes the throttled connections in the
+// order they were throttled.
+//
+
+
+//
+// Rate limiting.
+//
+// Token buckets limit the bytes and the messages (in echo mode every read is
+// a message) that are read per second, both per connection and for the server
+// as a whole. Reading a message takes its tokens even if that puts a bucket in
+// debt; a connection with a bucket in debt stops reading and is put in
+// [worker::rate_limited] until [worker::rate_timer] finds that the debt has
+// been paid off. Nothing read is ever dropped.
+//
+// The server buckets are only checked when a connection reads, so when they
+// run dry every connection that is reading may still complete one more read
+// before it is paused. With several workers, each has its own server buckets
+// with an equal share of the server rates.
+//
+
+struct rate_limit
+{
+  double rate;  // Tokens per second. 0 for no limit.
+  double burst; // Bucket capacity.
+};
+
+struct token_bucket
+{
+  double tokens;
+  uint64_t updated; // uv_now() when [tokens] was last refilled.
+};
+
+
+//
+// Connection cap.
+//
+// Every accepted connection costs a file descriptor and memory, so a flood of
+// connections could exhaust the process. When [limits_.max_connections] are
+// open the server becomes overloaded and stays so until the number of open
+// connections has fallen below [limits_.connections_low_watermark]. What
+// happens to connections arriving while overloaded depends on the policy:
+//
+//   OVERLOAD_PAUSE: They are not accepted. Not accepting in [connection_cb]
+//     makes libuv stop polling the listening socket, which leaves new
+//     connections in the kernel backlog. [worker::accept_pending] records
+//     that libuv has one connection waiting for [uv_accept].
+//   OVERLOAD_CLOSE: They are accepted and closed immediately.
+//
+// With several workers, each enforces an equal share of the limits.
+//
+
+enum
+{
+  OVERLOAD_PAUSE,
+  OVERLOAD_CLOSE,
+};
+
+static const char *const overload_policies[] = { "pause", "close", NULL };
+
+
+//
+// Slow subscribers.
+//
+// A message published to a channel, or broadcast to WebSocket connections,
+// is not written to a subscriber that already has more than
+// [limits_.max_subscriber_queued_bytes] queued for writing. What happens
+// instead depends on the policy:
+//
+//   SLOW_SUBSCRIBER_SKIP: The subscriber misses the message.
+//   SLOW_SUBSCRIBER_DROP: The subscriber is closed.
+//
+
+enum
+{
+  SLOW_SUBSCRIBER_SKIP,
+  SLOW_SUBSCRIBER_DROP,
+};
+
+static const char *const slow_subscriber_policies[] = { "skip", "drop", NULL };
+
+
+//
+// Limits that can be changed at runtime with [set_limits]. Workers have their
+// own copy of their share of the limits, see [share_limits].
+//
+static struct server_limits
+{
+  // Bytes a connection may read per loop iteration. 0 for no limit.
+  size_t read_budget;
+
+  rate_limit connection_bytes;
+  rate_limit connection_messages;
+  rate_limit server_bytes;
+  rate_limit server_messages;
+
+  // Open connections at which the server stops accepting. 0 for no limit.
+  size_t max_connections;
+
+  // Accepting is resumed when fewer connections than this are open. 0 for
+  // [max_connections].
+  size_t connections_low_watermark;
+
+  int overload_policy; // OVERLOAD_*
+
+  // Milliseconds the oldest pending write of a connection may wait before the
+  // connection is evicted. 0 for no limit.
+  uint64_t write_timeout;
+
+  // Bytes that may be queued for writing to a connection, and the number of
+  // milliseconds the connection may stay over that before it is evicted. 0
+  // for no limit.
+  size_t max_queued_bytes;
+  uint64_t max_queued_time;
+
+  // Bytes that may be queued for writing to a subscriber for it to be sent
+  // published messages. 0 for no limit.
+  size_t max_subscriber_queued_bytes;
+
+  int slow_subscriber_policy; // SLOW_SUBSCRIBER_*
+} limits_ = {
+  256 * 1024,
+  { 0, 0 },
+  { 0, 0 },
+  { 0, 0 },
+  { 0, 0 },
+  0,
+  0,
+  OVERLOAD_PAUSE,
+  0,
+  0,
+  0,
+  0,
+  SLOW_SUBSCRIBER_SKIP,
+};
+
+
+static uv_mutex_t limits_mutex_; // Guards [limits_] once started.
+
+
+//
+// Server statistics. Summed over the workers by [stats], and readable by
+// JavaScript without any call through [stats_buffer].
+//
+// Each worker counts in its own [worker::stats], which only its thread
+// touches, with plain increments. Once per loop iteration, before the loop
+// waits for I/O, [publish_stats] copies the counters that have changed to the
+// worker's row of [stats_rows_], which is what other threads read. Readers
+// thus never share a cache line with the counters as they are incremented,
+// and the rows of different workers are on different cache lines.
+//
+// A row is published under a sequence lock: its [stats_row::sequence] is odd
+// while it is being written. [read_stats_row] retries until it has read a row
+// with the same even sequence before and after, so each row it returns is
+// the counts of a worker at one point in time. Neither side ever blocks.
+//
+struct server_stats
+{
+  uint64_t connections;    // Currently open client connections.
+  uint64_t throttled;      // Times a connection used up its read budget.
+  uint64_t rate_limited;   // Times a connection was paused by a rate limit.
+  uint64_t overloaded;     // Times [limits_.max_connections] has been reached.
+  uint64_t rejected;       // Connections closed by OVERLOAD_CLOSE.
+  uint64_t evicted;        // Connections closed for not reading fast enough.
+  uint64_t skipped;        // Messages not written to slow subscribers.
+  uint64_t dropped;        // Slow subscribers closed.
+  uint64_t pooled;         // Idle upstream connections.
+  uint64_t upstream_errors; // Failed upstream connects, reads and writes.
+  uint64_t bytes_read;     // From clients.
+  uint64_t bytes_written;  // To clients.
+};
+
+static const struct
+{
+  const char *name;
+  size_t offset;
+} stat_fields[] = {
+  { "connections", offsetof(server_stats, connections) },
+  { "throttled", offsetof(server_stats, throttled) },
+  { "rateLimited", offsetof(server_stats, rate_limited) },
+  { "overloaded", offsetof(server_stats, overloaded) },
+  { "rejected", offsetof(server_stats, rejected) },
+  { "evicted", offsetof(server_stats, evicted) },
+  { "skipped", offsetof(server_stats, skipped) },
+  { "dropped", offsetof(server_stats, dropped) },
+  { "pooled", offsetof(server_stats, pooled) },
+  { "upstreamErrors", offsetof(server_stats, upstream_errors) },
+  { "bytesRead", offsetof(server_stats, bytes_read) },
+  { "bytesWritten", offsetof(server_stats, bytes_written) },
+};
+
+//
+// Writes to clients by the milliseconds from being queued to completing.
+// Bucket 0 counts writes that took less than 1 ms and bucket i > 0 those that
+// took from 2^(i-1) up to 2^i ms, the last bucket also counting longer ones.
+//
+static const size_t write_latency_buckets = 16;
+
+struct alignas(64) stats_row
+{
+  uint64_t sequence;
+  server_stats counters;
+  uint64_t write_latency[write_latency_buckets];
+};
+
+static stats_row *stats_rows_ = NULL; // One per worker.
+
+
+static void stat_add(uint64_t *counter, int64_t n)
+{
+  // Only called by the worker that owns [counter].
+
+  *counter += n;
+}
+
+
+static void publish_row(stats_row *row,
+                        const server_stats *counters,
+                        const uint64_t *write_latency)
+{
+  // Writes [counters] and [write_latency] to [row]. The relaxed atomic stores
+  // are ordered by the fences with respect to the odd and even sequence.
+
+  uint64_t sequence = row->sequence;
+  __atomic_store_n(&row->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  const uint64_t *from = reinterpret_cast<const uint64_t *>(counters);
+  uint64_t *to = reinterpret_cast<uint64_t *>(&row->counters);
+  for (size_t i = 0; i < sizeof(server_stats) / sizeof(uint64_t); ++i)
+    __atomic_store_n(&to[i], from[i], __ATOMIC_RELAXED);
+
+  for (size_t i = 0; i < write_latency_buckets; ++i)
+  {
+    __atomic_store_n(
+      &row->write_latency[i], write_latency[i], __ATOMIC_RELAXED);
+  }
+
+  __atomic_store_n(&row->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+
+static void read_stats_row(const stats_row *row, stats_row *snapshot)
+{
+  // Copies a consistent [row] to [snapshot], see [server_stats].
+
+  const size_t n = sizeof(stats_row) / sizeof(uint64_t);
+  const uint64_t *from = reinterpret_cast<const uint64_t *>(row);
+  uint64_t *to = reinterpret_cast<uint64_t *>(snapshot);
+
+  for (;;)
+  {
+    uint64_t sequence = __atomic_load_n(&row->sequence, __ATOMIC_ACQUIRE);
+
+    if ((sequence & 1) == 0)
+    {
+      for (size_t i = 1; i < n; ++i)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&row->sequence, __ATOMIC_RELAXED) == sequence)
+      {
+        to[0] = sequence;
+        return;
+      }
+    }
+
+    uv_sleep(0);
+  }
+}
+
+
+static uint64_t stat_field(const server_stats *stats, size_t i)
+{
+  return *reinterpret_cast<const uint64_t *>(
+    reinterpret_cast<const char *>(stats) + stat_fields[i].offset);
+}
+
+
+//
+// JavaScript events. Listeners are registered with [on].
+//
+
+enum
+{
+  EVENT_EVICT,
+  EVENT_MESSAGES,
+  EVENT_LOG,
+  EVENT_COUNT
+};
+
+static const char *const event_names[] = {
+  "evict", "messages", "log", NULL
+};
+
+static v8::Isolate *isolate_ = NULL;
+static v8::Persistent<v8::Context> context_;
+static v8::Persistent<v8::Function> listeners_[EVENT_COUNT];
+
+
+static void emit(int event, int argc, v8::Local<v8::Value> argv[])
+{
+  // Calls the listener of [event], if any. Must be called from the loop
+  // thread with a handle scope and the context of [context_] entered.
+
+  if (listeners_[event].IsEmpty()) return;
+
+  v8::Local<v8::Function> listener =
+    v8::Local<v8::Function>::New(isolate_, listeners_[event]);
+  node::MakeCallback(
+    isolate_, isolate_->GetCurrentContext()->Global(), listener, argc, argv,
+    node::async_context{0, 0});
+}
+
+
+//
+// Slow consumers.
+//
+// Data queued for writing to a client that does not read it stays in memory
+// for as long as the client lets it. [worker::evict_timer] periodically goes
+// through the connections that have pending writes and evicts (closes) those
+// whose oldest write has been pending longer than [limits_.write_timeout] or
+// that have had more than [limits_.max_queued_bytes] queued for longer than
+// [limits_.max_queued_time].
+//
+// Evictions are reported to JavaScript from the Node.js loop: workers queue
+// them in [evictions_] and signal [events_async_].
+//
+// So are WebSocket messages. Each worker collects the messages read during a
+// loop iteration and queues them in [messages_] all at once from [check_cb],
+// so that JavaScript is called once per batch rather than per message.
+//
+
+struct eviction
+{
+  eviction *next;
+  uint64_t id;
+  const char *reason;
+  uint64_t queued_bytes;
+  uint64_t oldest_write_age;
+};
+
+struct ws_message
+{
+  ws_message *next;
+  uint64_t id; // Of the connection.
+  bool binary;
+  size_t len;
+
+  char *data() { return reinterpret_cast<char *>(this + 1); }
+};
+
+struct message_queue
+{
+  ws_message *head;
+  ws_message **tail;
+};
+
+static uv_mutex_t events_mutex_; // Guards [evictions_] and [messages_].
+static eviction *evictions_ = NULL; // Newest first.
+static message_queue messages_;
+static uv_async_t events_async_;
+
+
+static void message_queue_init(message_queue *q)
+{
+  q->head = NULL;
+  q->tail = &q->head;
+}
+
+
+static void message_queue_splice(message_queue *to, message_queue *from)
+{
+  // Moves the messages of [from] to the end of [to].
+
+  if (!from->head) return;
+
+  *to->tail = from->head;
+  to->tail = from->tail;
+  message_queue_init(from);
+}
+
+
+//
+// Workers.
+//
+// A worker is an event loop serving connections. Worker 0 runs on the Node.js
+// loop. With the threads option, the others run a loop each on their own
+// thread. All workers then listen on the port with SO_REUSEPORT, which makes
+// the kernel spread incoming connections across them. A connection stays with
+// the worker that accepted it.
+//
+// Workers only touch their own state, apart from [store_] which is safe to
+// share, [limits_] which they copy under [limits_mutex_] when signalled
+// through [worker::wakeup], the queues of events and [worker::outbox].
+//
+// Connection ids are assigned by the workers without coordination: worker i
+// of n assigns i + 1, i + 1 + n, i + 1 + 2n and so on. The worker of a
+// connection can therefore be told from its id.
+//
+struct delivery;
+struct upstream;
+struct trace_event;
+
+struct alignas(64) worker
+{
+  size_t index;
+  uv_loop_t *loop;
+  uv_thread_t thread;
+  uv_tcp_t server;
+  uv_async_t wakeup; // Signals that [limits_] or [listening_] has changed.
+
+  uint64_t next_id; // Of the next connection accepted.
+
+  server_limits limits; // This worker's share of [limits_].
+  // Statistics, only touched by the worker's thread and published to its row
+  // of [stats_rows_] by [publish_stats]. Kept on cache lines of their own.
+  alignas(64) server_stats stats;
+  uint64_t write_latency[write_latency_buckets];
+  uv_prepare_t publish;
+
+  // Flight recorder, see [trace_event].
+  trace_event *trace; // Ring of [trace_size_] events.
+  uint64_t trace_head; // Events ever recorded.
+
+  // Read fairness.
+  alignas(64) uv_check_t check;
+
+  // Incremented by [check_cb] once per loop iteration. Connections use it to
+  // tell if their [connection::budget_used] refers to the current iteration.
+  uint64_t iteration;
+
+  list_node throttled;
+
+  // Rate limiting.
+  uv_timer_t rate_timer;
+  list_node rate_limited;
+  token_bucket server_bytes;
+  token_bucket server_messages;
+
+  // Connection cap.
+  bool overloaded;
+  bool accept_pending;
+
+  // Slow consumers.
+  uv_timer_t evict_timer;
+  list_node writing; // Connections with pending writes.
+
+  // WebSocket.
+  list_node websockets;   // Open WebSocket connections.
+  kv_store websocket_ids; // Open WebSocket connections by id.
+  message_queue batch;    // Messages read in this loop iteration.
+
+  // Pub/sub.
+  kv_store channels; // Channels with subscribers on this worker by name.
+
+  // Writes queued by JavaScript and other workers.
+  uv_async_t outbox_async;
+  uv_mutex_t outbox_mutex;
+  delivery *outbox;
+  delivery **outbox_tail;
+
+  // Proxy.
+  list_node pool;          // Idle upstream connections.
+  size_t pool_size;        // Upstream connections wanted in [pool].
+  size_t pool_connecting;  // Upstream connections connecting for [pool].
+  uv_timer_t pool_timer;   // Refills [pool] after a failure.
+};
+
+//
+// We use [worker_count_] != 0 to indicate that the echo server already has
+// been started.
+//
+static worker *workers_ = NULL;
+static size_t worker_count_ = 0;
+
+//
+// Cleared by [stop_listening] to have the workers close their listening
+// sockets.
+//
+static bool listening_ = true;
+
+//
+// Posted by [start_workers] for each worker thread once all have been
+// created, so that no worker runs before the number of workers is settled.
+//
+static uv_sem_t workers_started_;
+
+
+//
+// Flight recorder.
+//
+// Each worker records the lifecycle of its connections as fixed-size binary
+// events in a ring of its own, [worker::trace], which keeps the last
+// [trace_size_] events. Recording an event is a few stores to memory that
+// only the worker's thread writes: no lock, system call or formatting.
+// JavaScript copies the rings out on demand with [trace] or [dump_trace],
+// also after the fact, for example once a connection has failed.
+//
+// [worker::trace_head] is stored with release order after the event it
+// counts. A reader copies the events before the head it loaded and then
+// loads the head again, dropping the events that the worker may have
+// overwritten in between.
+//
+enum
+{
+  TRACE_ACCEPT,
+  TRACE_READ,  // [trace_event::value] is the number of bytes read.
+  TRACE_WRITE, // Likewise written.
+  TRACE_ERROR, // [trace_event::value] is the libuv error code.
+  TRACE_CLOSE,
+};
+
+static const char *const trace_types[] = {
+  "accept", "read", "write", "error", "close", NULL
+};
+
+struct trace_event
+{
+  uint64_t time;       // uv_hrtime() in nanoseconds.
+  uint64_t connection; // [connection::id], or 0 for none.
+  int64_t value;
+  uint64_t type;       // TRACE_*.
+};
+
+static size_t trace_size_ = 0; // Events per worker, a power of two or 0.
+static trace_event *trace_events_ = NULL; // The rings of all workers.
+
+
+static void record(worker *w, unsigned type, uint64_t connection, int64_t value)
+{
+  if (trace_size_ == 0) return;
+
+  uint64_t head = w->trace_head;
+  trace_event *e = &w->trace[head & (trace_size_ - 1)];
+
+  __atomic_store_n(&e->time, uv_hrtime(), __ATOMIC_RELAXED);
+  __atomic_store_n(&e->connection, connection, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->value, value, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->type, type, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&w->trace_head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+static size_t copy_trace(const worker *w, trace_event *out)
+{
+  // Copies the events recorded by [w], oldest first, to [out], which has room
+  // for [trace_size_] events. Returns the number of events copied.
+
+  uint64_t head = __atomic_load_n(&w->trace_head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > trace_size_ ? head - trace_size_ : 0;
+
+  for (uint64_t i = first; i < head; ++i)
+  {
+    const trace_event *e = &w->trace[i & (trace_size_ - 1)];
+    trace_event *to = &out[i - first];
+
+    to->time = __atomic_load_n(&e->time, __ATOMIC_RELAXED);
+    to->connection = __atomic_load_n(&e->connection, __ATOMIC_RELAXED);
+    to->value = __atomic_load_n(&e->value, __ATOMIC_RELAXED);
+    to->type = __atomic_load_n(&e->type, __ATOMIC_RELAXED);
+  }
+
+  // The event being recorded when the head is loaded again overwrites the
+  // one [trace_size_] before it.
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint64_t now = __atomic_load_n(&w->trace_head, __ATOMIC_RELAXED);
+  uint64_t valid = now >= trace_size_ ? now - trace_size_ + 1 : 0;
+  if (valid <= first) return head - first;
+  if (valid >= head) return 0;
+
+  ::memmove(out, out + (valid - first), (head - valid) * sizeof(trace_event));
+  return head - valid;
+}
+
+
+//
+// Reasons for a connection to not be reading. A connection reads only when no
+// flag is set.
+//
+enum
+{
+  PAUSED_BUDGET = 1 << 0,
+  PAUSED_RATE = 1 << 1,
+  PAUSED_SHUTDOWN = 1 << 2,
+  PAUSED_UPSTREAM = 1 << 3, // Connecting or backed up, see [upstream].
+  PAUSED_EOF = 1 << 4,      // Read to its end while relaying.
+};
+
+
+//
+// Client connection. [tcp] must be the first member as we cast between
+// connection and uv_stream_t/uv_handle_t in the libuv callbacks.
+//
+struct connection
+{
+  uv_tcp_t tcp;
+  worker *w;
+
+  unsigned paused; // PAUSED_* flags.
+  bool closing;
+
+  // Bytes read during loop iteration [budget_iteration].
+  uint64_t budget_iteration;
+  size_t budget_used;
+
+  list_node throttled_link; // Linked into [worker::throttled] if throttled.
+
+  token_bucket bytes;
+  token_bucket messages;
+  list_node rate_link; // Linked into [worker::rate_limited] if rate limited.
+
+  uint64_t id; // Identifies the connection in JavaScript events.
+
+  list_node writes;       // Pending writes, oldest first.
+  list_node writing_link; // Linked into [worker::writing] if [writes] is not
+                          // empty.
+  size_t queued_bytes;    // Bytes in [writes].
+  uint64_t over_since;    // uv_now() when [queued_bytes] went over the limit.
+
+  // Start of a request that has not been read in full yet.
+  buffer pending;
+
+  ws_connection ws;
+  list_node ws_link; // Linked into [worker::websockets] once open.
+
+  list_node subscriptions; // Of this connection, see [subscription].
+  size_t subscription_count;
+
+  upstream *up; // Paired upstream connection in proxy mode.
+};
+
+
+static connection *to_connection(uv_stream_t *stream)
+{
+  return reinterpret_cast<connection *>(stream);
+}
+
+
+static size_t budget_remaining(connection *conn)
+{
+  worker *w = conn->w;
+
+  if (w->limits.read_budget == 0) return SIZE_MAX;
+
+  if (conn->budget_iteration != w->iteration)
+  {
+    conn->budget_iteration = w->iteration;
+    conn->budget_used = 0;
+  }
+
+  return conn->budget_used < w->limits.read_budget
+    ? w->limits.read_budget - conn->budget_used
+    : 0;
+}
+
+
+static void bucket_init(token_bucket *bucket,
+                        const rate_limit *limit,
+                        uint64_t now)
+{
+  bucket->tokens = limit->burst;
+  bucket->updated = now;
+}
+
+
+static void bucket_refill(token_bucket *bucket,
+                          const rate_limit *limit,
+                          uint64_t now)
+{
+  if (limit->rate != 0)
+  {
+    bucket->tokens += limit->rate * (now - bucket->updated) / 1000.0;
+    if (bucket->tokens > limit->burst) bucket->tokens = limit->burst;
+  }
+
+  bucket->updated = now;
+}
+
+
+static uint64_t bucket_wait(const token_bucket *bucket, const rate_limit *limit)
+{
+  // Returns the number of milliseconds until [bucket] is out of debt.
+
+  if (limit->rate == 0 || bucket->tokens >= 0) return 0;
+
+  return static_cast<uint64_t>(-bucket->tokens * 1000.0 / limit->rate) + 1;
+}
+
+
+static bool bucket_take(token_bucket *bucket,
+                        const rate_limit *limit,
+                        double tokens)
+{
+  // Returns false if [bucket] is in debt after taking [tokens].
+
+  if (limit->rate == 0) return true;
+
+  bucket->tokens -= tokens;
+  return bucket->tokens >= 0;
+}
+
+
+static uint64_t rate_wait(connection *conn, uint64_t now)
+{
+  // Refills the buckets that apply to [conn] and returns the number of
+  // milliseconds until none of them is in debt.
+
+  worker *w = conn->w;
+  const server_limits *l = &w->limits;
+
+  bucket_refill(&conn->bytes, &l->connection_bytes, now);
+  bucket_refill(&conn->messages, &l->connection_messages, now);
+  bucket_refill(&w->server_bytes, &l->server_bytes, now);
+  bucket_refill(&w->server_messages, &l->server_messages, now);
+
+  uint64_t waits[] = {
+    bucket_wait(&conn->bytes, &l->connection_bytes),
+    bucket_wait(&conn->messages, &l->connection_messages),
+    bucket_wait(&w->server_bytes, &l->server_bytes),
+    bucket_wait(&w->server_messages, &l->server_messages),
+  };
+
+  uint64_t wait = 0;
+  for (size_t i = 0; i < sizeof(waits) / sizeof(waits[0]); ++i)
+    if (waits[i] > wait) wait = waits[i];
+
+  return wait;
+}
+
+
+static bool charge(connection *conn, size_t bytes, size_t messages)
+{
+  // Takes [bytes] and [messages] from the buckets that apply to [conn].
+  // Returns false if the connection has to stop reading.
+
+  worker *w = conn->w;
+  const server_limits *l = &w->limits;
+  uint64_t now = uv_now(w->loop);
+
+  bucket_refill(&conn->bytes, &l->connection_bytes, now);
+  bucket_refill(&conn->messages, &l->connection_messages, now);
+  bucket_refill(&w->server_bytes, &l->server_bytes, now);
+  bucket_refill(&w->server_messages, &l->server_messages, now);
+
+  bool ok = true;
+  ok &= bucket_take(&conn->bytes, &l->connection_bytes, bytes);
+  ok &= bucket_take(&conn->messages, &l->connection_messages, messages);
+  ok &= bucket_take(&w->server_bytes, &l->server_bytes, bytes);
+  ok &= bucket_take(&w->server_messages, &l->server_messages, messages);
+
+  return ok;
+}
+
+
+static void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
+{
+  // Allocates a buffer to read input into. Buffer is then passed to [read_cb].
+  // Buffer is not reused but is always released on call to [read_cb].
+  //
+  // [suggested_size] is just advisory (usually 64 KiB). We can allocate a
+  // smaller or a larger size. We never allocate more than what is left of the
+  // read budget of the connection so that it is not overrun by more than what
+  // is needed.
+  //
+  // If the allocation fails ([buf]->base == NULL) and error is passed to
+  // read_cb regardless of what size we set.
+
+  size_t remaining =
+    budget_remaining(to_connection(reinterpret_cast<uv_stream_t *>(handle)));
+  if (remaining > 0 && remaining < suggested_size) suggested_size = remaining;
+
+  *buf = uv_buf_init(
+    reinterpret_cast<char *>(::malloc(suggested_size)), suggested_size
+    );
+}
+
+
+static void relay_drained(connection *conn);
+
+
+struct write_data
+{
+  uv_write_t req;
+  uv_buf_t buf;
+  shared_buffer *shared; // Referenced by [buf] if not NULL.
+
+  connection *conn;
+  uint64_t submitted; // uv_now() when the write was queued.
+  list_node link;     // Linked into [connection::writes].
+};
+
+
+static void free_write_data(write_data *wd)
+{
+  if (wd->shared) shared_buffer_unref(wd->shared);
+  else ::free(wd->buf.base);
+
+  ::free(wd);
+}
+
+
+static void write_cb(uv_write_t *req, int status)
+{
+  // Called when data has been written to socket, or with UV_ECANCELED when
+  // the connection is closed before it could be written.
+
+  write_data *wd = reinterpret_cast<write_data *>(req->data);
+  connection *conn = wd->conn;
+
+  list_remove(&wd->link);
+  if (list_empty(&conn->writes)) list_remove(&conn->writing_link);
+
+  conn->queued_bytes -= wd->buf.len;
+  if (conn->queued_bytes <= conn->w->limits.max_queued_bytes)
+    conn->over_since = 0;
+
+  if (status == 0)
+  {
+    worker *w = conn->w;
+    uint64_t latency = uv_now(w->loop) - wd->submitted;
+    size_t bucket = latency == 0 ? 0 : 64 - __builtin_clzll(latency);
+    if (bucket >= write_latency_buckets) bucket = write_latency_buckets - 1;
+
+    stat_add(&w->write_latency[bucket], 1);
+    stat_add(&w->stats.bytes_written, wd->buf.len);
+    record(w, TRACE_WRITE, conn->id, wd->buf.len);
+  }
+  else
+  {
+    record(conn->w, TRACE_ERROR, conn->id, status);
+  }
+
+  free_write_data(wd);
+
+  if (status != 0 && status != UV_ECANCELED)
+    error("Error on writing client stream", status);
+
+  if (conn->up) relay_drained(conn);
+}
+
+
+static void submit_write(connection *conn, write_data *wd)
+{
+  // uv_write_t::data is used to keep state associated with the write
+  // operation.
+
+  size_t len = wd->buf.len;
+
+  wd->req.data = wd;
+  wd->conn = conn;
+  wd->submitted = uv_now(conn->w->loop);
+
+  int r = uv_write(
+    &wd->req, reinterpret_cast<uv_stream_t *>(conn), &wd->buf, 1, write_cb);
+  if (r == 0)
+  {
+    // Write is pending. [write_cb] will be called on write completed.
+
+    if (list_empty(&conn->writes))
+      list_push_back(&conn->w->writing, &conn->writing_link);
+    list_push_back(&conn->writes, &wd->link);
+
+    size_t max_queued_bytes = conn->w->limits.max_queued_bytes;
+    conn->queued_bytes += len;
+    if (max_queued_bytes != 0 && conn->queued_bytes > max_queued_bytes &&
+        conn->over_since == 0)
+      conn->over_since = wd->submitted;
+  }
+  else
+  {
+    // Write failed.
+    //
+    // Documentation is not explicit on this but assuming that there is no
+    // call to [write_cb]
+
+    free_write_data(wd);
+    record(conn->w, TRACE_ERROR, conn->id, r);
+    error("Error on writing client stream", r);
+  }
+}
+
+
+static void write_connection(connection *conn, char *data, size_t len)
+{
+  // Writes [data] to [conn]. [data] must have been allocated with malloc and
+  // is freed once written.
+
+  write_data *wd =
+    reinterpret_cast<write_data *>(::malloc(sizeof(write_data)));
+  wd->buf = uv_buf_init(data, len);
+  wd->shared = NULL;
+
+  submit_write(conn, wd);
+}
+
+
+static void write_shared(connection *conn, shared_buffer *sb)
+{
+  // Writes [sb] to [conn], holding a reference to it until written.
+
+  write_data *wd =
+    reinterpret_cast<write_data *>(::malloc(sizeof(write_data)));
+  wd->buf = uv_buf_init(sb->data, sb->len);
+  wd->shared = sb;
+  shared_buffer_ref(sb);
+
+  submit_write(conn, wd);
+}
+
+
+static void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t *in_buf);
+
+static void close_connection(connection *conn);
+
+
+static void pause_reading(connection *conn, unsigned reason)
+{
+  if (conn->paused == 0)
+    uv_read_stop(reinterpret_cast<uv_stream_t *>(conn));
+
+  conn->paused |= reason;
+}
+
+
+static void resume_reading(connection *conn, unsigned reason)
+{
+  if ((conn->paused & reason) == 0) return;
+
+  conn->paused &= ~reason;
+  if (conn->paused != 0 || conn->closing) return;
+
+  int r = uv_read_start(reinterpret_cast<uv_stream_t *>(conn), alloc_cb, read_cb);
+  if (r != 0)
+  {
+    // The connection would never be read again, so it is closed, as on a
+    // read error.
+
+    record(conn->w, TRACE_ERROR, conn->id, r);
+    error("Error on reading client stream", r);
+    close_connection(conn);
+  }
+}
+
+
+static void close_cb(uv_handle_t *handle)
+{
+  ::free(handle);
+}
+
+
+static void connection_close_cb(uv_handle_t *handle)
+{
+  connection *conn = reinterpret_cast<connection *>(handle);
+  buffer_free(&conn->pending);
+  ws_free(&conn->ws);
+  ::free(conn);
+}
+
+
+static void accept_connection(worker *w);
+
+
+static void update_overloaded(worker *w)
+{
+  // Leaves the overloaded state once there are few enough open connections,
+  // accepting the connection that libuv may be holding on to.
+
+  if (!w->overloaded) return;
+
+  size_t low_watermark = w->limits.connections_low_watermark != 0
+    ? w->limits.connections_low_watermark
+    : w->limits.max_connections;
+
+  if (w->limits.max_connections != 0 &&
+      w->stats.connections >= low_watermark)
+    return;
+
+  w->overloaded = false;
+
+  if (w->accept_pending)
+  {
+    w->accept_pending = false;
+    accept_connection(w);
+  }
+}
+
+
+//
+// Pub/sub.
+//
+// Each worker keeps the channels that its connections are subscribed to in
+// [worker::channels], which maps the name of a channel to its [channel]. A
+// message published on a worker is formatted once, into a [shared_buffer]
+// that is written to the subscribers on that worker and queued on every other
+// worker for theirs, see [publish_cb]. The reply to PUBLISH only counts the
+// subscribers on the worker of the publisher.
+//
+
+struct channel
+{
+  list_node subscribers; // [subscription::channel_link] of each subscriber.
+  size_t name_len;
+
+  char *name() { return reinterpret_cast<char *>(this + 1); }
+};
+
+struct subscription
+{
+  list_node channel_link;
+  list_node connection_link; // Linked into [connection::subscriptions].
+  connection *conn;
+  channel *ch;
+};
+
+
+static channel *find_channel(worker *w, const char *name, size_t len)
+{
+  const char *value;
+  size_t value_len;
+  if (!kv_get(&w->channels, kv_hash(name, len), name, len, &value, &value_len))
+    return NULL;
+
+  channel *ch;
+  ::memcpy(&ch, value, sizeof(ch));
+  return ch;
+}
+
+
+static void remove_subscription(subscription *s)
+{
+  // Removes [s], and its channel if it was the last subscriber.
+
+  connection *conn = s->conn;
+  channel *ch = s->ch;
+
+  list_remove(&s->channel_link);
+  list_remove(&s->connection_link);
+  --conn->subscription_count;
+  ::free(s);
+
+  if (list_empty(&ch->subscribers))
+  {
+    kv_del(
+      &conn->w->channels, kv_hash(ch->name(), ch->name_len),
+      ch->name(), ch->name_len);
+    ::free(ch);
+  }
+}
+
+
+static long long subscribe(connection *conn, const char *name, size_t len)
+{
+  // Subscribes [conn] to channel [name]. Returns the number of channels it is
+  // subscribed to, or -1 if out of memory.
+
+  worker *w = conn->w;
+
+  // A connection closed while executing its commands must not be left with
+  // subscriptions.
+
+  if (conn->closing) return conn->subscription_count;
+
+  channel *ch = find_channel(w, name, len);
+  if (ch)
+  {
+    for (list_node *node = conn->subscriptions.next;
+         node != &conn->subscriptions;
+         node = node->next)
+    {
+      if (container_of(node, subscription, connection_link)->ch == ch)
+        return conn->subscription_count;
+    }
+  }
+  else
+  {
+    ch = reinterpret_cast<channel *>(::malloc(sizeof(channel) + len));
+    if (!ch) return -1;
+
+    list_init(&ch->subscribers);
+    ch->name_len = len;
+    ::memcpy(ch->name(), name, len);
+
+    if (!kv_set(
+          &w->channels, kv_hash(name, len), name, len,
+          reinterpret_cast<char *>(&ch), sizeof(ch)))
+    {
+      ::free(ch);
+      return -1;
+    }
+  }
+
+  subscription *s =
+    reinterpret_cast<subscription *>(::malloc(sizeof(subscription)));
+  if (!s)
+  {
+    if (list_empty(&ch->subscribers))
+    {
+      kv_del(&w->channels, kv_hash(name, len), name, len);
+      ::free(ch);
+    }
+    return -1;
+  }
+
+  s->conn = conn;
+  s->ch = ch;
+  list_push_back(&ch->subscribers, &s->channel_link);
+  list_push_back(&conn->subscriptions, &s->connection_link);
+  return ++conn->subscription_count;
+}
+
+
+static long long unsubscribe(connection *conn, const char *name, size_t len)
+{
+  // Unsubscribes [conn] from channel [name]. Returns the number of channels
+  // it is still subscribed to.
+
+  for (list_node *node = conn->subscriptions.next;
+       node != &conn->subscriptions;
+       node = node->next)
+  {
+    subscription *s = container_of(node, subscription, connection_link);
+    if (s->ch->name_len == len && ::memcmp(s->ch->name(), name, len) == 0)
+    {
+      remove_subscription(s);
+      break;
+    }
+  }
+
+  return conn->subscription_count;
+}
+
+
+static void unsubscribe_all(connection *conn)
+{
+  while (!list_empty(&conn->subscriptions))
+  {
+    remove_subscription(
+      container_of(conn->subscriptions.next, subscription, connection_link));
+  }
+}
+
+
+static void close_upstream(upstream *up);
+
+
+static void close_connection(connection *conn)
+{
+  // The connection memory must stay valid until [close_cb] has been called.
+
+  if (conn->closing) return;
+
+  conn->closing = true;
+  list_remove(&conn->throttled_link);
+  list_remove(&conn->rate_link);
+  list_remove(&conn->writing_link);
+  stat_add(&conn->w->stats.connections, -1);
+  record(conn->w, TRACE_CLOSE, conn->id, 0);
+  unsubscribe_all(conn);
+  if (conn->up) close_upstream(conn->up);
+
+  if (!list_empty(&conn->ws_link))
+  {
+    list_remove(&conn->ws_link);
+    kv_del(
+      &conn->w->websocket_ids,
+      kv_hash(reinterpret_cast<char *>(&conn->id), sizeof(conn->id)),
+      reinterpret_cast<char *>(&conn->id), sizeof(conn->id));
+  }
+
+  uv_close(reinterpret_cast<uv_handle_t *>(conn), connection_close_cb);
+
+  update_overloaded(conn->w);
+}
+
+
+static void check_cb(uv_check_t *handle)
+{
+  // Called once per loop iteration after I/O has been polled. Starts a new
+  // budget period and resumes throttled connections, oldest first.
+
+  worker *w = reinterpret_cast<worker *>(handle->data);
+
+  ++w->iteration;
+
+  while (!list_empty(&w->throttled))
+  {
+    connection *conn =
+      container_of(w->throttled.next, connection, throttled_link);
+    list_remove(&conn->throttled_link);
+    resume_reading(conn, PAUSED_BUDGET);
+  }
+
+  // Hand the WebSocket messages read in this iteration over to JavaScript.
+
+  if (w->batch.head)
+  {
+    uv_mutex_lock(&events_mutex_);
+    message_queue_splice(&messages_, &w->batch);
+    uv_mutex_unlock(&events_mutex_);
+
+    uv_async_send(&events_async_);
+  }
+}
+
+
+static void rate_timer_cb(uv_timer_t *handle);
+
+
+static void schedule_rate_timer(worker *w, uint64_t wait)
+{
+  if (!uv_is_active(reinterpret_cast<uv_handle_t *>(&w->rate_timer)) ||
+      uv_timer_get_due_in(&w->rate_timer) > wait)
+    uv_timer_start(&w->rate_timer, rate_timer_cb, wait, 0);
+}
+
+
+static void rate_timer_cb(uv_timer_t *handle)
+{
+  // Resumes the rate limited connections that are no longer in debt and
+  // rearms the timer for the ones that still are.
+
+  worker *w = reinterpret_cast<worker *>(handle->data);
+  uint64_t now = uv_now(w->loop);
+  uint64_t next = UINT64_MAX;
+
+  list_node *node = w->rate_limited.next;
+  while (node != &w->rate_limited)
+  {
+    connection *conn = container_of(node, connection, rate_link);
+    node = node->next;
+
+    uint64_t wait = rate_wait(conn, now);
+    if (wait == 0)
+    {
+      list_remove(&conn->rate_link);
+      resume_reading(conn, PAUSED_RATE);
+    }
+    else if (wait < next)
+    {
+      next = wait;
+    }
+  }
+
+  if (next != UINT64_MAX)
+    uv_timer_start(&w->rate_timer, rate_timer_cb, next, 0);
+}
+
+
+static uint64_t evict_interval(const server_limits *l)
+{
+  // Checks for slow consumers a few times per shortest eviction time. Returns
+  // 0 if eviction is disabled.
+
+  uint64_t shortest = UINT64_MAX;
+  if (l->write_timeout != 0) shortest = l->write_timeout;
+  if (l->max_queued_bytes != 0 && l->max_queued_time < shortest)
+    shortest = l->max_queued_time;
+
+  if (shortest == UINT64_MAX) return 0;
+
+  return shortest < 40 ? 10 : shortest / 4;
+}
+
+
+static void post_eviction(connection *conn, const char *reason, uint64_t now)
+{
+  // Queues the eviction of [conn] to be reported by [events_async_cb].
+
+  write_data *oldest = container_of(conn->writes.next, write_data, link);
+
+  eviction *e = reinterpret_cast<eviction *>(::malloc(sizeof(eviction)));
+  e->id = conn->id;
+  e->reason = reason;
+  e->queued_bytes = conn->queued_bytes;
+  e->oldest_write_age = now - oldest->submitted;
+
+  uv_mutex_lock(&events_mutex_);
+  e->next = evictions_;
+  evictions_ = e;
+  uv_mutex_unlock(&events_mutex_);
+
+  uv_async_send(&events_async_);
+}
+
+
+static void emit_evict(const eviction *e)
+{
+  if (listeners_[EVENT_EVICT].IsEmpty()) return;
+
+  v8::HandleScope handle_scope(isolate_);
+  v8::Local<v8::Context> context =
+    v8::Local<v8::Context>::New(isolate_, context_);
+  v8::Context::Scope context_scope(context);
+
+  v8::Local<v8::Object> info = v8::Object::New(isolate_);
+  info->Set(
+    context,
+    v8::String::NewFromUtf8(isolate_, "id").ToLocalChecked(),
+    v8::Number::New(isolate_, static_cast<double>(e->id))
+    ).FromJust();
+  info->Set(
+    context,
+    v8::String::NewFromUtf8(isolate_, "reason").ToLocalChecked(),
+    v8::String::NewFromUtf8(isolate_, e->reason).ToLocalChecked()
+    ).FromJust();
+  info->Set(
+    context,
+    v8::String::NewFromUtf8(isolate_, "queuedBytes").ToLocalChecked(),
+    v8::Number::New(isolate_, static_cast<double>(e->queued_bytes))
+    ).FromJust();
+  info->Set(
+    context,
+    v8::String::NewFromUtf8(isolate_, "oldestWriteAge").ToLocalChecked(),
+    v8::Number::New(isolate_, static_cast<double>(e->oldest_write_age))
+    ).FromJust();
+
+  v8::Local<v8::Value> argv[] = { info };
+  emit(EVENT_EVICT, 1, argv);
+}
+
+
+static void free_message_cb(char *data, void *hint)
+{
+  ::free(hint);
+}
+
+
+static void emit_messages(ws_message *m)
+{
+  // Passes the messages in the list [m] to the listener in a single array of
+  // { id, data } objects, [data] being a string for text messages and a
+  // Buffer that takes over the memory of the message for binary ones.
+
+  if (listeners_[EVENT_MESSAGES].IsEmpty())
+  {
+    while (m)
+    {
+      ws_message *next = m->next;
+      ::free(m);
+      m = next;
+    }
+    return;
+  }
+
+  v8::HandleScope handle_scope(isolate_);
+  v8::Local<v8::Context> context =
+    v8::Local<v8::Context>::New(isolate_, context_);
+  v8::Context::Scope context_scope(context);
+
+  v8::Local<v8::String> id_name =
+    v8::String::NewFromUtf8(isolate_, "id").ToLocalChecked();
+  v8::Local<v8::String> data_name =
+    v8::String::NewFromUtf8(isolate_, "data").ToLocalChecked();
+
+  v8::Local<v8::Array> batch = v8::Array::New(isolate_);
+  uint32_t count = 0;
+
+  while (m)
+  {
+    ws_message *next = m->next;
+
+    v8::Local<v8::Value> data;
+    if (m->binary)
+    {
+      data = node::Buffer::New(
+        isolate_, m->data(), m->len, free_message_cb, m).ToLocalChecked();
+    }
+    else
+    {
+      data = v8::String::NewFromUtf8(
+        isolate_, m->data(), v8::NewStringType::kNormal, m->len
+        ).ToLocalChecked();
+    }
+
+    v8::Local<v8::Object> message = v8::Object::New(isolate_);
+    message->Set(
+      context, id_name, v8::Number::New(isolate_, static_cast<double>(m->id))
+      ).FromJust();
+    message->Set(context, data_name, data).FromJust();
+    batch->Set(context, count++, message).FromJust();
+
+    if (!m->binary) ::free(m);
+    m = next;
+  }
+
+  v8::Local<v8::Value> argv[] = { batch };
+  emit(EVENT_MESSAGES, 1, argv);
+}
+
+
+static void events_async_cb(uv_async_t *handle)
+{
+  // Runs on the Node.js loop. Reports the queued evictions, oldest first,
+  // and then the queued messages.
+
+  message_queue messages;
+  message_queue_init(&messages);
+
+  uv_mutex_lock(&events_mutex_);
+  eviction *newest = evictions_;
+  evictions_ = NULL;
+  message_queue_splice(&messages, &messages_);
+  uv_mutex_unlock(&events_mutex_);
+
+  eviction *oldest = NULL;
+  while (newest)
+  {
+    eviction *e = newest;
+    newest = e->next;
+    e->next = oldest;
+    oldest = e;
+  }
+
+  while (oldest)
+  {
+    eviction *e = oldest;
+    oldest = e->next;
+    emit_evict(e);
+    ::free(e);
+  }
+
+  if (messages.head) emit_messages(messages.head);
+}
+
+
+static void emit_log(const char *text, const char *code, uint64_t count)
+{
+  // Calls the log listener with { message, code, suppressed }, or with
+  // { message, dropped } if [code] is NULL.
+
+  v8::HandleScope handle_scope(isolate_);
+  v8::Local<v8::Context> context =
+    v8::Local<v8::Context>::New(isolate_, context_);
+  v8::Context::Scope context_scope(context);
+
+  v8::Local<v8::Object> info = v8::Object::New(isolate_);
+  info->Set(
+    context,
+    v8::String::NewFromUtf8(isolate_, "message").ToLocalChecked(),
+    v8::String::NewFromUtf8(isolate_, text).ToLocalChecked()
+    ).FromJust();
+  if (code)
+  {
+    info->Set(
+      context,
+      v8::String::NewFromUtf8(isolate_, "code").ToLocalChecked(),
+      v8::String::NewFromUtf8(isolate_, code).ToLocalChecked()
+      ).FromJust();
+  }
+  info->Set(
+    context,
+    v8::String::NewFromUtf8(
+      isolate_, code ? "suppressed" : "dropped").ToLocalChecked(),
+    v8::Number::New(isolate_, static_cast<double>(count))
+    ).FromJust();
+
+  v8::Local<v8::Value> argv[] = { info };
+  emit(EVENT_LOG, 1, argv);
+}
+
+
+static void log_async_cb(uv_async_t *handle)
+{
+  // Runs on the Node.js loop. Reports the batches taken by [log_thread_],
+  // oldest first. Batches taken before the listener was removed are written
+  // to stderr instead.
+
+  log_batch *oldest = take_log_batches();
+
+  while (oldest)
+  {
+    log_batch *b = oldest;
+    oldest = b->next;
+
+    if (listeners_[EVENT_LOG].IsEmpty())
+    {
+      write_log(b);
+    }
+    else
+    {
+      char line[512];
+
+      for (size_t i = 0; i < b->len; ++i)
+      {
+        const log_message *m = &b->messages[i];
+        if (format_log(m, line, sizeof(line)) >= 0)
+          emit_log(line, uv_err_name(m->status), m->suppressed);
+      }
+
+      if (b->dropped != 0 &&
+          format_dropped(b->dropped, line, sizeof(line)) >= 0)
+        emit_log(line, NULL, b->dropped);
+    }
+
+    ::free(b);
+  }
+}
+
+
+static void evict_timer_cb(uv_timer_t *handle)
+{
+  worker *w = reinterpret_cast<worker *>(handle->data);
+  const server_limits *l = &w->limits;
+  uint64_t now = uv_now(w->loop);
+
+  list_node *node = w->writing.next;
+  while (node != &w->writing)
+  {
+    connection *conn = container_of(node, connection, writing_link);
+    node = node->next;
+
+    write_data *oldest = container_of(conn->writes.next, write_data, link);
+
+    const char *reason = NULL;
+    if (l->write_timeout != 0 && now - oldest->submitted > l->write_timeout)
+      reason = "writeTimeout";
+    else if (l->max_queued_bytes != 0 && conn->over_since != 0 &&
+             now - conn->over_since > l->max_queued_time)
+      reason = "maxQueuedBytes";
+
+    if (reason)
+    {
+      stat_add(&w->stats.evicted, 1);
+      post_eviction(conn, reason, now);
+      close_connection(conn);
+    }
+  }
+
+  uint64_t interval = evict_interval(l);
+  if (interval != 0)
+    uv_timer_start(&w->evict_timer, evict_timer_cb, interval, 0);
+}
+
+
+static void shutdown_cb(uv_shutdown_t *req, int status)
+{
+  connection *conn = reinterpret_cast<connection *>(req->handle);
+  ::free(req);
+
+  close_connection(conn);
+}
+
+
+static void shutdown_connection(connection *conn)
+{
+  // Stops reading and closes [conn] once what has been queued for writing
+  // has been written.
+
+  if (conn->closing || (conn->paused & PAUSED_SHUTDOWN)) return;
+
+  pause_reading(conn, PAUSED_SHUTDOWN);
+
+  uv_shutdown_t *req =
+    reinterpret_cast<uv_shutdown_t *>(::malloc(sizeof(uv_shutdown_t)));
+  int r = uv_shutdown(req, reinterpret_cast<uv_stream_t *>(conn), shutdown_cb);
+  if (r != 0)
+  {
+    ::free(req);
+    close_connection(conn);
+  }
+}
+
+
+//
+// Proxy.
+//
+// In proxy mode each client connection is paired with a connection to the
+// upstream server at [upstream_addr_], and what is read from either is
+// written to the other. Read buffers are handed over to the write as they
+// are, without copying.
+//
+// Each worker keeps a pool of upstream connections that have already been
+// established, so that a client does not wait for the connect, and refills it
+// as connections are taken. An upstream connection serves a single client:
+// the relay does not know where messages end, so it cannot tell when an
+// upstream connection would be back to a state in which it could serve
+// another one.
+//
+// Reading from either side stops while more than [relay_high_water] bytes
+// are queued for writing to the other, and resumes once that has fallen to
+// [relay_low_water].
+//
+
+static const size_t relay_high_water = 1024 * 1024;
+static const size_t relay_low_water = 256 * 1024;
+
+// Milliseconds before connecting again after a connection for the pool has
+// failed.
+static const uint64_t pool_retry_interval = 1000;
+
+static sockaddr_in upstream_addr_;
+
+struct upstream
+{
+  uv_tcp_t tcp; // Must be the first member, see [connection].
+  worker *w;
+
+  connection *client; // NULL while in the pool.
+  bool pooled;        // Connecting for the pool.
+  bool connected;
+  bool reading;
+  bool closing;
+
+  list_node pool_link; // Linked into [worker::pool] while idle.
+  size_t queued_bytes; // Written and not yet completed.
+
+  uv_connect_t connect;
+  uv_shutdown_t shutdown;
+};
+
+struct relay_write
+{
+  uv_write_t req;
+  uv_buf_t buf;
+  upstream *up;
+};
+
+
+static void upstream_close_cb(uv_handle_t *handle)
+{
+  ::free(handle);
+}
+
+
+static void close_upstream(upstream *up)
+{
+  if (up->closing) return;
+
+  up->closing = true;
+
+  if (!list_empty(&up->pool_link))
+  {
+    list_remove(&up->pool_link);
+    stat_add(&up->w->stats.pooled, -1);
+  }
+
+  if (up->client)
+  {
+    up->client->up = NULL;
+    up->client = NULL;
+  }
+
+  uv_close(reinterpret_cast<uv_handle_t *>(up), upstream_close_cb);
+}
+
+
+static void upstream_alloc_cb(uv_handle_t *handle,
+                              size_t suggested_size,
+                              uv_buf_t *buf)
+{
+  *buf = uv_buf_init(
+    reinterpret_cast<char *>(::malloc(suggested_size)), suggested_size
+    );
+}
+
+
+static void fill_pool(worker *w);
+
+
+static void upstream_read_cb(uv_stream_t *stream,
+                             ssize_t nread,
+                             const uv_buf_t *buf)
+{
+  upstream *up = reinterpret_cast<upstream *>(stream);
+  connection *client = up->client;
+
+  if (nread > 0 && client)
+  {
+    // The client frees the buffer once written.
+
+    write_connection(client, buf->base, nread);
+
+    if (client->queued_bytes > relay_high_water)
+    {
+      uv_read_stop(stream);
+      up->reading = false;
+    }
+    return;
+  }
+
+  // Anything read while in the pool is dropped.
+
+  ::free(buf->base);
+
+  if (nread < 0)
+  {
+    if (nread != UV_EOF)
+    {
+      stat_add(&up->w->stats.upstream_errors, 1);
+      error("Error on reading upstream stream", nread);
+    }
+
+    // The client is closed once what has been read has been written to it.
+
+    worker *w = up->w;
+    close_upstream(up);
+
+    if (client) shutdown_connection(client);
+    else fill_pool(w);
+  }
+}
+
+
+static void relay_drained(connection *conn)
+{
+  // Called as writes to [conn] complete. Resumes reading from its upstream
+  // connection once few enough bytes are queued.
+
+  upstream *up = conn->up;
+
+  if (up->reading || up->closing || conn->queued_bytes > relay_low_water)
+    return;
+
+  int r = uv_read_start(
+    reinterpret_cast<uv_stream_t *>(up), upstream_alloc_cb, upstream_read_cb);
+  if (r != 0)
+  {
+    error("Error on reading upstream stream", r);
+    return;
+  }
+
+  up->reading = true;
+}
+
+
+static void pool_timer_cb(uv_timer_t *handle)
+{
+  fill_pool(reinterpret_cast<worker *>(handle->data));
+}
+
+
+static void connect_cb(uv_connect_t *req, int status)
+{
+  upstream *up = reinterpret_cast<upstream *>(req->handle);
+  worker *w = up->w;
+  bool pooled = up->pooled;
+
+  if (pooled)
+  {
+    up->pooled = false;
+    --w->pool_connecting;
+  }
+
+  if (status == UV_ECANCELED) return; // Closed, along with its client.
+
+  if (status != 0)
+  {
+    stat_add(&w->stats.upstream_errors, 1);
+    error("Error on connecting upstream", status);
+
+    connection *client = up->client;
+    close_upstream(up);
+
+    if (client)
+    {
+      close_connection(client);
+    }
+    else if (!uv_is_active(reinterpret_cast<uv_handle_t *>(&w->pool_timer)))
+    {
+      uv_timer_start(&w->pool_timer, pool_timer_cb, pool_retry_interval, 0);
+    }
+    return;
+  }
+
+  up->connected = true;
+
+  // Reading while in the pool notices the upstream server closing the
+  // connection.
+
+  int r = uv_read_start(
+    reinterpret_cast<uv_stream_t *>(up), upstream_alloc_cb, upstream_read_cb);
+  if (r != 0)
+  {
+    error("Error on reading upstream stream", r);
+
+    connection *client = up->client;
+    close_upstream(up);
+    if (client) close_connection(client);
+    return;
+  }
+
+  up->reading = true;
+
+  if (up->client)
+  {
+    resume_reading(up->client, PAUSED_UPSTREAM);
+  }
+  else
+  {
+    list_push_back(&w->pool, &up->pool_link);
+    stat_add(&w->stats.pooled, 1);
+  }
+}
+
+
+static upstream *connect_upstream(worker *w, connection *client)
+{
+  // Starts connecting to the upstream server, for [client] or, if it is
+  // NULL, for the pool. Returns NULL on failure.
+
+  upstream *up = reinterpret_cast<upstream *>(::malloc(sizeof(upstream)));
+  if (!up) return NULL;
+
+  uv_tcp_init(w->loop, &up->tcp);
+  up->w = w;
+  up->client = client;
+  up->pooled = client == NULL;
+  up->connected = false;
+  up->reading = false;
+  up->closing = false;
+  list_init(&up->pool_link);
+  up->queued_bytes = 0;
+
+  int r = uv_tcp_connect(
+    &up->connect, &up->tcp,
+    reinterpret_cast<const sockaddr *>(&upstream_addr_), connect_cb);
+  if (r != 0)
+  {
+    stat_add(&w->stats.upstream_errors, 1);
+    error("Error on connecting upstream", r);
+    uv_close(reinterpret_cast<uv_handle_t *>(up), upstream_close_cb);
+    return NULL;
+  }
+
+  if (up->pooled) ++w->pool_connecting;
+  return up;
+}
+
+
+static void fill_pool(worker *w)
+{
+  while (w->stats.pooled + w->pool_connecting < w->pool_size &&
+         connect_upstream(w, NULL))
+    ;
+}
+
+
+static bool pair_upstream(connection *conn)
+{
+  // Pairs [conn] with an idle upstream connection, or with a new one that it
+  // waits for. Returns false on failure.
+
+  worker *w = conn->w;
+  upstream *up;
+
+  if (!list_empty(&w->pool))
+  {
+    up = container_of(w->pool.next, upstream, pool_link);
+    list_remove(&up->pool_link);
+    stat_add(&w->stats.pooled, -1);
+    up->client = conn;
+  }
+  else
+  {
+    up = connect_upstream(w, conn);
+    if (!up) return false;
+
+    conn->paused |= PAUSED_UPSTREAM;
+  }
+
+  conn->up = up;
+  fill_pool(w);
+  return true;
+}
+
+
+static void relay_write_cb(uv_write_t *req, int status)
+{
+  relay_write *rw = reinterpret_cast<relay_write *>(req->data);
+  upstream *up = rw->up;
+  connection *client = up->client;
+
+  up->queued_bytes -= rw->buf.len;
+  ::free(rw->buf.base);
+  ::free(rw);
+
+  if (status != 0 && status != UV_ECANCELED)
+    error("Error on writing upstream stream", status);
+
+  if (client && up->queued_bytes <= relay_low_water)
+    resume_reading(client, PAUSED_UPSTREAM);
+}
+
+
+static void relay(connection *conn, char *data, size_t len)
+{
+  // Writes [data], read from [conn], to its upstream connection. [data] must
+  // have been allocated with malloc and is freed once written.
+
+  upstream *up = conn->up;
+
+  relay_write *rw =
+    reinterpret_cast<relay_write *>(::malloc(sizeof(relay_write)));
+  rw->req.data = rw;
+  rw->buf = uv_buf_init(data, len);
+  rw->up = up;
+
+  int r = uv_write(
+    &rw->req, reinterpret_cast<uv_stream_t *>(up), &rw->buf, 1,
+    relay_write_cb);
+  if (r != 0)
+  {
+    ::free(data);
+    ::free(rw);
+    error("Error on writing upstream stream", r);
+    close_connection(conn);
+    return;
+  }
+
+  up->queued_bytes += len;
+  if (up->queued_bytes > relay_high_water) pause_reading(conn, PAUSED_UPSTREAM);
+}
+
+
+static void upstream_shutdown_cb(uv_shutdown_t *req, int status)
+{
+  upstream *up = reinterpret_cast<upstream *>(req->handle);
+
+  if (status != 0 && status != UV_ECANCELED)
+  {
+    error("Error on shutting down upstream stream", status);
+    if (up->client) close_connection(up->client);
+  }
+}
+
+
+static void relay_eof(connection *conn)
+{
+  // [conn] has sent all it will. Passes that on to its upstream connection
+  // once what has been read has been written, and keeps writing what the
+  // upstream server answers until it closes.
+
+  pause_reading(conn, PAUSED_EOF);
+
+  upstream *up = conn->up;
+  int r = uv_shutdown(
+    &up->shutdown, reinterpret_cast<uv_stream_t *>(up), upstream_shutdown_cb);
+  if (r != 0)
+  {
+    error("Error on shutting down upstream stream", r);
+    close_connection(conn);
+  }
+}
+
+
+//
+// Outbox.
+//
+// Writes of a shared buffer that are queued on a worker, by JavaScript or by
+// another worker, and carried out from the worker's loop by
+// [outbox_async_cb]:
+//
+//   DELIVER_SEND: To WebSocket connection [delivery::id].
+//   DELIVER_BROADCAST: To every open WebSocket connection.
+//   DELIVER_PUBLISH: To every subscriber of [delivery::channel].
+//
+
+enum
+{
+  DELIVER_SEND,
+  DELIVER_BROADCAST,
+  DELIVER_PUBLISH,
+};
+
+struct delivery
+{
+  delivery *next;
+  int kind; // DELIVER_*
+  uint64_t id;
+  shared_buffer *data; // Referenced until delivered.
+  size_t channel_len;
+
+  char *channel() { return reinterpret_cast<char *>(this + 1); }
+};
+
+
+static bool post_delivery(worker *w,
+                          int kind,
+                          uint64_t id,
+                          const char *channel, size_t channel_len,
+                          shared_buffer *data)
+{
+  // Queues [data] on [w]. Returns false if out of memory.
+
+  delivery *d =
+    reinterpret_cast<delivery *>(::malloc(sizeof(delivery) + channel_len));
+  if (!d) return false;
+
+  d->next = NULL;
+  d->kind = kind;
+  d->id = id;
+  d->data = data;
+  d->channel_len = channel_len;
+  ::memcpy(d->channel(), channel, channel_len);
+  shared_buffer_ref(data);
+
+  uv_mutex_lock(&w->outbox_mutex);
+  *w->outbox_tail = d;
+  w->outbox_tail = &d->next;
+  uv_mutex_unlock(&w->outbox_mutex);
+
+  uv_async_send(&w->outbox_async);
+  return true;
+}
+
+
+static bool write_subscriber(connection *conn, shared_buffer *sb)
+{
+  // Writes [sb] to subscriber [conn] unless it is slow, see
+  // SLOW_SUBSCRIBER_*. Returns false if it has not been written.
+
+  if (conn->closing || (conn->paused & PAUSED_SHUTDOWN)) return false;
+
+  worker *w = conn->w;
+  size_t max_queued_bytes = w->limits.max_subscriber_queued_bytes;
+
+  if (max_queued_bytes != 0 && conn->queued_bytes > max_queued_bytes)
+  {
+    if (w->limits.slow_subscriber_policy == SLOW_SUBSCRIBER_SKIP)
+    {
+      stat_add(&w->stats.skipped, 1);
+    }
+    else
+    {
+      stat_add(&w->stats.dropped, 1);
+      close_connection(conn);
+    }
+    return false;
+  }
+
+  write_shared(conn, sb);
+  return true;
+}
+
+
+static size_t deliver_publish(worker *w,
+                              const char *name, size_t len,
+                              shared_buffer *sb)
+{
+  // Writes [sb] to the subscribers of channel [name] on [w]. Returns the
+  // number written to.
+
+  channel *ch = find_channel(w, name, len);
+  if (!ch) return 0;
+
+  size_t receivers = 0;
+
+  list_node *node = ch->subscribers.next;
+  while (node != &ch->subscribers)
+  {
+    connection *conn =
+      container_of(node, subscription, channel_link)->conn;
+    node = node->next;
+
+    // Dropping the last subscriber frees the channel.
+
+    bool last = node == &ch->subscribers;
+
+    if (write_subscriber(conn, sb)) ++receivers;
+    else if (last) break;
+  }
+
+  return receivers;
+}
+
+
+static void deliver_broadcast(worker *w, shared_buffer *sb)
+{
+  // A connection may be dropped while iterating.
+
+  list_node *node = w->websockets.next;
+  while (node != &w->websockets)
+  {
+    connection *conn = container_of(node, connection, ws_link);
+    node = node->next;
+    write_subscriber(conn, sb);
+  }
+}
+
+
+static void deliver_send(worker *w, uint64_t id, shared_buffer *sb)
+{
+  const char *value;
+  size_t value_len;
+  if (!kv_get(
+        &w->websocket_ids,
+        kv_hash(reinterpret_cast<char *>(&id), sizeof(id)),
+        reinterpret_cast<char *>(&id), sizeof(id),
+        &value, &value_len))
+    return; // Closed.
+
+  connection *conn;
+  ::memcpy(&conn, value, sizeof(conn));
+  if (!conn->closing && (conn->paused & PAUSED_SHUTDOWN) == 0)
+    write_shared(conn, sb);
+}
+
+
+static void outbox_async_cb(uv_async_t *handle)
+{
+  worker *w = reinterpret_cast<worker *>(handle->data);
+
+  uv_mutex_lock(&w->outbox_mutex);
+  delivery *d = w->outbox;
+  w->outbox = NULL;
+  w->outbox_tail = &w->outbox;
+  uv_mutex_unlock(&w->outbox_mutex);
+
+  while (d)
+  {
+    if (d->kind == DELIVER_SEND)
+      deliver_send(w, d->id, d->data);
+    else if (d->kind == DELIVER_BROADCAST)
+      deliver_broadcast(w, d->data);
+    else
+      deliver_publish(w, d->channel(), d->channel_len, d->data);
+
+    delivery *next = d->next;
+    shared_buffer_unref(d->data);
+    ::free(d);
+    d = next;
+  }
+}
+
+
+static void post_to_all(int kind,
+                        uint64_t id,
+                        const char *channel, size_t channel_len,
+                        shared_buffer *data,
+                        worker *except)
+{
+  // Queues [data] on every worker but [except].
+
+  for (size_t i = 0; i < worker_count_; ++i)
+  {
+    if (&workers_[i] == except) continue;
+
+    if (!post_delivery(&workers_[i], kind, id, channel, channel_len, data))
+      error("Error on delivering message", UV_ENOMEM);
+  }
+}
+
+
+//
+// Pub/sub commands of RESP connections, see [resp_pubsub].
+//
+
+static long long subscribe_cb(void *arg, const char *channel, size_t len)
+{
+  return subscribe(reinterpret_cast<connection *>(arg), channel, len);
+}
+
+
+static long long unsubscribe_cb(void *arg, const char *channel, size_t len)
+{
+  return unsubscribe(reinterpret_cast<connection *>(arg), channel, len);
+}
+
+
+static bool any_channel_cb(void *arg, const char **channel, size_t *len)
+{
+  connection *conn = reinterpret_cast<connection *>(arg);
+  if (list_empty(&conn->subscriptions)) return false;
+
+  subscription *s =
+    container_of(conn->subscriptions.next, subscription, connection_link);
+  *channel = s->ch->name();
+  *len = s->ch->name_len;
+  return true;
+}
+
+
+static long long publish_cb(void *arg,
+                            const char *channel, size_t len,
+                            const char *message, size_t message_len)
+{
+  connection *conn = reinterpret_cast<connection *>(arg);
+
+  buffer formatted = { NULL, 0, 0 };
+  shared_buffer *sb = NULL;
+
+  if (resp_message(channel, len, message, message_len, &formatted))
+    sb = shared_buffer_new(&formatted);
+
+  if (!sb)
+  {
+    buffer_free(&formatted);
+    return -1;
+  }
+
+  post_to_all(DELIVER_PUBLISH, 0, channel, len, sb, conn->w);
+  size_t receivers = deliver_publish(conn->w, channel, len, sb);
+  shared_buffer_unref(sb);
+
+  return receivers;
+}
+
+
+static bool queue_message_cb(void *arg,
+                             ws_opcode opcode,
+                             const char *data, size_t len)
+{
+  // Adds a WebSocket message read from [arg] to the batch of its worker.
+
+  connection *conn = reinterpret_cast<connection *>(arg);
+
+  ws_message *m =
+    reinterpret_cast<ws_message *>(::malloc(sizeof(ws_message) + len));
+  if (!m) return false;
+
+  m->next = NULL;
+  m->id = conn->id;
+  m->binary = opcode == WS_BINARY;
+  m->len = len;
+  ::memcpy(m->data(), data, len);
+
+  *conn->w->batch.tail = m;
+  conn->w->batch.tail = &m->next;
+  return true;
+}
+
+
+static bool open_websocket(connection *conn)
+{
+  // Makes [conn], which has completed the handshake, reachable by [send] and
+  // [broadcast].
+
+  worker *w = conn->w;
+  connection *value = conn;
+
+  if (!kv_set(
+        &w->websocket_ids,
+        kv_hash(reinterpret_cast<char *>(&conn->id), sizeof(conn->id)),
+        reinterpret_cast<char *>(&conn->id), sizeof(conn->id),
+        reinterpret_cast<char *>(&value), sizeof(value)))
+    return false;
+
+  list_push_back(&w->websockets, &conn->ws_link);
+  return true;
+}
+
+
+static size_t execute_requests(connection *conn, char *data, size_t len)
+{
+  // Executes the RESP commands, answers the HTTP requests or reads the
+  // WebSocket frames read and writes all their replies in a single write. An
+  // incomplete request at the end is kept in [conn]->pending until the rest
+  // of it has been read. Returns the number of requests executed.
+
+  if (conn->pending.len != 0)
+  {
+    if (!buffer_append(&conn->pending, data, len))
+    {
+      error("Error on reading client stream", UV_ENOMEM);
+      close_connection(conn);
+      return 0;
+    }
+
+    data = conn->pending.data;
+    len = conn->pending.len;
+  }
+
+  buffer out = { NULL, 0, 0 };
+  size_t consumed;
+  size_t requests;
+  bool ok;
+  bool shutdown;
+
+  if (mode_ == MODE_RESP)
+  {
+    resp_pubsub pubsub = {
+      conn, subscribe_cb, unsubscribe_cb, any_channel_cb, publish_cb
+    };
+    resp_status status =
+      resp_execute(&store_, &pubsub, data, len, &out, &consumed, &requests);
+    ok = status != RESP_OUT_OF_MEMORY;
+    shutdown = status == RESP_PROTOCOL_ERROR;
+  }
+  else if (mode_ == MODE_HTTP)
+  {
+    http_status status =
+      http_execute(&responses_, data, len, &out, &consumed, &requests);
+    ok = status != HTTP_OUT_OF_MEMORY;
+    shutdown = status == HTTP_CLOSE;
+  }
+  else
+  {
+    bool was_open = conn->ws.open;
+    ws_status status = ws_execute(
+      &conn->ws, data, len, &out, &consumed, &requests,
+      queue_message_cb, conn);
+    ok = status != WS_OUT_OF_MEMORY;
+    shutdown = status == WS_CLOSE;
+
+    if (ok && !was_open && conn->ws.open) ok = open_websocket(conn);
+  }
+
+  if (out.len != 0) write_connection(conn, out.data, out.len);
+  else buffer_free(&out);
+
+  if (shutdown)
+  {
+    shutdown_connection(conn);
+    return requests;
+  }
+
+  if (ok && data == conn->pending.data)
+    buffer_consume(&conn->pending, consumed);
+  else if (ok && consumed < len)
+    ok = buffer_append(&conn->pending, data + consumed, len - consumed);
+
+  if (!ok)
+  {
+    error("Error on executing client command", UV_ENOMEM);
+    close_connection(conn);
+  }
+  else if (conn->pending.len > max_request_size)
+  {
+    shutdown_connection(conn);
+  }
+  else if (conn->pending.len == 0)
+  {
+    // Don't hold on to memory while idle.
+
+    buffer_free(&conn->pending);
+  }
+
+  return requests;
+}
+
+
+static void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t *in_buf)
+{
+  // Called when data has been read from socket or there is an error.
+  //
+  // [nread] contains the number of bytes read if >= 0 and error is < 0. [nread]
+  // of 0 does not mean that the socket has been closed.
+  //
+  // We are expected to close the socket in case of error.
+  //
+  // Data is read into [buf]->base. Buffer has been allocated by previous call
+  // [alloc_cb]. We are expected to free this buffer before returning. Note that
+  // [buf]->base might be NULL.
+
+  connection *conn = to_connection(stream);
+  worker *w = conn->w;
+  char *in_data = in_buf->base;
+
+  if (nread > 0)
+  {
+    size_t messages = 1;
+
+    stat_add(&w->stats.bytes_read, nread);
+    record(w, TRACE_READ, conn->id, nread);
+
+    if (mode_ == MODE_ECHO)
+    {
+      // Send echo response. We reuse the buffer passed to the read callback
+      // and free it once the write has been completed.
+
+      write_connection(conn, in_data, nread);
+      in_data = 0; // Don't free it now.
+    }
+    else if (mode_ == MODE_PROXY)
+    {
+      relay(conn, in_data, nread);
+      in_data = 0;
+    }
+    else
+    {
+      messages = execute_requests(conn, in_data, nread);
+    }
+
+    // Yield to other connections once the read budget has been used up.
+    // [budget_remaining] has already been called for this iteration by
+    // [alloc_cb].
+
+    conn->budget_used += nread;
+    if (w->limits.read_budget != 0 &&
+        conn->budget_used >= w->limits.read_budget && !conn->closing)
+    {
+      stat_add(&w->stats.throttled, 1);
+      pause_reading(conn, PAUSED_BUDGET);
+      list_push_back(&w->throttled, &conn->throttled_link);
+    }
+
+    // Stop reading while over any rate limit.
+
+    if (!charge(conn, nread, messages) && !conn->closing &&
+        (conn->paused & PAUSED_RATE) == 0)
+    {
+      stat_add(&w->stats.rate_limited, 1);
+      pause_reading(conn, PAUSED_RATE);
+      list_push_back(&w->rate_limited, &conn->rate_link);
+      schedule_rate_timer(w, rate_wait(conn, uv_now(w->loop)));
+    }
+  }
+  else if (nread < 0)
+  {
+    record(w, TRACE_ERROR, conn->id, nread);
+    if (nread != UV_EOF)
+      error("Error on reading client stream", nread);
+
+    if (nread == UV_EOF && conn->up) relay_eof(conn);
+    else close_connection(conn);
+  }
+
+  if (in_data) ::free(in_data);
+}
+
+
+static void accept_connection(worker *w)
+{
+  uint64_t now = uv_now(w->loop);
+
+  connection *conn =
+    reinterpret_cast<connection *>(::malloc(sizeof(connection)));
+  uv_tcp_init(w->loop, &conn->tcp);
+  conn->w = w;
+  conn->paused = 0;
+  conn->closing = false;
+  conn->budget_iteration = w->iteration;
+  conn->budget_used = 0;
+  list_init(&conn->throttled_link);
+  bucket_init(&conn->bytes, &w->limits.connection_bytes, now);
+  bucket_init(&conn->messages, &w->limits.connection_messages, now);
+  list_init(&conn->rate_link);
+  conn->id = w->next_id;
+  w->next_id += worker_count_;
+  list_init(&conn->writes);
+  list_init(&conn->writing_link);
+  conn->queued_bytes = 0;
+  conn->over_since = 0;
+  conn->pending.data = NULL;
+  conn->pending.len = 0;
+  conn->pending.cap = 0;
+  ws_init(&conn->ws);
+  list_init(&conn->ws_link);
+  list_init(&conn->subscriptions);
+  conn->subscription_count = 0;
+  conn->up = NULL;
+
+  uv_stream_t *server = reinterpret_cast<uv_stream_t *>(&w->server);
+  uv_stream_t *client = reinterpret_cast<uv_stream_t *>(conn);
+
+  int r = uv_accept(server, client);
+  if (r == 0)
+  {
+    stat_add(&w->stats.connections, 1);
+    record(w, TRACE_ACCEPT, conn->id, 0);
+
+    if (mode_ == MODE_PROXY && !pair_upstream(conn))
+    {
+      close_connection(conn);
+      return;
+    }
+
+    // Start reading, unless waiting for the upstream connection. We continue
+    // reading until calling uv_read_stop() or uv_close().
+
+    if (conn->paused == 0) r = uv_read_start(client, alloc_cb, read_cb);
+    if (r == 0)
+    {
+      // Reads are pending. [read_cb] will be called when data has been read.
+    }
+    else
+    {
+      record(w, TRACE_ERROR, conn->id, r);
+      close_connection(conn);
+      error("Error on reading client stream", r);
+    }
+  }
+  else
+  {
+    uv_close(reinterpret_cast<uv_handle_t *>(conn), connection_close_cb);
+    record(w, TRACE_ERROR, 0, r);
+    error("Error on accepting client connection", r);
+  }
+}
+
+
+static void reject_connection(worker *w)
+{
+  // Accepts a connection only to close it.
+
+  uv_tcp_t *client = reinterpret_cast<uv_tcp_t *>(::malloc(sizeof(uv_tcp_t)));
+  uv_tcp_init(w->loop, client);
+
+  int r = uv_accept(
+    reinterpret_cast<uv_stream_t *>(&w->server),
+    reinterpret_cast<uv_stream_t *>(client));
+  if (r == 0) stat_add(&w->stats.rejected, 1);
+  else error("Error on accepting client connection", r);
+
+  uv_close(reinterpret_cast<uv_handle_t *>(client), close_cb);
+}
+
+
+static void connection_cb(uv_stream_t * server, int status)
+{
+  if (status < 0)
+  {
+    error("Error on listening", status);
+    return; // Assuming no connection to accept.
+  }
+
+  worker *w = reinterpret_cast<worker *>(server->data);
+
+  if (!w->overloaded && w->limits.max_connections != 0 &&
+      w->stats.connections >= w->limits.max_connections)
+  {
+    w->overloaded = true;
+    stat_add(&w->stats.overloaded, 1);
+  }
+
+  if (!w->overloaded)
+  {
+    accept_connection(w);
+  }
+  else if (w->limits.overload_policy == OVERLOAD_PAUSE)
+  {
+    // libuv stops polling the listening socket until we accept.
+
+    w->accept_pending = true;
+  }
+  else
+  {
+    reject_connection(w);
+  }
+}
+
+
+static bool get_number_option(v8::Isolate *isolate,
+                              v8::Local<v8::Object> options,
+                              const char *name,
+                              double *value)
+{
+  // Reads the optional non-negative number [name] from [options] into
+  // [value]. Throws and returns false if it is present but not a number.
+
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Value> v = options->Get(
+    context, v8::String::NewFromUtf8(isolate, name).ToLocalChecked()
+    ).ToLocalChecked();
+
+  if (v->IsUndefined()) return true;
+
+  if (!v->IsNumber() || !(v->NumberValue(context).FromJust() >= 0))
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong options").ToLocalChecked()));
+    return false;
+  }
+
+  *value = v->NumberValue(context).FromJust();
+  return true;
+}
+
+
+static bool get_size_option(v8::Isolate *isolate,
+                            v8::Local<v8::Object> options,
+                            const char *name,
+                            size_t *value)
+{
+  double d = static_cast<double>(*value);
+  if (!get_number_option(isolate, options, name, &d)) return false;
+
+  *value = static_cast<size_t>(d);
+  return true;
+}
+
+
+static bool get_uint64_option(v8::Isolate *isolate,
+                              v8::Local<v8::Object> options,
+                              const char *name,
+                              uint64_t *value)
+{
+  double d = static_cast<double>(*value);
+  if (!get_number_option(isolate, options, name, &d)) return false;
+
+  *value = static_cast<uint64_t>(d);
+  return true;
+}
+
+
+static bool get_enum_option(v8::Isolate *isolate,
+                            v8::Local<v8::Object> options,
+                            const char *name,
+                            const char *const names[],
+                            int *value)
+{
+  // Reads the optional string [name] from [options] and stores its index in
+  // the NULL terminated [names] in [value]. Throws and returns false if it is
+  // present but not one of [names].
+
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Value> v = options->Get(
+    context, v8::String::NewFromUtf8(isolate, name).ToLocalChecked()
+    ).ToLocalChecked();
+
+  if (v->IsUndefined()) return true;
+
+  if (v->IsString())
+  {
+    v8::String::Utf8Value str(isolate, v);
+    for (int i = 0; names[i]; ++i)
+    {
+      if (::strcmp(*str, names[i]) == 0)
+      {
+        *value = i;
+        return true;
+      }
+    }
+  }
+
+  isolate->ThrowException(v8::Exception::TypeError(
+      v8::String::NewFromUtf8(isolate, "Wrong options").ToLocalChecked()));
+  return false;
+}
+
+
+static bool get_rate_option(v8::Isolate *isolate,
+                            v8::Local<v8::Object> options,
+                            const char *name,
+                            rate_limit *limit)
+{
+  // Reads the options [name]PerSecond and [name]Burst. The burst defaults to
+  // one second worth of tokens when only the rate is given.
+
+  char rate_name[64];
+  char burst_name[64];
+  ::snprintf(rate_name, sizeof(rate_name), "%sPerSecond", name);
+  ::snprintf(burst_name, sizeof(burst_name), "%sBurst", name);
+
+  double rate = -1;
+  double burst = -1;
+  if (!get_number_option(isolate, options, rate_name, &rate) ||
+      !get_number_option(isolate, options, burst_name, &burst))
+    return false;
+
+  if (rate >= 0)
+  {
+    limit->rate = rate;
+    if (burst < 0) limit->burst = rate;
+  }
+  if (burst >= 0) limit->burst = burst;
+
+  return true;
+}
+
+
+static bool get_limits(v8::Isolate *isolate,
+                       v8::Local<v8::Object> options,
+                       server_limits *l)
+{
+  // Reads the limits present in [options] into [l]. Limits that are not
+  // present are left unchanged.
+
+  return
+    get_size_option(isolate, options, "readBudget", &l->read_budget) &&
+    get_rate_option(
+      isolate, options, "connectionBytes", &l->connection_bytes) &&
+    get_rate_option(
+      isolate, options, "connectionMessages", &l->connection_messages) &&
+    get_rate_option(isolate, options, "serverBytes", &l->server_bytes) &&
+    get_rate_option(isolate, options, "serverMessages", &l->server_messages) &&
+    get_size_option(
+      isolate, options, "maxConnections", &l->max_connections) &&
+    get_size_option(
+      isolate, options, "connectionsLowWatermark",
+      &l->connections_low_watermark) &&
+    get_enum_option(
+      isolate, options, "overloadPolicy", overload_policies,
+      &l->overload_policy) &&
+    get_uint64_option(isolate, options, "writeTimeout", &l->write_timeout) &&
+    get_size_option(
+      isolate, options, "maxQueuedBytes", &l->max_queued_bytes) &&
+    get_uint64_option(
+      isolate, options, "maxQueuedTime", &l->max_queued_time) &&
+    get_size_option(
+      isolate, options, "maxSubscriberQueuedBytes",
+      &l->max_subscriber_queued_bytes) &&
+    get_enum_option(
+      isolate, options, "slowSubscriberPolicy", slow_subscriber_policies,
+      &l->slow_subscriber_policy);
+}
+
+
+static void share_limits(const server_limits *all, size_t n, server_limits *l)
+{
+  // Sets [l] to the share of [all] enforced by each of [n] workers.
+
+  *l = *all;
+
+  if (n == 1) return;
+
+  l->server_bytes.rate = all->server_bytes.rate / n;
+  l->server_bytes.burst = all->server_bytes.burst / n;
+  l->server_messages.rate = all->server_messages.rate / n;
+  l->server_messages.burst = all->server_messages.burst / n;
+  l->max_connections = (all->max_connections + n - 1) / n;
+  l->connections_low_watermark = (all->connections_low_watermark + n - 1) / n;
+}
+
+
+static void apply_limits(worker *w)
+{
+  // Takes the worker's share of [limits_]. Runs on the worker's thread.
+
+  uv_mutex_lock(&limits_mutex_);
+  share_limits(&limits_, worker_count_, &w->limits);
+  uv_mutex_unlock(&limits_mutex_);
+
+  // Let connections that are paused by a rate limit be reevaluated against
+  // the new limits.
+
+  if (!list_empty(&w->rate_limited))
+    uv_timer_start(&w->rate_timer, rate_timer_cb, 0, 0);
+
+  update_overloaded(w);
+
+  uint64_t interval = evict_interval(&w->limits);
+  if (interval != 0)
+    uv_timer_start(&w->evict_timer, evict_timer_cb, interval, 0);
+  else
+    uv_timer_stop(&w->evict_timer);
+}
+
+
+static void close_listener(worker *w)
+{
+  // Stops accepting connections on [w]. Runs on the worker's thread.
+
+  uv_handle_t *server = reinterpret_cast<uv_handle_t *>(&w->server);
+  if (uv_is_closing(server)) return;
+
+  w->accept_pending = false;
+  uv_close(server, NULL);
+}
+
+
+static void publish_stats_cb(uv_prepare_t *handle)
+{
+  // Runs before the loop waits for I/O, so what has been counted is published
+  // before the worker may go idle.
+
+  worker *w = reinterpret_cast<worker *>(handle->data);
+  stats_row *row = &stats_rows_[w->index];
+
+  if (::memcmp(&row->counters, &w->stats, sizeof(w->stats)) == 0 &&
+      ::memcmp(row->write_latency, w->write_latency, sizeof(w->write_latency))
+        == 0)
+    return;
+
+  publish_row(row, &w->stats, w->write_latency);
+}
+
+
+static void wakeup_cb(uv_async_t *handle)
+{
+  worker *w = reinterpret_cast<worker *>(handle->data);
+
+  if (!__atomic_load_n(&listening_, __ATOMIC_ACQUIRE)) close_listener(w);
+  apply_limits(w);
+}
+
+
+static int adopt_listener(worker *w, int fd, bool duplicate, size_t backlog)
+{
+  // Makes [fd], which must be a listening TCP socket, or with [duplicate] a
+  // duplicate of it, the listening socket of [w]. [fd] is left open if it is
+  // not adopted. Like [listen_worker], the socket is left to be closed by the
+  // caller if any step fails.
+
+  uv_tcp_init(w->loop, &w->server);
+  w->server.data = w;
+
+  int accepting = 0;
+  socklen_t len = sizeof(accepting);
+  int r = 0;
+
+  if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) != 0)
+    r = uv_translate_sys_error(errno);
+  else if (!accepting)
+    r = UV_EINVAL;
+
+  if (r == 0 && duplicate)
+  {
+    fd = ::dup(fd);
+    if (fd == -1) r = uv_translate_sys_error(errno);
+  }
+
+  if (r == 0)
+  {
+    r = uv_tcp_open(&w->server, fd);
+    if (r != 0 && duplicate) ::close(fd);
+  }
+
+  if (r != 0)
+  {
+    error("Error on adopting listening socket", r);
+    return r;
+  }
+
+  // Listening again only sets the backlog.
+
+  r = uv_listen(
+    reinterpret_cast<uv_stream_t *>(&w->server), backlog, connection_cb
+    );
+  if (r != 0) error("Error on listening", r);
+
+  return r;
+}
+
+
+static int listen_worker(worker *w,
+                         const sockaddr_in *addr,
+                         size_t backlog,
+                         bool reuse_port)
+{
+  // Opens the listening socket of [w]. With [reuse_port], several sockets may
+  // listen on the same port.
+  //
+  // The socket is created by [uv_tcp_init_ex] so that it can be configured
+  // before binding. It is left to be closed by the caller if any step fails.
+
+  uv_tcp_init_ex(w->loop, &w->server, AF_INET);
+  w->server.data = w;
+
+  int r = 0;
+
+  if (reuse_port)
+  {
+#ifdef SO_REUSEPORT
+    uv_os_fd_t fd;
+    int on = 1;
+    r = uv_fileno(reinterpret_cast<uv_handle_t *>(&w->server), &fd);
+    if (r == 0 &&
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+      r = uv_translate_sys_error(errno);
+#else
+    r = UV_ENOTSUP;
+#endif
+    if (r != 0) error("Error on enabling port reuse", r);
+  }
+
+  if (r == 0)
+  {
+    r = uv_tcp_bind(&w->server, reinterpret_cast<const sockaddr *>(addr), 0);
+    if (r != 0) error("Error on binding", r);
+  }
+
+  if (r == 0)
+  {
+    r = uv_listen(
+      reinterpret_cast<uv_stream_t *>(&w->server), backlog, connection_cb
+      );
+    if (r != 0) error("Error on listening", r);
+  }
+
+  return r;
+}
+
+
+static void init_worker(worker *w)
+{
+  // Initializes the state of [w] other than the listening socket. The handles
+  // of worker 0, which runs on the Node.js loop, must not by themselves keep
+  // the loop alive.
+
+  uv_loop_t *loop = w->loop;
+  bool unref = loop == uv_default_loop();
+
+  share_limits(&limits_, worker_count_, &w->limits);
+  ::memset(&w->stats, 0, sizeof(w->stats));
+  ::memset(w->write_latency, 0, sizeof(w->write_latency));
+  uv_prepare_init(loop, &w->publish);
+  w->publish.data = w;
+  uv_prepare_start(&w->publish, publish_stats_cb);
+
+  w->trace = trace_events_ + w->index * trace_size_;
+  w->trace_head = 0;
+
+  uv_async_init(loop, &w->wakeup, wakeup_cb);
+  w->wakeup.data = w;
+
+  w->next_id = w->index + 1;
+
+  w->iteration = 0;
+  list_init(&w->throttled);
+  uv_check_init(loop, &w->check);
+  w->check.data = w;
+  uv_check_start(&w->check, check_cb);
+
+  list_init(&w->rate_limited);
+  uv_timer_init(loop, &w->rate_timer);
+  w->rate_timer.data = w;
+  bucket_init(&w->server_bytes, &w->limits.server_bytes, uv_now(loop));
+  bucket_init(&w->server_messages, &w->limits.server_messages, uv_now(loop));
+
+  w->overloaded = false;
+  w->accept_pending = false;
+
+  list_init(&w->writing);
+  uv_timer_init(loop, &w->evict_timer);
+  w->evict_timer.data = w;
+  uint64_t interval = evict_interval(&w->limits);
+  if (interval != 0)
+    uv_timer_start(&w->evict_timer, evict_timer_cb, interval, 0);
+
+  list_init(&w->websockets);
+  kv_init(&w->websocket_ids);
+  message_queue_init(&w->batch);
+
+  kv_init(&w->channels);
+
+  uv_async_init(loop, &w->outbox_async, outbox_async_cb);
+  w->outbox_async.data = w;
+  uv_mutex_init(&w->outbox_mutex);
+  w->outbox = NULL;
+  w->outbox_tail = &w->outbox;
+
+  list_init(&w->pool);
+  w->pool_size = 0;
+  w->pool_connecting = 0;
+  uv_timer_init(loop, &w->pool_timer);
+  w->pool_timer.data = w;
+
+  if (unref)
+  {
+    uv_unref(reinterpret_cast<uv_handle_t *>(&w->wakeup));
+    uv_unref(reinterpret_cast<uv_handle_t *>(&w->outbox_async));
+    uv_unref(reinterpret_cast<uv_handle_t *>(&w->check));
+    uv_unref(reinterpret_cast<uv_handle_t *>(&w->publish));
+    uv_unref(reinterpret_cast<uv_handle_t *>(&w->rate_timer));
+    uv_unref(reinterpret_cast<uv_handle_t *>(&w->evict_timer));
+    uv_unref(reinterpret_cast<uv_handle_t *>(&w->pool_timer));
+  }
+}
+
+
+static void run_worker(void *arg)
+{
+  worker *w = reinterpret_cast<worker *>(arg);
+  uv_sem_wait(&workers_started_);
+  uv_run(w->loop, UV_RUN_DEFAULT);
+}
+
+
+static void close_handle_cb(uv_handle_t *handle, void *arg)
+{
+  if (!uv_is_closing(handle)) uv_close(handle, NULL);
+}
+
+
+static void close_worker(worker *w)
+{
+  // Closes the handles of [w], including its listening socket, and its loop.
+  // For a worker other than worker 0 whose thread could not be created.
+
+  uv_walk(w->loop, close_handle_cb, NULL);
+  uv_run(w->loop, UV_RUN_DEFAULT);
+  uv_loop_close(w->loop);
+  ::free(w->loop);
+  uv_mutex_destroy(&w->outbox_mutex);
+}
+
+
+static void free_workers_cb(uv_handle_t *handle)
+{
+  // [handle] is the socket of worker 0, which is at the start of the array of
+  // workers.
+
+  ::free(handle->data);
+}
+
+
+static int start_workers(size_t threads,
+                         const sockaddr_in *addr,
+                         int fd,
+                         size_t backlog,
+                         size_t pool_size)
+{
+  // Starts [threads] workers listening on [addr], or on the listening socket
+  // [fd] if it is not -1, sharing a pool of [pool_size] upstream connections
+  // in proxy mode. Returns 0 on success; on failure nothing is left running.
+  // If a thread cannot be created, the server runs with the workers whose
+  // thread could be.
+  //
+  // The workers share an adopted socket through duplicates of [fd], which
+  // all accept from its single queue.
+
+  void *mem;
+  if (::posix_memalign(&mem, alignof(worker), threads * sizeof(worker)) != 0)
+    return UV_ENOMEM;
+
+  worker *workers = reinterpret_cast<worker *>(mem);
+  ::memset(workers, 0, threads * sizeof(worker));
+
+  if (::posix_memalign(&mem, alignof(stats_row), threads * sizeof(stats_row))
+      != 0)
+  {
+    ::free(workers);
+    return UV_ENOMEM;
+  }
+
+  stats_row *rows = reinterpret_cast<stats_row *>(mem);
+  ::memset(rows, 0, threads * sizeof(stats_row));
+
+  trace_event *trace = NULL;
+  if (trace_size_ != 0)
+  {
+    trace = reinterpret_cast<trace_event *>(
+      ::calloc(threads * trace_size_, sizeof(trace_event)));
+    if (!trace)
+    {
+      ::free(rows);
+      ::free(workers);
+      return UV_ENOMEM;
+    }
+  }
+
+  // Open all listening sockets before starting any thread, so that a port
+  // that is in use is reported before any connection has been accepted.
+
+  size_t listening = 0;
+  int r = 0;
+
+  for (; listening < threads && r == 0; ++listening)
+  {
+    worker *w = &workers[listening];
+    w->index = listening;
+
+    if (listening == 0)
+    {
+      w->loop = uv_default_loop(); // Node.js uses the default loop.
+    }
+    else
+    {
+      w->loop = reinterpret_cast<uv_loop_t *>(::malloc(sizeof(uv_loop_t)));
+      r = uv_loop_init(w->loop);
+      if (r != 0)
+      {
+        ::free(w->loop);
+        error("Error on creating loop", r);
+        break;
+      }
+    }
+
+    r = fd == -1
+      ? listen_worker(w, addr, backlog, threads > 1)
+      : adopt_listener(w, fd, listening != 0, backlog);
+  }
+
+  if (r != 0)
+  {
+    // [listening] workers have a loop and a socket to close. The socket of
+    // worker 0 is closed on the Node.js loop, after which [workers] is freed.
+
+    for (size_t i = 1; i < listening; ++i)
+    {
+      uv_close(reinterpret_cast<uv_handle_t *>(&workers[i].server), NULL);
+      uv_run(workers[i].loop, UV_RUN_DEFAULT);
+      uv_loop_close(workers[i].loop);
+      ::free(workers[i].loop);
+    }
+
+    if (listening != 0)
+      uv_close(
+        reinterpret_cast<uv_handle_t *>(&workers[0].server), free_workers_cb);
+    else
+      ::free(workers);
+
+    ::free(rows);
+    ::free(trace);
+    return r;
+  }
+
+  workers_ = workers;
+  worker_count_ = threads;
+  stats_rows_ = rows;
+  trace_events_ = trace;
+
+  for (size_t i = 0; i < threads; ++i) init_worker(&workers[i]);
+
+  // The threads wait for [workers_started_] before running their loops, so
+  // that if one cannot be created the workers can still be reduced to those
+  // whose thread was. Threads cannot be taken back.
+
+  size_t started = 1;
+  r = threads > 1 ? uv_sem_init(&workers_started_, 0) : 0;
+  if (r != 0) error("Error on creating semaphore", r);
+
+  for (; r == 0 && started < threads; ++started)
+  {
+    r = uv_thread_create(
+      &workers[started].thread, run_worker, &workers[started]);
+    if (r != 0)
+    {
+      error("Error on creating thread", r);
+      break;
+    }
+  }
+
+  if (started < threads)
+  {
+    // Close the listening sockets of the workers left without a thread, so
+    // that the kernel no longer queues connections on them, and share the
+    // limits among the workers that are left.
+
+    for (size_t i = started; i < threads; ++i) close_worker(&workers[i]);
+
+    worker_count_ = started;
+    for (size_t i = 0; i < started; ++i) apply_limits(&workers[i]);
+  }
+
+  if (mode_ == MODE_PROXY)
+  {
+    for (size_t i = 0; i < worker_count_; ++i)
+    {
+      workers[i].pool_size = (pool_size + worker_count_ - 1) / worker_count_;
+      fill_pool(&workers[i]);
+    }
+  }
+
+  for (size_t i = 1; i < started; ++i) uv_sem_post(&workers_started_);
+
+  return 0;
+}
+
+
+static void start(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // start(port[, options]) or start(options)
+  //
+  // Options:
+  //   fd: Listening socket to serve instead of binding to [port], such as
+  //       one inherited from a service manager or received with
+  //       receiveListener. Required without [port].
+  //   backlog: Length of the kernel queue of connections not yet accepted.
+  //       Defaults to 511.
+  //   mode: 'echo' (default) to echo what is read, 'resp' to serve an
+  //       in-memory key-value store over a subset of the Redis protocol or
+  //       'http' to answer HTTP requests with the responses set by
+  //       setResponse or 'ws' to accept WebSocket connections, see send and
+  //       the messages event, or 'proxy' to relay connections to and from
+  //       the upstream server.
+  //   threads: Number of workers, each running its own event loop and
+  //       accepting connections on the port. Defaults to 1, which serves all
+  //       connections on the Node.js loop.
+  //   storeMemory: Bytes the entries of the key-value store may use before
+  //       entries not recently used are evicted. 0 (default) for no limit.
+  //   upstreamPort, upstreamHost: Address of the upstream server in proxy
+  //       mode. The port is required; the host is an IPv4 address and
+  //       defaults to '127.0.0.1'.
+  //   upstreamPool: Number of idle upstream connections kept open, shared
+  //       by the workers. Defaults to 16.
+  //   traceEvents: Number of connection events each worker keeps for trace
+  //       and dumpTrace, rounded up to a power of two. Defaults to 4096; 0
+  //       disables recording.
+  //
+  // and the limits accepted by [set_limits].
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (args.Length() != 1 && args.Length() != 2) {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong number of arguments")
+            .ToLocalChecked()));
+    return;
+  }
+
+  bool has_port = args[0]->IsNumber();
+
+  if (has_port
+      ? args.Length() == 2 && !args[1]->IsObject()
+      : args.Length() != 1 || !args[0]->IsObject())
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
+    return;
+  }
+
+  if (worker_count_ != 0)
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Already started").ToLocalChecked()));
+    return;
+  }
+
+  size_t backlog = 511;
+  int mode = MODE_ECHO;
+  size_t threads = 1;
+  size_t store_memory = 0;
+  size_t upstream_port = 0;
+  size_t upstream_pool = 16;
+  size_t trace_size = 4096;
+  sockaddr_in upstream_addr;
+  double fd = -1;
+
+  if (!has_port || args.Length() == 2)
+  {
+    v8::Local<v8::Object> options = args[args.Length() - 1].As<v8::Object>();
+
+    server_limits l = limits_;
+    if (!get_limits(isolate, options, &l) ||
+        !get_size_option(isolate, options, "backlog", &backlog) ||
+        !get_enum_option(isolate, options, "mode", modes, &mode) ||
+        !get_size_option(isolate, options, "threads", &threads) ||
+        !get_size_option(isolate, options, "storeMemory", &store_memory) ||
+        !get_size_option(isolate, options, "upstreamPort", &upstream_port) ||
+        !get_size_option(isolate, options, "upstreamPool", &upstream_pool) ||
+        !get_size_option(isolate, options, "traceEvents", &trace_size) ||
+        !get_number_option(isolate, options, "fd", &fd))
+      return;
+
+    v8::Local<v8::Value> host =
+      options->Get(
+        isolate->GetCurrentContext(),
+        v8::String::NewFromUtf8(isolate, "upstreamHost").ToLocalChecked()
+        ).ToLocalChecked();
+
+    bool upstream_ok = true;
+    if (mode == MODE_PROXY)
+    {
+      if (host->IsUndefined())
+      {
+        upstream_ok = uv_ip4_addr("127.0.0.1", upstream_port, &upstream_addr)
+          == 0;
+      }
+      else if (host->IsString())
+      {
+        v8::String::Utf8Value host_name(isolate, host);
+        upstream_ok =
+          uv_ip4_addr(*host_name, upstream_port, &upstream_addr) == 0;
+      }
+      else
+      {
+        upstream_ok = false;
+      }
+
+      upstream_ok = upstream_ok && upstream_port != 0 && upstream_port < 65536;
+    }
+
+    bool fd_ok = fd == -1
+      ? has_port
+      : fd <= INT_MAX && fd == static_cast<int>(fd);
+
+    if (threads == 0 || !upstream_ok || !fd_ok ||
+        trace_size > (size_t(1) << 24))
+    {
+      isolate->ThrowException(v8::Exception::TypeError(
+          v8::String::NewFromUtf8(isolate, "Wrong options").ToLocalChecked()));
+      return;
+    }
+
+    limits_ = l;
+  }
+
+  // The port is ignored when adopting a socket.
+
+  struct sockaddr_in addr;
+  int r = 0;
+
+  if (fd == -1)
+  {
+    int port = args[0]->IntegerValue(isolate->GetCurrentContext())
+      .FromJust(); // Truncated
+
+    r = uv_ip4_addr("127.0.0.1", port, &addr);
+    if (r != 0) error("Error on parsing address", r);
+  }
+
+  if (r == 0)
+  {
+    r = start_log();
+    if (r != 0) error("Error on starting log thread", r);
+  }
+
+  if (r == 0)
+  {
+    // Workers may start serving as soon as they are started, so everything
+    // they share is set up first.
+
+    mode_ = mode;
+    trace_size_ = trace_size <= 1
+      ? trace_size
+      : size_t(1) << (64 - __builtin_clzll(trace_size - 1));
+    if (mode == MODE_PROXY) upstream_addr_ = upstream_addr;
+
+    if (!kv_shards_init(&store_, store_memory))
+    {
+      r = UV_ENOMEM;
+      error("Error on creating key-value store", r);
+    }
+    else
+    {
+      r = start_workers(
+        threads, &addr, static_cast<int>(fd),
+        backlog, upstream_pool);
+      if (r != 0) kv_shards_free(&store_);
+    }
+  }
+
+  if (r != 0)
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Failed to start").ToLocalChecked()));
+    return;
+  }
+}
+
+
+static bool check_started(v8::Isolate *isolate)
+{
+  if (worker_count_ != 0) return true;
+
+  isolate->ThrowException(v8::Exception::TypeError(
+      v8::String::NewFromUtf8(isolate, "Not started").ToLocalChecked()));
+  return false;
+}
+
+
+static void throw_errno(v8::Isolate *isolate, const char *prefix)
+{
+  int r = uv_translate_sys_error(errno);
+  error(prefix, r);
+
+  isolate->ThrowException(v8::Exception::Error(
+      v8::String::NewFromUtf8(isolate, uv_strerror(r)).ToLocalChecked()));
+}
+
+
+static bool get_unix_address(v8::Isolate *isolate,
+                             v8::Local<v8::Value> path,
+                             sockaddr_un *addr)
+{
+  // Sets [addr] to the Unix socket at [path]. Throws and returns false if
+  // [path] is not a string or is too long.
+
+  if (path->IsString())
+  {
+    v8::String::Utf8Value name(isolate, path);
+
+    ::memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (static_cast<size_t>(name.length()) < sizeof(addr->sun_path))
+    {
+      ::memcpy(addr->sun_path, *name, name.length());
+      return true;
+    }
+  }
+
+  isolate->ThrowException(v8::Exception::TypeError(
+      v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
+  return false;
+}
+
+
+static void listener_fd(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // listenerFd()
+  //
+  // Returns the descriptor of the listening socket, for example to pass it
+  // on to a child process in its stdio. Workers other than the first listen
+  // on their own sockets unless the socket was adopted with the fd option.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (!check_started(isolate)) return;
+
+  uv_os_fd_t fd;
+  int r = uv_fileno(reinterpret_cast<uv_handle_t *>(&workers_[0].server), &fd);
+  if (r != 0)
+  {
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Not listening").ToLocalChecked()));
+    return;
+  }
+
+  args.GetReturnValue().Set(fd);
+}
+
+
+static void hand_off(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // handOff(path)
+  //
+  // Sends the listening socket to the process waiting in receiveListener on
+  // the Unix socket at [path]. Both processes then accept from the same
+  // socket, so no connection is refused while the server is replaced; call
+  // stopListening once the new process has started.
+  //
+  // Only the socket of the first worker is handed off. With the threads
+  // option, connections still queued on the sockets of the other workers are
+  // reset when they stop listening, unless the socket was adopted with the fd
+  // option, which the workers share.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  sockaddr_un addr;
+  if (args.Length() != 1 || !get_unix_address(isolate, args[0], &addr))
+    return;
+
+  if (!check_started(isolate)) return;
+
+  uv_os_fd_t fd;
+  if (uv_fileno(reinterpret_cast<uv_handle_t *>(&workers_[0].server), &fd)
+      != 0)
+  {
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Not listening").ToLocalChecked()));
+    return;
+  }
+
+  int s = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s == -1)
+  {
+    throw_errno(isolate, "Error on handing off listening socket");
+    return;
+  }
+
+  // The descriptor travels as SCM_RIGHTS ancillary data of a single byte.
+
+  char byte = 0;
+  iovec iov = { &byte, 1 };
+
+  union
+  {
+    cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  ::memset(&control, 0, sizeof(control));
+
+  msghdr msg;
+  ::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  ::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  if (::connect(s, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      ::sendmsg(s, &msg, MSG_NOSIGNAL) != 1)
+    throw_errno(isolate, "Error on handing off listening socket");
+
+  ::close(s);
+}
+
+
+//
+// A receiveListener waiting on the Node.js loop for handOff to connect to
+// [server] and send the listening socket over [client].
+//
+struct listener_receiver
+{
+  uv_poll_t server_poll;
+  uv_poll_t client_poll; // Initialized once handOff has connected.
+  int server;
+  int client;            // -1 until handOff has connected.
+  int open_handles;
+  sockaddr_un addr;
+  v8::Isolate *isolate;
+  v8::Persistent<v8::Context> context;
+  v8::Persistent<v8::Promise::Resolver> resolver;
+};
+
+
+static void receiver_close_cb(uv_handle_t *handle)
+{
+  listener_receiver *r = reinterpret_cast<listener_receiver *>(handle->data);
+  if (--r->open_handles != 0) return;
+
+  if (r->client != -1) ::close(r->client);
+  ::close(r->server);
+
+  r->context.Reset();
+  r->resolver.Reset();
+  delete r;
+}
+
+
+static void finish_receive(listener_receiver *r, int fd, int status)
+{
+  // Settles the promise of [r] with [fd], or rejects it with [status] if it
+  // is not 0, and closes [r].
+
+  ::unlink(r->addr.sun_path);
+
+  uv_close(reinterpret_cast<uv_handle_t *>(&r->server_poll), receiver_close_cb);
+  if (r->client != -1)
+    uv_close(
+      reinterpret_cast<uv_handle_t *>(&r->client_poll), receiver_close_cb);
+
+  v8::Isolate *isolate = r->isolate;
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context =
+    v8::Local<v8::Context>::New(isolate, r->context);
+  v8::Context::Scope context_scope(context);
+
+  // Runs the reactions to the promise once settled.
+  node::CallbackScope callback_scope(
+    isolate, v8::Object::New(isolate), node::async_context{0, 0});
+
+  v8::Local<v8::Promise::Resolver> resolver =
+    v8::Local<v8::Promise::Resolver>::New(isolate, r->resolver);
+
+  if (status == 0)
+  {
+    resolver->Resolve(context, v8::Integer::New(isolate, fd)).FromJust();
+    return;
+  }
+
+  error("Error on receiving listening socket", status);
+  resolver->Reject(
+    context,
+    v8::Exception::Error(
+      v8::String::NewFromUtf8(isolate, uv_strerror(status)).ToLocalChecked())
+    ).FromJust();
+}
+
+
+static void receiver_client_cb(uv_poll_t *handle, int status, int events)
+{
+  // Receives the listening socket sent by handOff.
+
+  listener_receiver *r = reinterpret_cast<listener_receiver *>(handle->data);
+
+  if (status < 0)
+  {
+    finish_receive(r, -1, status);
+    return;
+  }
+
+  char byte;
+  iovec iov = { &byte, 1 };
+
+  union
+  {
+    cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  msghdr msg;
+  ::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t n = ::recvmsg(r->client, &msg, MSG_CMSG_CLOEXEC);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+
+  cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+  {
+    int fd;
+    ::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    finish_receive(r, fd, 0);
+  }
+  else
+  {
+    finish_receive(
+      r, -1, n == -1 ? uv_translate_sys_error(errno) : UV_EPROTO);
+  }
+}
+
+
+static void receiver_server_cb(uv_poll_t *handle, int status, int events)
+{
+  // Accepts the connection from handOff.
+
+  listener_receiver *r = reinterpret_cast<listener_receiver *>(handle->data);
+
+  if (status < 0)
+  {
+    finish_receive(r, -1, status);
+    return;
+  }
+
+  int c = ::accept4(r->server, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (c == -1)
+  {
+    if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+      finish_receive(r, -1, uv_translate_sys_error(errno));
+    return;
+  }
+
+  r->client = c;
+  uv_poll_stop(&r->server_poll);
+
+  uv_poll_init(uv_default_loop(), &r->client_poll, c);
+  r->client_poll.data = r;
+  ++r->open_handles;
+  uv_poll_start(&r->client_poll, UV_READABLE, receiver_client_cb);
+}
+
+
+static void receive_listener(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // receiveListener(path)
+  //
+  // Waits for a listening socket to be sent with handOff to a Unix socket
+  // created at [path]. Returns a promise of its descriptor, to be passed to
+  // start as the fd option. Waiting does not block the event loop, but keeps
+  // it alive until the socket has been received.
+  //
+  // A socket left at [path] by an earlier handoff is replaced. Anything else
+  // at [path] is an error.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  sockaddr_un addr;
+  if (args.Length() != 1 || !get_unix_address(isolate, args[0], &addr))
+    return;
+
+  struct stat st;
+  bool stale = ::lstat(addr.sun_path, &st) == 0;
+  if (stale && !S_ISSOCK(st.st_mode))
+  {
+    errno = EEXIST;
+    throw_errno(isolate, "Error on receiving listening socket");
+    return;
+  }
+
+  int s = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s == -1)
+  {
+    throw_errno(isolate, "Error on receiving listening socket");
+    return;
+  }
+
+  if (stale) ::unlink(addr.sun_path);
+
+  if (::bind(s, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      ::listen(s, 1) != 0)
+  {
+    throw_errno(isolate, "Error on receiving listening socket");
+    ::close(s);
+    return;
+  }
+
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Promise::Resolver> resolver =
+    v8::Promise::Resolver::New(context).ToLocalChecked();
+
+  listener_receiver *r = new listener_receiver;
+  r->server = s;
+  r->client = -1;
+  r->open_handles = 1;
+  r->addr = addr;
+  r->isolate = isolate;
+  r->context.Reset(isolate, context);
+  r->resolver.Reset(isolate, resolver);
+
+  uv_poll_init(uv_default_loop(), &r->server_poll, s);
+  r->server_poll.data = r;
+  uv_poll_start(&r->server_poll, UV_READABLE, receiver_server_cb);
+
+  args.GetReturnValue().Set(resolver->GetPromise());
+}
+
+
+static void stop_listening(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // stopListening()
+  //
+  // Stops accepting connections, for example after handing off the listening
+  // socket. Open connections are served until they close.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (!check_started(isolate)) return;
+
+  __atomic_store_n(&listening_, false, __ATOMIC_RELEASE);
+
+  close_listener(&workers_[0]);
+
+  for (size_t i = 1; i < worker_count_; ++i)
+    uv_async_send(&workers_[i].wakeup);
+}
+
+
+static void set_limits(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // setLimits(options)
+  //
+  // Changes the limits given in [options], also for connections that are
+  // already open. Limits not given are left unchanged.
+  //
+  // Options:
+  //   readBudget: Bytes a connection may read per loop iteration before
+  //       yielding to other connections. 0 for no limit.
+  //   connectionBytesPerSecond, connectionBytesBurst,
+  //   connectionMessagesPerSecond, connectionMessagesBurst,
+  //   serverBytesPerSecond, serverBytesBurst,
+  //   serverMessagesPerSecond, serverMessagesBurst: Token bucket rate and
+  //       capacity for the bytes and messages read by each connection and by
+  //       the server as a whole. A rate of 0 means no limit. The burst
+  //       defaults to the rate.
+  //   maxConnections: Open connections at which the server stops accepting.
+  //       0 for no limit.
+  //   connectionsLowWatermark: Accepting resumes when fewer connections than
+  //       this are open. Defaults to maxConnections.
+  //   overloadPolicy: 'pause' to leave new connections in the kernel backlog
+  //       or 'close' to accept and immediately close them while overloaded.
+  //   writeTimeout: Milliseconds the oldest pending write of a connection may
+  //       wait before the connection is evicted. 0 for no limit.
+  //   maxQueuedBytes, maxQueuedTime: A connection that has had more than
+  //       maxQueuedBytes queued for writing for more than maxQueuedTime
+  //       milliseconds is evicted. 0 for no limit.
+  //   maxSubscriberQueuedBytes: A subscriber, or WebSocket connection for
+  //       broadcasts, that has more than this queued for writing is slow.
+  //       0 for no limit.
+  //   slowSubscriberPolicy: 'skip' to not send slow subscribers the message
+  //       or 'drop' to close them.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (args.Length() != 1 || !args[0]->IsObject())
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
+    return;
+  }
+
+  server_limits l = limits_;
+  if (!get_limits(isolate, args[0].As<v8::Object>(), &l)) return;
+
+  uv_mutex_lock(&limits_mutex_);
+  limits_ = l;
+  uv_mutex_unlock(&limits_mutex_);
+
+  // Worker 0 runs on this thread, the others take their share when woken.
+
+  if (worker_count_ != 0) apply_limits(&workers_[0]);
+
+  for (size_t i = 1; i < worker_count_; ++i)
+    uv_async_send(&workers_[i].wakeup);
+}
+
+
+static void set_response(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // setResponse(path, body[, options])
+  //
+  // Sets the response to HTTP GET and HEAD requests for [path] (without a
+  // query). [body] is a string or a Buffer, or null to remove the response.
+  // The response is formatted once, here, and copied as is for each request.
+  //
+  // Options:
+  //   status: Status code. Defaults to 200.
+  //   contentType: Defaults to 'text/plain'.
+
+  v8::Isolate* isolate = args.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+  if (args.Length() < 2 || args.Length() > 3 || !args[0]->IsString() ||
+      !(args[1]->IsString() || args[1]->IsArrayBufferView() ||
+        args[1]->IsNull()) ||
+      (args.Length() == 3 && !args[2]->IsObject()))
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
+    return;
+  }
+
+  v8::String::Utf8Value path(isolate, args[0]);
+
+  if (args[1]->IsNull())
+  {
+    kv_shards_del(&responses_, *path, path.length());
+    return;
+  }
+
+  double status = 200;
+  v8::Local<v8::Value> content_type_value =
+    v8::String::NewFromUtf8(isolate, "text/plain").ToLocalChecked();
+
+  if (args.Length() == 3)
+  {
+    v8::Local<v8::Object> options = args[2].As<v8::Object>();
+
+    if (!get_number_option(isolate, options, "status", &status)) return;
+
+    v8::Local<v8::Value> v = options->Get(
+      context,
+      v8::String::NewFromUtf8(isolate, "contentType").ToLocalChecked()
+      ).ToLocalChecked();
+
+    if (!v->IsUndefined()) content_type_value = v;
+  }
+
+  if (status < 100 || status > 999 || !content_type_value->IsString())
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong options").ToLocalChecked()));
+    return;
+  }
+
+  v8::String::Utf8Value content_type(isolate, content_type_value);
+
+  bool ok;
+  buffer response = { NULL, 0, 0 };
+
+  if (args[1]->IsString())
+  {
+    v8::String::Utf8Value body(isolate, args[1]);
+    ok = http_format(
+      static_cast<int>(status),
+      *content_type, content_type.length(),
+      *body, body.length(),
+      &response);
+  }
+  else
+  {
+    ok = http_format(
+      static_cast<int>(status),
+      *content_type, content_type.length(),
+      node::Buffer::Data(args[1]), node::Buffer::Length(args[1]),
+      &response);
+  }
+
+  ok = ok && kv_shards_set(
+    &responses_, *path, path.length(), response.data, response.len);
+  buffer_free(&response);
+
+  if (!ok)
+  {
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Out of memory").ToLocalChecked()));
+  }
+}
+
+
+static bool format_frame(v8::Isolate *isolate,
+                         v8::Local<v8::Value> data,
+                         buffer *frame)
+{
+  // Formats [data] as a text frame if it is a string and as a binary frame
+  // if it is a Buffer. Throws and returns false on failure.
 
-//
-// We use [loop_] != NULL to indicate that the echo server already has been
-// started.
-//
-static uv_loop_t *loop_ = NULL;
+  bool ok;
+
+  if (data->IsString())
+  {
+    v8::String::Utf8Value text(isolate, data);
+    ok = ws_frame(WS_TEXT, *text, text.length(), frame);
+  }
+  else if (data->IsArrayBufferView())
+  {
+    ok = ws_frame(
+      WS_BINARY, node::Buffer::Data(data), node::Buffer::Length(data), frame);
+  }
+  else
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
+    return false;
+  }
 
+  if (!ok)
+  {
+    buffer_free(frame);
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Out of memory").ToLocalChecked()));
+  }
 
-static void error(const char *prefix, int status)
+  return ok;
+}
+
+
+static bool check_ws_mode(v8::Isolate *isolate)
 {
-  ::fprintf(stderr, "%s: %s.\n", prefix, uv_strerror(status));
+  if (worker_count_ != 0 && mode_ == MODE_WS) return true;
+
+  isolate->ThrowException(v8::Exception::TypeError(
+      v8::String::NewFromUtf8(isolate, "Not started in ws mode")
+        .ToLocalChecked()));
+  return false;
 }
 
 
-static void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf)
+static bool share_frame(v8::Isolate *isolate,
+                        v8::Local<v8::Value> data,
+                        shared_buffer **sb)
 {
-  // Allocates a buffer to read input into. Buffer is then passed to [read_cb].
-  // Buffer is not reused but is always released on call to [read_cb].
+  // Formats [data] like [format_frame] into a new [shared_buffer]. Throws and
+  // returns false on failure.
+
+  buffer frame = { NULL, 0, 0 };
+  if (!format_frame(isolate, data, &frame)) return false;
+
+  *sb = shared_buffer_new(&frame);
+  if (!*sb)
+  {
+    buffer_free(&frame);
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Out of memory").ToLocalChecked()));
+    return false;
+  }
+
+  return true;
+}
+
+
+static void send(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // send(id, data)
   //
-  // [suggested_size] is just advisory (usually 64 KiB). We can allocate a
-  // smaller or a larger size.
+  // Sends [data] to WebSocket connection [id], as a text message if it is a
+  // string and as a binary message if it is a Buffer. Nothing is sent if the
+  // connection has been closed.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (args.Length() != 2 || !args[0]->IsNumber())
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
+    return;
+  }
+
+  if (!check_ws_mode(isolate)) return;
+
+  int64_t id = args[0]->IntegerValue(isolate->GetCurrentContext()).FromJust();
+  if (id <= 0) return; // Not a connection.
+
+  shared_buffer *sb;
+  if (!share_frame(isolate, args[1], &sb)) return;
+
+  if (!post_delivery(
+        &workers_[(id - 1) % worker_count_], DELIVER_SEND, id, NULL, 0, sb))
+  {
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Out of memory").ToLocalChecked()));
+  }
+
+  shared_buffer_unref(sb);
+}
+
+
+static void broadcast(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // broadcast(data)
   //
-  // If the allocation fails ([buf]->base == NULL) and error is passed to
-  // read_cb regardless of what size we set.
-  
-  *buf = uv_buf_init(
-    reinterpret_cast<char *>(::malloc(suggested_size)), suggested_size
-    );
+  // Sends [data], like [send], to every open WebSocket connection but the
+  // slow ones, see slowSubscriberPolicy. The frame is formatted once and
+  // shared by all connections.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (args.Length() != 1)
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
+    return;
+  }
+
+  if (!check_ws_mode(isolate)) return;
+
+  shared_buffer *sb;
+  if (!share_frame(isolate, args[0], &sb)) return;
+
+  post_to_all(DELIVER_BROADCAST, 0, NULL, 0, sb, NULL);
+  shared_buffer_unref(sb);
 }
 
 
-struct write_data
+static void publish(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
-  uv_write_t req;
-  uv_buf_t buf;
-};
+  // publish(channel, message)
+  //
+  // Publishes [message], a string or a Buffer, on [channel] to its
+  // subscribers but the slow ones, see slowSubscriberPolicy, like PUBLISH.
+
+  v8::Isolate* isolate = args.GetIsolate();
 
+  if (args.Length() != 2 || !args[0]->IsString() ||
+      (!args[1]->IsString() && !args[1]->IsArrayBufferView()))
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
+    return;
+  }
 
-static void free_write_data(write_data *wd)
+  if (worker_count_ == 0 || mode_ != MODE_RESP)
+  {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Not started in resp mode")
+          .ToLocalChecked()));
+    return;
+  }
+
+  v8::String::Utf8Value channel(isolate, args[0]);
+
+  buffer message = { NULL, 0, 0 };
+  bool ok;
+
+  if (args[1]->IsString())
+  {
+    v8::String::Utf8Value text(isolate, args[1]);
+    ok = resp_message(
+      *channel, channel.length(), *text, text.length(), &message);
+  }
+  else
+  {
+    ok = resp_message(
+      *channel, channel.length(),
+      node::Buffer::Data(args[1]), node::Buffer::Length(args[1]),
+      &message);
+  }
+
+  shared_buffer *sb = ok ? shared_buffer_new(&message) : NULL;
+  if (!sb)
+  {
+    buffer_free(&message);
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Out of memory").ToLocalChecked()));
+    return;
+  }
+
+  post_to_all(DELIVER_PUBLISH, 0, *channel, channel.length(), sb, NULL);
+  shared_buffer_unref(sb);
+}
+
+
+static void set_stat(v8::Isolate *isolate,
+                     v8::Local<v8::Object> obj,
+                     const char *name,
+                     uint64_t value)
 {
-  ::free(wd->buf.base);
-  ::free(wd);
+  obj->Set(
+    isolate->GetCurrentContext(),
+    v8::String::NewFromUtf8(isolate, name).ToLocalChecked(),
+    v8::Number::New(isolate, static_cast<double>(value))
+    ).FromJust();
 }
 
 
-static void write_cb(uv_write_t *req, int status)
+static void stats(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
-  // Called when data has been written to socket.
-  
-  write_data *wd = reinterpret_cast<write_data *>(req->data);
-  free_write_data(wd);
+  // Returns a snapshot of the server statistics, the sum of a consistent
+  // snapshot of the counters of each worker.
+
+  v8::Isolate* isolate = args.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Object> obj = v8::Object::New(isolate);
+
+  stats_row total = {};
+  for (size_t i = 0; i < worker_count_; ++i)
+  {
+    stats_row row;
+    read_stats_row(&stats_rows_[i], &row);
+
+    uint64_t *to = reinterpret_cast<uint64_t *>(&total.counters);
+    const uint64_t *from = reinterpret_cast<const uint64_t *>(&row.counters);
+    for (size_t j = 0; j < sizeof(server_stats) / sizeof(uint64_t); ++j)
+      to[j] += from[j];
+
+    for (size_t b = 0; b < write_latency_buckets; ++b)
+      total.write_latency[b] += row.write_latency[b];
+  }
+
+  const size_t field_count = sizeof(stat_fields) / sizeof(stat_fields[0]);
+  for (size_t f = 0; f < field_count; ++f)
+    set_stat(isolate, obj, stat_fields[f].name, stat_field(&total.counters, f));
+
+  v8::Local<v8::Array> write_latency =
+    v8::Array::New(isolate, write_latency_buckets);
+  for (size_t b = 0; b < write_latency_buckets; ++b)
+  {
+    write_latency->Set(
+      context, b,
+      v8::Number::New(isolate, static_cast<double>(total.write_latency[b]))
+      ).FromJust();
+  }
+  obj->Set(
+    context,
+    v8::String::NewFromUtf8(isolate, "writeLatency").ToLocalChecked(),
+    write_latency
+    ).FromJust();
+
+  kv_shards_stats store = {};
+  if (worker_count_ != 0) kv_shards_get_stats(&store_, &store);
+
+  set_stat(isolate, obj, "keys", store.keys);
+  set_stat(isolate, obj, "storeMemory", store.memory);
+  set_stat(isolate, obj, "storeEvicted", store.evicted);
+
+  // Messages published, broadcast or sent whose writes have not all
+  // completed.
 
-  if (status != 0) error("Error on writing client stream", status);
+  set_stat(
+    isolate, obj, "sharedBuffers",
+    __atomic_load_n(&shared_buffer_count, __ATOMIC_RELAXED));
+
+  args.GetReturnValue().Set(obj);
 }
 
 
-static void close_and_free(uv_stream_t* client)
+static void keep_stats_cb(void *data, size_t length, void *deleter_data)
 {
-  uv_close(reinterpret_cast<uv_handle_t *>(client), NULL);
-  ::free(client);
+  // [stats_rows_] is never freed once started.
 }
 
 
-static void read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t *in_buf)
+static void stats_buffer(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
-  // Called when data has been read from socket or there is an error.
+  // statsBuffer()
   //
-  // [nread] contains the number of bytes read if >= 0 and error is < 0. [nread]
-  // of 0 does not mean that the socket has been closed.
+  // Returns a BigUint64Array over the counters of the workers, laid out as
+  // described by statsLayout, which the workers keep updating. Polling it
+  // involves no call into the server.
   //
-  // We are expected to close the socket in case of error.
+  // The counters of a row are from one point in time if the sequence of the
+  // row is even and the same before and after reading them; otherwise the
+  // worker was publishing it and it should be read again.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (!check_started(isolate)) return;
+
+  size_t len = worker_count_ * sizeof(stats_row);
+  std::unique_ptr<v8::BackingStore> store =
+    v8::ArrayBuffer::NewBackingStore(stats_rows_, len, keep_stats_cb, NULL);
+  v8::Local<v8::ArrayBuffer> buffer =
+    v8::ArrayBuffer::New(isolate, std::move(store));
+
+  args.GetReturnValue().Set(
+    v8::BigUint64Array::New(buffer, 0, len / sizeof(uint64_t)));
+}
+
+
+static void stats_layout(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // statsLayout()
   //
-  // Data is read into [buf]->base. Buffer has been allocated by previous call
-  // [alloc_cb]. We are expected to free this buffer before returning. Note that
-  // [buf]->base might be NULL.
-  
-  char *in_data = in_buf->base;
-  
-  if (nread > 0)
+  // Describes the array returned by statsBuffer:
+  //
+  //   { rows, rowLength, sequence, fields: { connections, ... },
+  //     writeLatency, writeLatencyBuckets }
+  //
+  // The array has a row of [rowLength] elements per worker. [sequence] is
+  // the index in a row of its sequence, see statsBuffer, and [fields] that of
+  // each counter that [stats] sums over the workers. The buckets of the write
+  // latency histogram start at index [writeLatency].
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (!check_started(isolate)) return;
+
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Object> obj = v8::Object::New(isolate);
+  v8::Local<v8::Object> fields = v8::Object::New(isolate);
+
+  const size_t field_count = sizeof(stat_fields) / sizeof(stat_fields[0]);
+  for (size_t f = 0; f < field_count; ++f)
   {
-    // Send echo response. We reuse the buffer passed to the read callback and
-    // free it once the write has been completed.
-    
-    // uv_write_t::data is used to keep state associated with the write
-    // operation.
-    
-    write_data *wd =
-      reinterpret_cast<write_data *>(::malloc(sizeof(write_data)));
-    wd->req.data = wd;
-    wd->buf = uv_buf_init(in_data, nread);
-    in_data = 0; // Don't free it now.
-    
-    int r = uv_write(&wd->req, stream, &wd->buf, 1, write_cb);
-    if (r == 0)
-    {
-      // Write is pending. [write_cb] will be called on write completed.
-    }
-    else
-    {
-      // Write failed.
-      //
-      // Documentation is not explicit on this but assuming that there is no
-      // call to [write_cb]
-      
-      free_write_data(wd);
-      error("Error on writing client stream", r);
-    }
+    set_stat(
+      isolate, fields, stat_fields[f].name,
+      (offsetof(stats_row, counters) + stat_fields[f].offset) /
+        sizeof(uint64_t));
   }
-  else if (nread < 0)
-  {
-    if (nread != UV_EOF)
-      error("Error on reading client stream", nread);
 
-    close_and_free(stream);
-  }
-  
-  if (in_data) ::free(in_data);
+  set_stat(isolate, obj, "rows", worker_count_);
+  set_stat(isolate, obj, "rowLength", sizeof(stats_row) / sizeof(uint64_t));
+  set_stat(
+    isolate, obj, "sequence", offsetof(stats_row, sequence) / sizeof(uint64_t));
+  obj->Set(
+    context,
+    v8::String::NewFromUtf8(isolate, "fields").ToLocalChecked(),
+    fields
+    ).FromJust();
+  set_stat(
+    isolate, obj, "writeLatency",
+    offsetof(stats_row, write_latency) / sizeof(uint64_t));
+  set_stat(isolate, obj, "writeLatencyBuckets", write_latency_buckets);
+
+  args.GetReturnValue().Set(obj);
 }
 
 
-static void connection_cb(uv_stream_t * server, int status)
+struct traced_event
 {
-  if (status < 0)
+  trace_event event;
+  size_t worker;
+};
+
+
+static int compare_traced_cb(const void *a, const void *b)
+{
+  uint64_t ta = reinterpret_cast<const traced_event *>(a)->event.time;
+  uint64_t tb = reinterpret_cast<const traced_event *>(b)->event.time;
+  return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+
+static traced_event *collect_trace(size_t *count)
+{
+  // Returns the events recorded by all workers, oldest first, or NULL if out
+  // of memory. The caller frees the result.
+
+  trace_event *ring = reinterpret_cast<trace_event *>(
+    ::malloc((trace_size_ != 0 ? trace_size_ : 1) * sizeof(trace_event)));
+  traced_event *all = reinterpret_cast<traced_event *>(
+    ::malloc((worker_count_ * trace_size_ + 1) * sizeof(traced_event)));
+  if (!ring || !all)
   {
-    error("Error on listening", status);
-    return; // Assuming no connection to accept.
+    ::free(ring);
+    ::free(all);
+    return NULL;
   }
-  
-  uv_tcp_t *client = reinterpret_cast<uv_tcp_t *>(::malloc(sizeof(uv_tcp_t)));
-  uv_tcp_init(loop_, client);
-  
-  int r = uv_accept(server, reinterpret_cast<uv_stream_t *>(client));
-  if (r == 0)
+
+  *count = 0;
+  for (size_t i = 0; trace_size_ != 0 && i < worker_count_; ++i)
   {
-    // Start reading. We continue reading until calling uv_read_stop() or
-    // uv_close().
-    
-    r = uv_read_start(
-      reinterpret_cast<uv_stream_t *>(client), alloc_cb, read_cb
-      );
-    if (r == 0)
-    {
-      // Reads are pending. [read_cb] will be called when data has been read.
-    }
-    else
+    size_t n = copy_trace(&workers_[i], ring);
+    for (size_t j = 0; j < n; ++j)
     {
-      close_and_free(reinterpret_cast<uv_stream_t *>(client));
-      error("Error on reading client stream", r);
+      all[*count].event = ring[j];
+      all[*count].worker = i;
+      ++*count;
     }
   }
-  else
+
+  ::free(ring);
+  ::qsort(all, *count, sizeof(traced_event), compare_traced_cb);
+  return all;
+}
+
+
+static void trace(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // trace()
+  //
+  // Returns the connection events that the workers have kept, see the
+  // traceEvents option of start, oldest first:
+  //
+  //   [{ time, worker, connection, type, value[, code] }, ...]
+  //
+  // [time] is a BigInt in nanoseconds on the clock of
+  // process.hrtime.bigint(). [type] is 'accept', 'read', 'write', 'error' or
+  // 'close'. [value] is the number of bytes read or written, or the error
+  // code, in which case [code] is its name, such as 'ECONNRESET'. End of
+  // file is reported as the error 'EOF'.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (!check_started(isolate)) return;
+
+  size_t count;
+  traced_event *events = collect_trace(&count);
+  if (!events)
   {
-    ::free(client);
-    error("Error on accepting client connection", r);
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Out of memory").ToLocalChecked()));
+    return;
+  }
+
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Array> result = v8::Array::New(isolate, count);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    const trace_event *e = &events[i].event;
+    v8::Local<v8::Object> obj = v8::Object::New(isolate);
+
+    obj->Set(
+      context,
+      v8::String::NewFromUtf8(isolate, "time").ToLocalChecked(),
+      v8::BigInt::NewFromUnsigned(isolate, e->time)
+      ).FromJust();
+    set_stat(isolate, obj, "worker", events[i].worker);
+    set_stat(isolate, obj, "connection", e->connection);
+    obj->Set(
+      context,
+      v8::String::NewFromUtf8(isolate, "type").ToLocalChecked(),
+      v8::String::NewFromUtf8(isolate, trace_types[e->type]).ToLocalChecked()
+      ).FromJust();
+    obj->Set(
+      context,
+      v8::String::NewFromUtf8(isolate, "value").ToLocalChecked(),
+      v8::Number::New(isolate, static_cast<double>(e->value))
+      ).FromJust();
+
+    if (e->type == TRACE_ERROR)
+    {
+      obj->Set(
+        context,
+        v8::String::NewFromUtf8(isolate, "code").ToLocalChecked(),
+        v8::String::NewFromUtf8(
+          isolate, uv_err_name(static_cast<int>(e->value))).ToLocalChecked()
+        ).FromJust();
+    }
+
+    result->Set(context, i, obj).FromJust();
   }
+
+  ::free(events);
+  args.GetReturnValue().Set(result);
 }
 
 
-static void start(const v8::FunctionCallbackInfo<v8::Value> &args)
+static void dump_trace(const v8::FunctionCallbackInfo<v8::Value> &args)
 {
+  // dumpTrace(path)
+  //
+  // Writes the events returned by trace to the file at [path], one per line:
+  //
+  //   <time> <worker> <connection> <type> <value or code>
+  //
+  // Returns the number of events written. Blocks until the file is written.
+
   v8::Isolate* isolate = args.GetIsolate();
 
-  if (args.Length() != 1) {
+  if (args.Length() != 1 || !args[0]->IsString())
+  {
     isolate->ThrowException(v8::Exception::TypeError(
-        v8::String::NewFromUtf8(isolate, "Wrong number of arguments")));
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
     return;
   }
 
-  if (!args[0]->IsNumber())
+  if (!check_started(isolate)) return;
+
+  size_t count;
+  traced_event *events = collect_trace(&count);
+  if (!events)
   {
-    isolate->ThrowException(v8::Exception::TypeError(
-        v8::String::NewFromUtf8(isolate, "Wrong arguments")));
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Out of memory").ToLocalChecked()));
     return;
   }
-  
-  if (loop_)
+
+  v8::String::Utf8Value path(isolate, args[0]);
+  FILE *file = ::fopen(*path, "w");
+  if (!file)
   {
-    isolate->ThrowException(v8::Exception::TypeError(
-        v8::String::NewFromUtf8(isolate, "Already started")));
+    ::free(events);
+    throw_errno(isolate, "Error on opening trace file");
     return;
   }
-  
-  int port = args[0]->IntegerValue(); // Truncated
-  
-  uv_loop_t *loop = uv_default_loop(); // Node.js uses the default loop.
-    
-  struct sockaddr_in addr;
-  int r = uv_ip4_addr("127.0.0.1", port, &addr);
-  if (r == 0)
+
+  for (size_t i = 0; i < count; ++i)
   {
-    // Note: Is it not clear from documentation if when handle is opened other
-    // then that there are no socket created on [uv_tcp_init]. So assuming it is
-    // opened on successful call to [uv_tcp_bind] and thus is should be closed
-    // on failed call to [uv_listen]
-    
-    uv_tcp_init(loop, &server_);
-    r = uv_tcp_bind(&server_, reinterpret_cast<sockaddr *>(&addr), 0);
-    if (r == 0)
-    {
-      r = uv_listen(
-        reinterpret_cast<uv_stream_t *>(&server_), 0, connection_cb
-        );
-      if (r == 0)
-      {
-        // Success.
+    const trace_event *e = &events[i].event;
 
-        loop_ = loop;
-      }
-      else
-      {
-        uv_close(reinterpret_cast<uv_handle_t *>(&server_), NULL);
-        error("Error on listening", r);
-      }
+    if (e->type == TRACE_ERROR)
+    {
+      ::fprintf(file, "%llu %zu %llu %s %s\n",
+                static_cast<unsigned long long>(e->time), events[i].worker,
+                static_cast<unsigned long long>(e->connection),
+                trace_types[e->type], uv_err_name(static_cast<int>(e->value)));
     }
     else
     {
-      error("Error on binding", r);
+      ::fprintf(file, "%llu %zu %llu %s %lld\n",
+                static_cast<unsigned long long>(e->time), events[i].worker,
+                static_cast<unsigned long long>(e->connection),
+                trace_types[e->type], static_cast<long long>(e->value));
     }
   }
-  else
+
+  ::free(events);
+
+  bool failed = ::ferror(file) != 0;
+  if (::fclose(file) != 0 || failed)
   {
-    error("Error on parsing address", r);
+    throw_errno(isolate, "Error on writing trace file");
+    return;
   }
-  
-  if (r != 0)
+
+  args.GetReturnValue().Set(static_cast<double>(count));
+}
+
+
+static void on(const v8::FunctionCallbackInfo<v8::Value> &args)
+{
+  // on(event, listener)
+  //
+  // Sets the listener of [event], replacing any previous listener. A
+  // [listener] of null removes it.
+  //
+  // Events:
+  //   evict({ id, reason, queuedBytes, oldestWriteAge }): A connection has
+  //       been evicted for not reading fast enough. [reason] is
+  //       'writeTimeout' or 'maxQueuedBytes'.
+  //   messages([{ id, data }, ...]): WebSocket messages have been read.
+  //       [data] is a string for text messages and a Buffer for binary ones.
+  //       Messages are passed in batches, in the order they were read from
+  //       each connection.
+  //   log({ message, code, suppressed }): An error has been logged, such as
+  //       'Error on reading client stream: connection reset by peer.' with
+  //       [code] 'ECONNRESET'. Errors are rate limited per message and code;
+  //       [suppressed] is 0, or the number of such errors that were not
+  //       logged when this is their summary. If messages had to be dropped,
+  //       the listener is called with { message, dropped }. While there is a
+  //       listener, errors are not written to stderr.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  int event = -1;
+  if (args.Length() == 2 && args[0]->IsString())
+  {
+    v8::String::Utf8Value name(isolate, args[0]);
+    for (int i = 0; event_names[i]; ++i)
+      if (::strcmp(*name, event_names[i]) == 0) event = i;
+  }
+
+  if (event < 0 || !(args[1]->IsFunction() || args[1]->IsNull()))
   {
     isolate->ThrowException(v8::Exception::TypeError(
-        v8::String::NewFromUtf8(isolate, "Failed to start")));
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
     return;
   }
+
+  isolate_ = isolate;
+  context_.Reset(isolate, isolate->GetCurrentContext());
+
+  if (args[1]->IsFunction())
+    listeners_[event].Reset(isolate, args[1].As<v8::Function>());
+  else
+    listeners_[event].Reset();
+
+  if (event == EVENT_LOG)
+  {
+    uv_mutex_lock(&log_mutex_);
+    log_to_js_ = args[1]->IsFunction();
+    uv_mutex_unlock(&log_mutex_);
+  }
 }
 
 
 static void init(v8::Local<v8::Object> exports, v8::Local<v8::Object> module)
 {
+  uv_mutex_init(&log_mutex_);
+  uv_cond_init(&log_cond_);
+  uv_async_init(uv_default_loop(), &log_async_, log_async_cb);
+  uv_unref(reinterpret_cast<uv_handle_t *>(&log_async_));
+  node::AddEnvironmentCleanupHook(v8::Isolate::GetCurrent(), stop_log, NULL);
+
+  uv_mutex_init(&limits_mutex_);
+  uv_mutex_init(&events_mutex_);
+  message_queue_init(&messages_);
+
+  if (!kv_shards_init(&responses_, 0))
+  {
+    v8::Isolate *isolate = v8::Isolate::GetCurrent();
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, uv_strerror(UV_ENOMEM))
+            .ToLocalChecked()));
+    return;
+  }
+
+  uv_async_init(uv_default_loop(), &events_async_, events_async_cb);
+  uv_unref(reinterpret_cast<uv_handle_t *>(&events_async_));
+
   NODE_SET_METHOD(exports, "start", start);
+  NODE_SET_METHOD(exports, "listenerFd", listener_fd);
+  NODE_SET_METHOD(exports, "handOff", hand_off);
+  NODE_SET_METHOD(exports, "receiveListener", receive_listener);
+  NODE_SET_METHOD(exports, "stopListening", stop_listening);
+  NODE_SET_METHOD(exports, "setLimits", set_limits);
+  NODE_SET_METHOD(exports, "setResponse", set_response);
+  NODE_SET_METHOD(exports, "send", send);
+  NODE_SET_METHOD(exports, "broadcast", broadcast);
+  NODE_SET_METHOD(exports, "publish", publish);
+  NODE_SET_METHOD(exports, "stats", stats);
+  NODE_SET_METHOD(exports, "statsBuffer", stats_buffer);
+  NODE_SET_METHOD(exports, "statsLayout", stats_layout);
+  NODE_SET_METHOD(exports, "trace", trace);
+  NODE_SET_METHOD(exports, "dumpTrace", dump_trace);
+  NODE_SET_METHOD(exports, "on", on);
 }
 
 NODE_MODULE(echo_server, init)
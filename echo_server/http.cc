@@ -0,0 +1,582 @@
+#include "http.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SIMD_X86
+#endif
+
+
+namespace echo_server {
+
+
+static const size_t max_header_size = 8 * 1024;
+
+static const size_t max_body_size = 1024 * 1024;
+
+
+//
+// Scanning for the end of a line.
+//
+// Lines end at the first control character, which for a valid request is the
+// CR of a CRLF. Finding it also finds any other control character, which is
+// not allowed in a request or header line (tab is).
+//
+
+static const char *find_ctl_scalar(const char *p, const char *end)
+{
+  for (; p < end; ++p)
+  {
+    unsigned char c = *p;
+    if ((c < 0x20 && c != '\t') || c == 0x7f) return p;
+  }
+
+  return end;
+}
+
+
+#ifdef HTTP_SIMD_X86
+
+__attribute__((target("sse4.2")))
+static const char *find_ctl_sse42(const char *p, const char *end)
+{
+  // Byte ranges matched by [_mm_cmpestri], in pairs of lowest and highest.
+
+  static const char ranges[16] = { 0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f };
+
+  __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ranges));
+
+  while (end - p >= 16)
+  {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    int i = _mm_cmpestri(
+      r, 6, v, 16,
+      _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (i != 16) return p + i;
+
+    p += 16;
+  }
+
+  return find_ctl_scalar(p, end);
+}
+
+
+__attribute__((target("avx2")))
+static const char *find_ctl_avx2(const char *p, const char *end)
+{
+  const __m256i max_ctl = _mm256_set1_epi8(0x1f);
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i del = _mm256_set1_epi8(0x7f);
+
+  while (end - p >= 32)
+  {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+
+    // Unsigned v <= 0x1f, as signed compares would also match bytes >= 0x80.
+
+    __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, max_ctl), v);
+    ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), ctl);
+    ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, del));
+
+    unsigned mask = _mm256_movemask_epi8(ctl);
+    if (mask != 0) return p + __builtin_ctz(mask);
+
+    p += 32;
+  }
+
+  return find_ctl_scalar(p, end);
+}
+
+#endif
+
+
+typedef const char *(*scan_fn)(const char *p, const char *end);
+
+
+static scan_fn select_find_ctl()
+{
+#ifdef HTTP_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return find_ctl_avx2;
+  if (__builtin_cpu_supports("sse4.2")) return find_ctl_sse42;
+#endif
+
+  return find_ctl_scalar;
+}
+
+
+static const scan_fn find_ctl = select_find_ctl();
+
+
+//
+// Parsing.
+//
+
+enum parse_status
+{
+  PARSE_OK,
+  PARSE_INCOMPLETE,
+  PARSE_BAD_REQUEST,
+  PARSE_HEADER_TOO_LARGE,
+  PARSE_BODY_TOO_LARGE,
+  PARSE_NOT_IMPLEMENTED,
+};
+
+
+struct request
+{
+  const char *path; // Without the query.
+  size_t path_len;
+  bool get;
+  bool head;
+  int minor_version; // Of HTTP/1.x.
+  bool close;        // Close the connection after the response.
+};
+
+
+static parse_status parse_line(const char **p,
+                               const char *end,
+                               const char **line_end)
+{
+  // Finds the CRLF ending the line at [p] and moves [p] past it.
+
+  const char *q = find_ctl(*p, end);
+
+  if (q == end || (*q == '\r' && q + 1 == end)) return PARSE_INCOMPLETE;
+  if (q[0] != '\r' || q[1] != '\n') return PARSE_BAD_REQUEST;
+
+  *line_end = q;
+  *p = q + 2;
+  return PARSE_OK;
+}
+
+
+static bool equals(const char *s, size_t len, const char *literal)
+{
+  // Case insensitive comparison with [literal].
+
+  return len == ::strlen(literal) && ::strncasecmp(s, literal, len) == 0;
+}
+
+
+static void trim(const char **s, const char **end)
+{
+  while (*s < *end && (**s == ' ' || **s == '\t')) ++*s;
+  while (*end > *s && ((*end)[-1] == ' ' || (*end)[-1] == '\t')) --*end;
+}
+
+
+static void parse_connection(const char *value,
+                             const char *end,
+                             bool *close,
+                             bool *keep_alive)
+{
+  // Connection is a comma separated list of options.
+
+  while (value < end)
+  {
+    const char *comma =
+      reinterpret_cast<const char *>(::memchr(value, ',', end - value));
+    const char *option_end = comma ? comma : end;
+    const char *option = value;
+    trim(&option, &option_end);
+
+    if (equals(option, option_end - option, "close")) *close = true;
+    if (equals(option, option_end - option, "keep-alive")) *keep_alive = true;
+
+    value = comma ? comma + 1 : end;
+  }
+}
+
+
+static parse_status parse_content_length(const char *value,
+                                         const char *end,
+                                         size_t *content_length)
+{
+  if (value == end) return PARSE_BAD_REQUEST;
+
+  size_t n = 0;
+  for (; value < end; ++value)
+  {
+    if (*value < '0' || *value > '9') return PARSE_BAD_REQUEST;
+    n = n * 10 + (*value - '0');
+    if (n > max_body_size) return PARSE_BODY_TOO_LARGE;
+  }
+
+  *content_length = n;
+  return PARSE_OK;
+}
+
+
+static parse_status parse_request_line(const char *line,
+                                       const char *end,
+                                       request *req)
+{
+  // method SP request-target SP HTTP-version
+
+  const char *sp1 =
+    reinterpret_cast<const char *>(::memchr(line, ' ', end - line));
+  if (!sp1 || sp1 == line) return PARSE_BAD_REQUEST;
+
+  const char *target = sp1 + 1;
+  const char *sp2 =
+    reinterpret_cast<const char *>(::memchr(target, ' ', end - target));
+  if (!sp2 || sp2 == target) return PARSE_BAD_REQUEST;
+
+  const char *version = sp2 + 1;
+  if (end - version != 8 || ::memcmp(version, "HTTP/1.", 7) != 0 ||
+      version[7] < '0' || version[7] > '9')
+    return PARSE_BAD_REQUEST;
+
+  req->get = sp1 - line == 3 && ::memcmp(line, "GET", 3) == 0;
+  req->head = sp1 - line == 4 && ::memcmp(line, "HEAD", 4) == 0;
+
+  const char *query =
+    reinterpret_cast<const char *>(::memchr(target, '?', sp2 - target));
+  req->path = target;
+  req->path_len = (query ? query : sp2) - target;
+
+  req->minor_version = version[7] - '0';
+  return PARSE_OK;
+}
+
+
+static parse_status parse_request(const char **p,
+                                  const char *end,
+                                  request *req)
+{
+  // Parses the request at [p], including its body, and moves [p] past it.
+
+  const char *q = *p;
+
+  // The request line and headers must fit in [max_header_size], including
+  // any empty lines before the request line.
+
+  const char *limit =
+    static_cast<size_t>(end - q) > max_header_size ? q + max_header_size : end;
+
+  // Empty lines before the request line are ignored (RFC 9112, 2.2).
+
+  while (limit - q >= 2 && q[0] == '\r' && q[1] == '\n') q += 2;
+
+  const char *line = q;
+  const char *line_end;
+  parse_status status = parse_line(&q, limit, &line_end);
+
+  if (status == PARSE_OK)
+    status = parse_request_line(line, line_end, req);
+
+  bool close = false;
+  bool keep_alive = false;
+  size_t content_length = 0;
+  bool has_content_length = false;
+
+  while (status == PARSE_OK)
+  {
+    line = q;
+    status = parse_line(&q, limit, &line_end);
+    if (status != PARSE_OK || line == line_end) break;
+
+    // Obsolete line folding is not accepted.
+
+    if (*line == ' ' || *line == '\t') return PARSE_BAD_REQUEST;
+
+    const char *colon =
+      reinterpret_cast<const char *>(::memchr(line, ':', line_end - line));
+    if (!colon || colon == line || colon[-1] == ' ' || colon[-1] == '\t')
+      return PARSE_BAD_REQUEST;
+
+    const char *value = colon + 1;
+    const char *value_end = line_end;
+    trim(&value, &value_end);
+
+    size_t name_len = colon - line;
+
+    if (equals(line, name_len, "connection"))
+    {
+      parse_connection(value, value_end, &close, &keep_alive);
+    }
+    else if (equals(line, name_len, "content-length"))
+    {
+      size_t n;
+      status = parse_content_length(value, value_end, &n);
+      if (status != PARSE_OK) break;
+      if (has_content_length && n != content_length) return PARSE_BAD_REQUEST;
+
+      content_length = n;
+      has_content_length = true;
+    }
+    else if (equals(line, name_len, "transfer-encoding"))
+    {
+      status = PARSE_NOT_IMPLEMENTED;
+    }
+  }
+
+  if (status == PARSE_INCOMPLETE && limit != end)
+    return PARSE_HEADER_TOO_LARGE;
+  if (status != PARSE_OK) return status;
+
+  if (static_cast<size_t>(end - q) < content_length) return PARSE_INCOMPLETE;
+  q += content_length;
+
+  req->close = req->minor_version == 0 ? !keep_alive : close;
+
+  *p = q;
+  return PARSE_OK;
+}
+
+
+//
+// Responses.
+//
+// A formatted response is stored as the length of its header, as a uint32_t,
+// followed by the header and the body. The header ends with the
+// Content-Length line; the Connection line and the empty line ending the
+// header are added when responding.
+//
+
+struct canned_response
+{
+  const char *header;
+  const char *body;
+};
+
+static const canned_response not_found = {
+  "HTTP/1.1 404 Not Found\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 10\r\n",
+  "Not Found\n"
+};
+
+static const canned_response method_not_allowed = {
+  "HTTP/1.1 405 Method Not Allowed\r\n"
+  "Allow: GET, HEAD\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 19\r\n",
+  "Method Not Allowed\n"
+};
+
+//
+// Responses to requests that cannot be parsed. The connection is closed after
+// them.
+//
+
+static const canned_response bad_request = {
+  "HTTP/1.1 400 Bad Request\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 12\r\n",
+  "Bad Request\n"
+};
+
+static const canned_response content_too_large = {
+  "HTTP/1.1 413 Content Too Large\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 18\r\n",
+  "Content Too Large\n"
+};
+
+static const canned_response header_too_large = {
+  "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 32\r\n",
+  "Request Header Fields Too Large\n"
+};
+
+static const canned_response not_implemented = {
+  "HTTP/1.1 501 Not Implemented\r\n"
+  "Content-Type: text/plain\r\n"
+  "Content-Length: 16\r\n",
+  "Not Implemented\n"
+};
+
+
+static const char *reason_phrase(int status)
+{
+  switch (status)
+  {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "";
+  }
+}
+
+
+bool http_format(int status,
+                 const char *content_type, size_t content_type_len,
+                 const char *body, size_t body_len,
+                 buffer *out)
+{
+  char line[128];
+  int n = ::snprintf(
+    line, sizeof(line), "HTTP/1.1 %03d %s\r\n", status, reason_phrase(status));
+  int m = ::snprintf(
+    line + n, sizeof(line) - n, "Content-Length: %zu\r\n", body_len);
+
+  static const char content_type_name[] = "Content-Type: ";
+  uint32_t header_len =
+    n + sizeof(content_type_name) - 1 + content_type_len + 2 + m;
+
+  return buffer_reserve(out, sizeof(header_len) + header_len + body_len) &&
+    buffer_append(
+      out, reinterpret_cast<const char *>(&header_len), sizeof(header_len)) &&
+    buffer_append(out, line, n) &&
+    buffer_append(out, content_type_name, sizeof(content_type_name) - 1) &&
+    buffer_append(out, content_type, content_type_len) &&
+    buffer_append(out, "\r\n", 2) &&
+    buffer_append(out, line + n, m) &&
+    buffer_append(out, body, body_len);
+}
+
+
+static bool respond(const request *req,
+                    const char *header, size_t header_len,
+                    const char *body, size_t body_len,
+                    bool close,
+                    buffer *out)
+{
+  // HTTP/1.1 connections are kept alive unless told otherwise, HTTP/1.0
+  // connections only if told so.
+
+  const char *end_of_header =
+    close ? "Connection: close\r\n\r\n"
+    : req->minor_version == 0 ? "Connection: keep-alive\r\n\r\n"
+    : "\r\n";
+  size_t end_of_header_len = ::strlen(end_of_header);
+
+  if (req->head) body_len = 0;
+
+  return buffer_reserve(out, header_len + end_of_header_len + body_len) &&
+    buffer_append(out, header, header_len) &&
+    buffer_append(out, end_of_header, end_of_header_len) &&
+    buffer_append(out, body, body_len);
+}
+
+
+static bool respond_canned(const request *req,
+                           const canned_response *response,
+                           bool close,
+                           buffer *out)
+{
+  return respond(
+    req,
+    response->header, ::strlen(response->header),
+    response->body, ::strlen(response->body),
+    close,
+    out);
+}
+
+
+struct lookup
+{
+  const request *req;
+  buffer *out;
+  bool ok;
+};
+
+
+static void respond_cb(void *arg, const char *value, size_t value_len)
+{
+  // Called with the formatted response while its shard is locked.
+
+  lookup *l = reinterpret_cast<lookup *>(arg);
+
+  uint32_t header_len;
+  ::memcpy(&header_len, value, sizeof(header_len));
+  const char *header = value + sizeof(header_len);
+  const char *body = header + header_len;
+
+  l->ok = respond(
+    l->req,
+    header, header_len,
+    body, value + value_len - body,
+    l->req->close,
+    l->out);
+}
+
+
+static bool execute(kv_shards *responses, const request *req, buffer *out)
+{
+  // Appends the response to [req] to [out]. Returns false if out of memory.
+
+  if (!req->get && !req->head)
+    return respond_canned(req, &method_not_allowed, req->close, out);
+
+  lookup l = { req, out, true };
+  if (!kv_shards_get(responses, req->path, req->path_len, respond_cb, &l))
+    return respond_canned(req, &not_found, req->close, out);
+
+  return l.ok;
+}
+
+
+http_status http_execute(kv_shards *responses,
+                         const char *data, size_t len,
+                         buffer *out,
+                         size_t *consumed, size_t *requests)
+{
+  request req;
+
+  const char *p = data;
+  const char *end = data + len;
+
+  *requests = 0;
+
+  for (;;)
+  {
+    const char *next = p;
+    parse_status status = parse_request(&next, end, &req);
+
+    if (status == PARSE_INCOMPLETE) break;
+
+    if (status != PARSE_OK)
+    {
+      const canned_response *response =
+        status == PARSE_HEADER_TOO_LARGE ? &header_too_large
+        : status == PARSE_BODY_TOO_LARGE ? &content_too_large
+        : status == PARSE_NOT_IMPLEMENTED ? &not_implemented
+        : &bad_request;
+
+      request unparsed = { NULL, 0, false, false, 1, true };
+
+      *consumed = p - data;
+      return respond_canned(&unparsed, response, true, out)
+        ? HTTP_CLOSE
+        : HTTP_OUT_OF_MEMORY;
+    }
+
+    if (!execute(responses, &req, out))
+    {
+      *consumed = p - data;
+      return HTTP_OUT_OF_MEMORY;
+    }
+
+    ++*requests;
+    p = next;
+
+    if (req.close)
+    {
+      *consumed = p - data;
+      return HTTP_CLOSE;
+    }
+  }
+
+  *consumed = p - data;
+  return HTTP_OK;
+}
+
+} // namespace echo_server
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "buffer.h"
+#include "kv_shards.h"
+
+namespace echo_server {
+
+//
+// Minimal HTTP/1.1 responder.
+//
+// Answers GET and HEAD requests with responses looked up by path (without the
+// query) in a [kv_shards] of preformatted responses, see [http_format]. Other
+// methods get 405 and unknown paths 404. Connections are kept alive as HTTP/1.1
+// and HTTP/1.0 define, and pipelined requests are answered in order. Request
+// bodies are read and ignored; chunked request bodies are not supported.
+//
+// Request and header lines are scanned for their end with SSE4.2 or AVX2 when
+// the CPU has them.
+//
+
+enum http_status
+{
+  HTTP_OK,
+  HTTP_CLOSE, // The connection is to be closed after the output is written.
+  HTTP_OUT_OF_MEMORY,
+};
+
+//
+// Formats a response with [status], [content_type] and [body] into [out], to
+// be stored as the value of its path. Returns false if out of memory.
+//
+extern bool http_format(int status,
+                        const char *content_type, size_t content_type_len,
+                        const char *body, size_t body_len,
+                        buffer *out);
+
+//
+// Answers the complete requests at the start of [data] and appends the
+// responses to [out]. [consumed] is set to the number of bytes of the answered
+// requests; the rest is an incomplete request that has to be passed again once
+// more data has arrived. [requests] is set to the number of requests answered.
+//
+extern http_status http_execute(kv_shards *responses,
+                                const char *data, size_t len,
+                                buffer *out,
+                                size_t *consumed, size_t *requests);
+
+} // namespace echo_server
@@ -0,0 +1,157 @@
+#include "kv_shards.h"
+
+#include <uv.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+namespace echo_server {
+
+
+struct alignas(64) kv_shard
+{
+  uv_rwlock_t lock;
+  kv_store store;
+  size_t memory_budget; // 0 for no limit.
+  size_t evicted;
+};
+
+
+static kv_shard *shard_of(kv_shards *shards, uint64_t hash)
+{
+  // The stores use the low bits of the hash to find the slot, so the shard is
+  // picked by the high bits.
+
+  return &shards->shards[hash >> 58];
+}
+
+static_assert(KV_SHARDS == 64, "shard_of() takes 6 bits of the hash");
+
+
+bool kv_shards_init(kv_shards *shards, size_t memory_budget)
+{
+  void *mem;
+  if (::posix_memalign(&mem, alignof(kv_shard), KV_SHARDS * sizeof(kv_shard)))
+    return false;
+
+  shards->shards = reinterpret_cast<kv_shard *>(mem);
+
+  for (size_t i = 0; i < KV_SHARDS; ++i)
+  {
+    kv_shard *shard = &shards->shards[i];
+    uv_rwlock_init(&shard->lock);
+    kv_init(&shard->store);
+    shard->memory_budget = memory_budget / KV_SHARDS;
+    shard->evicted = 0;
+
+    if (memory_budget != 0 && shard->memory_budget == 0)
+      shard->memory_budget = 1;
+
+    // Chunks no larger than the budget, so that evicting can bring the arena
+    // back within it.
+
+    if (memory_budget != 0)
+      kv_set_chunk_size(&shard->store, shard->memory_budget);
+  }
+
+  return true;
+}
+
+
+void kv_shards_free(kv_shards *shards)
+{
+  for (size_t i = 0; i < KV_SHARDS; ++i)
+  {
+    kv_shard *shard = &shards->shards[i];
+    kv_free(&shard->store);
+    uv_rwlock_destroy(&shard->lock);
+  }
+
+  ::free(shards->shards);
+  shards->shards = NULL;
+}
+
+
+bool kv_shards_get(kv_shards *shards,
+                   const char *key, size_t key_len,
+                   kv_value_cb cb, void *arg)
+{
+  uint64_t hash = kv_hash(key, key_len);
+  kv_shard *shard = shard_of(shards, hash);
+
+  uv_rwlock_rdlock(&shard->lock);
+
+  const char *value;
+  size_t value_len;
+  bool found = kv_get(&shard->store, hash, key, key_len, &value, &value_len);
+  if (found) cb(arg, value, value_len);
+
+  uv_rwlock_rdunlock(&shard->lock);
+
+  return found;
+}
+
+
+bool kv_shards_set(kv_shards *shards,
+                   const char *key, size_t key_len,
+                   const char *value, size_t value_len)
+{
+  uint64_t hash = kv_hash(key, key_len);
+  kv_shard *shard = shard_of(shards, hash);
+
+  uv_rwlock_wrlock(&shard->lock);
+
+  bool ok = kv_set(&shard->store, hash, key, key_len, value, value_len);
+
+  // Evict other entries until the arena is back within budget. An entry that
+  // is over the budget on its own is not kept.
+
+  if (ok && shard->memory_budget != 0)
+  {
+    while (shard->store.memory > shard->memory_budget &&
+           kv_evict(&shard->store, hash, key, key_len))
+      ++shard->evicted;
+
+    if (shard->store.memory > shard->memory_budget)
+    {
+      kv_del(&shard->store, hash, key, key_len);
+      ok = false;
+    }
+  }
+
+  uv_rwlock_wrunlock(&shard->lock);
+
+  return ok;
+}
+
+
+bool kv_shards_del(kv_shards *shards, const char *key, size_t key_len)
+{
+  uint64_t hash = kv_hash(key, key_len);
+  kv_shard *shard = shard_of(shards, hash);
+
+  uv_rwlock_wrlock(&shard->lock);
+  bool found = kv_del(&shard->store, hash, key, key_len);
+  uv_rwlock_wrunlock(&shard->lock);
+
+  return found;
+}
+
+
+void kv_shards_get_stats(kv_shards *shards, kv_shards_stats *stats)
+{
+  ::memset(stats, 0, sizeof(*stats));
+
+  for (size_t i = 0; i < KV_SHARDS; ++i)
+  {
+    kv_shard *shard = &shards->shards[i];
+
+    uv_rwlock_rdlock(&shard->lock);
+    stats->keys += shard->store.count;
+    stats->memory += shard->store.memory;
+    stats->evicted += shard->evicted;
+    uv_rwlock_rdunlock(&shard->lock);
+  }
+}
+
+} // namespace echo_server
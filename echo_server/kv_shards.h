@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kv_store.h"
+
+namespace echo_server {
+
+//
+// Key-value store shared by the worker threads.
+//
+// Keys are spread over a fixed number of shards by their hash. Each shard is a
+// [kv_store] behind its own read-write lock, so lookups of different keys, and
+// of the same key, run in parallel while modifications only block the shard
+// they modify. Shards are cache line aligned so that the locks of different
+// shards never share a cache line.
+//
+// With a memory budget, each shard gets an equal part of it and evicts entries
+// with the CLOCK algorithm when a set leaves its arena over its part. The
+// arena chunks of a shard are no larger than its part, so a set fails only
+// for an entry that does not fit in the part by itself.
+//
+
+enum { KV_SHARDS = 64 };
+
+struct kv_shard;
+
+struct kv_shards
+{
+  kv_shard *shards;
+};
+
+//
+// Called with the value of a key while its shard is locked.
+//
+typedef void (*kv_value_cb)(void *arg, const char *value, size_t value_len);
+
+
+//
+// [memory_budget] is the number of bytes that entries may use. 0 for no
+// limit. Returns false if out of memory.
+//
+extern bool kv_shards_init(kv_shards *shards, size_t memory_budget);
+
+extern void kv_shards_free(kv_shards *shards);
+
+//
+// Looks up [key] and calls [cb] with its value. Returns false if there is no
+// such key.
+//
+extern bool kv_shards_get(kv_shards *shards,
+                          const char *key, size_t key_len,
+                          kv_value_cb cb, void *arg);
+
+//
+// Sets [key] to [value]. Returns false if out of memory or if the entry does
+// not fit in the memory budget of its shard; [key] is then removed.
+//
+extern bool kv_shards_set(kv_shards *shards,
+                          const char *key, size_t key_len,
+                          const char *value, size_t value_len);
+
+//
+// Removes [key]. Returns false if there was no such key.
+//
+extern bool kv_shards_del(kv_shards *shards, const char *key, size_t key_len);
+
+struct kv_shards_stats
+{
+  size_t keys;
+  size_t memory;  // Bytes of the arenas holding entries.
+  size_t evicted; // Entries evicted to stay within the memory budget.
+};
+
+extern void kv_shards_get_stats(kv_shards *shards, kv_shards_stats *stats);
+
+} // namespace echo_server
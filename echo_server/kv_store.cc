@@ -0,0 +1,481 @@
+#include "kv_store.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+namespace echo_server {
+
+
+//
+// An entry is a block of the arena holding the key followed by the value.
+// Entries too large for a chunk are allocated on their own and have
+// [size_class] KV_SIZE_CLASSES. Free blocks keep the header, so that the
+// buddy of a block being freed can be told to be free and whole.
+//
+struct kv_entry
+{
+  uint32_t key_len;
+  uint32_t value_len;
+  uint16_t size_class;
+  uint16_t is_free;
+  uint32_t referenced; // CLOCK reference bit.
+
+  // Link free blocks of the same size class. Overlap the key.
+  kv_entry *&next_free()
+  {
+    return reinterpret_cast<kv_entry **>(this + 1)[0];
+  }
+
+  kv_entry *&prev_free()
+  {
+    return reinterpret_cast<kv_entry **>(this + 1)[1];
+  }
+
+  char *key() { return reinterpret_cast<char *>(this + 1); }
+  char *value() { return key() + key_len; }
+};
+
+
+static const size_t min_block_size = 32;
+
+static_assert(sizeof(kv_entry) + 2 * sizeof(kv_entry *) <= min_block_size,
+              "A free block holds its header and two links");
+
+static const size_t min_slots = 64;
+
+static const size_t cache_line_size = 64;
+
+
+static size_t block_size(uint32_t size_class)
+{
+  return min_block_size << size_class;
+}
+
+
+static uint32_t size_class_of(size_t size)
+{
+  uint32_t size_class = 0;
+  while (size_class < KV_SIZE_CLASSES && block_size(size_class) < size)
+    ++size_class;
+
+  return size_class;
+}
+
+
+static void push_free(kv_store *store, kv_entry *block, uint32_t size_class)
+{
+  kv_entry *head = store->free_blocks[size_class];
+
+  block->size_class = size_class;
+  block->is_free = 1;
+  block->next_free() = head;
+  block->prev_free() = NULL;
+
+  if (head) head->prev_free() = block;
+  store->free_blocks[size_class] = block;
+}
+
+
+static void unlink_free(kv_store *store, kv_entry *block)
+{
+  kv_entry *next = block->next_free();
+  kv_entry *prev = block->prev_free();
+
+  if (next) next->prev_free() = prev;
+  if (prev) prev->next_free() = next;
+  else store->free_blocks[block->size_class] = next;
+
+  block->is_free = 0;
+}
+
+
+static kv_entry *buddy_of(kv_entry *block, uint32_t size_class)
+{
+  // Chunks are aligned to their size, so a block and its buddy differ only
+  // in the bit of their size.
+
+  return reinterpret_cast<kv_entry *>(
+    reinterpret_cast<uintptr_t>(block) ^ block_size(size_class));
+}
+
+
+static kv_entry *alloc_entry(kv_store *store, size_t key_len, size_t value_len)
+{
+  size_t size = sizeof(kv_entry) + key_len + value_len;
+  uint32_t size_class = size_class_of(size);
+  kv_entry *entry;
+
+  if (size_class > store->chunk_class)
+  {
+    entry = reinterpret_cast<kv_entry *>(::malloc(size));
+    if (!entry) return NULL;
+
+    size_class = KV_SIZE_CLASSES;
+    store->memory += size;
+    store->used += size;
+  }
+  else
+  {
+    // Take the smallest free block that is large enough, or a new chunk, and
+    // split off halves of it until it has the size wanted.
+
+    uint32_t c = size_class;
+    while (c <= store->chunk_class && !store->free_blocks[c]) ++c;
+
+    if (c <= store->chunk_class)
+    {
+      entry = store->free_blocks[c];
+      unlink_free(store, entry);
+    }
+    else
+    {
+      size_t csize = block_size(store->chunk_class);
+
+      void *mem;
+      if (::posix_memalign(&mem, csize, csize) != 0) return NULL;
+
+      entry = reinterpret_cast<kv_entry *>(mem);
+      store->memory += csize;
+      c = store->chunk_class;
+    }
+
+    while (c > size_class)
+    {
+      --c;
+      push_free(store, reinterpret_cast<kv_entry *>(
+        reinterpret_cast<char *>(entry) + block_size(c)), c);
+    }
+
+    store->used += block_size(size_class);
+  }
+
+  entry->key_len = key_len;
+  entry->value_len = value_len;
+  entry->size_class = size_class;
+  entry->is_free = 0;
+  return entry;
+}
+
+
+static bool is_referenced(kv_entry *entry)
+{
+  return __atomic_load_n(&entry->referenced, __ATOMIC_RELAXED) != 0;
+}
+
+
+static void set_referenced(kv_entry *entry, uint32_t referenced)
+{
+  // Skip the store if the bit already has the value, so that lookups of a hot
+  // key do not keep invalidating its cache line on other cores.
+
+  if (__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED) != referenced)
+    __atomic_store_n(&entry->referenced, referenced, __ATOMIC_RELAXED);
+}
+
+
+static void free_entry(kv_store *store, kv_entry *entry)
+{
+  if (entry->size_class == KV_SIZE_CLASSES)
+  {
+    size_t size = sizeof(kv_entry) + entry->key_len + entry->value_len;
+    store->memory -= size;
+    store->used -= size;
+    ::free(entry);
+    return;
+  }
+
+  uint32_t size_class = entry->size_class;
+  store->used -= block_size(size_class);
+
+  // Merge the block with its buddy while that is free and whole. A chunk
+  // merged back together holds no entries and is returned.
+
+  while (size_class < store->chunk_class)
+  {
+    kv_entry *buddy = buddy_of(entry, size_class);
+    if (!buddy->is_free || buddy->size_class != size_class) break;
+
+    unlink_free(store, buddy);
+    if (buddy < entry) entry = buddy;
+    ++size_class;
+  }
+
+  if (size_class == store->chunk_class)
+  {
+    store->memory -= block_size(size_class);
+    ::free(entry);
+    return;
+  }
+
+  push_free(store, entry, size_class);
+}
+
+
+static bool entry_fits(const kv_entry *entry, size_t key_len, size_t value_len)
+{
+  return entry->size_class != KV_SIZE_CLASSES &&
+    sizeof(kv_entry) + key_len + value_len <= block_size(entry->size_class);
+}
+
+
+static uint64_t rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+
+uint64_t kv_hash(const char *key, size_t len)
+{
+  // MurmurHash3 style mixing of 8 bytes at a time.
+
+  const uint64_t c1 = 0x87c37b91114253d5ull;
+  const uint64_t c2 = 0x4cf5ad432745937full;
+
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+
+  while (len >= 8)
+  {
+    uint64_t k;
+    ::memcpy(&k, key, 8);
+    k = rotl(k * c1, 31) * c2;
+    h = rotl(h ^ k, 27) * 5 + 0x52dce729;
+
+    key += 8;
+    len -= 8;
+  }
+
+  uint64_t k = 0;
+  for (size_t i = 0; i < len; ++i)
+    k |= static_cast<uint64_t>(static_cast<unsigned char>(key[i])) << (i * 8);
+  h ^= rotl(k * c1, 31) * c2;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+
+  return h;
+}
+
+
+static size_t find_slot(const kv_store *store,
+                        uint64_t hash,
+                        const char *key, size_t key_len)
+{
+  // Returns the slot holding [key] or the empty slot where it would be
+  // inserted.
+
+  size_t i = hash & store->mask;
+
+  for (;;)
+  {
+    kv_entry *entry = store->slots[i].entry;
+    if (!entry) return i;
+
+    if (store->slots[i].hash == hash && entry->key_len == key_len &&
+        ::memcmp(entry->key(), key, key_len) == 0)
+      return i;
+
+    i = (i + 1) & store->mask;
+  }
+}
+
+
+static bool grow(kv_store *store)
+{
+  size_t n = store->slots ? (store->mask + 1) * 2 : min_slots;
+
+  // Align the slots so that a probe sequence touches as few cache lines as
+  // possible.
+
+  void *mem;
+  if (::posix_memalign(&mem, cache_line_size, n * sizeof(kv_slot)) != 0)
+    return false;
+
+  kv_slot *slots = reinterpret_cast<kv_slot *>(mem);
+  ::memset(slots, 0, n * sizeof(kv_slot));
+
+  kv_slot *old_slots = store->slots;
+  size_t old_n = old_slots ? store->mask + 1 : 0;
+
+  store->slots = slots;
+  store->mask = n - 1;
+
+  for (size_t i = 0; i < old_n; ++i)
+  {
+    if (!old_slots[i].entry) continue;
+
+    size_t j = old_slots[i].hash & store->mask;
+    while (slots[j].entry) j = (j + 1) & store->mask;
+    slots[j] = old_slots[i];
+  }
+
+  ::free(old_slots);
+  return true;
+}
+
+
+void kv_init(kv_store *store)
+{
+  ::memset(store, 0, sizeof(*store));
+  store->chunk_class = KV_SIZE_CLASSES - 1;
+}
+
+
+void kv_free(kv_store *store)
+{
+  // Chunks are returned once all their entries are freed.
+
+  for (size_t i = 0; store->slots && i <= store->mask; ++i)
+  {
+    kv_entry *entry = store->slots[i].entry;
+    if (entry) free_entry(store, entry);
+  }
+
+  ::free(store->slots);
+  kv_init(store);
+}
+
+
+void kv_set_chunk_size(kv_store *store, size_t size)
+{
+  uint32_t size_class = 0;
+  while (size_class + 1 < KV_SIZE_CLASSES &&
+         block_size(size_class + 1) <= size)
+    ++size_class;
+
+  store->chunk_class = size_class;
+}
+
+
+bool kv_get(kv_store *store, uint64_t hash,
+            const char *key, size_t key_len,
+            const char **value, size_t *value_len)
+{
+  if (store->count == 0) return false;
+
+  size_t i = find_slot(store, hash, key, key_len);
+  kv_entry *entry = store->slots[i].entry;
+  if (!entry) return false;
+
+  set_referenced(entry, 1);
+
+  *value = entry->value();
+  *value_len = entry->value_len;
+  return true;
+}
+
+
+bool kv_set(kv_store *store, uint64_t hash,
+            const char *key, size_t key_len,
+            const char *value, size_t value_len)
+{
+  // Keep the load factor at or below 3/4.
+
+  if (!store->slots || (store->count + 1) * 4 > (store->mask + 1) * 3)
+    if (!grow(store)) return false;
+
+  size_t i = find_slot(store, hash, key, key_len);
+  kv_entry *entry = store->slots[i].entry;
+
+  if (entry && entry_fits(entry, key_len, value_len))
+  {
+    // Overwrite in place.
+
+    entry->value_len = value_len;
+    ::memcpy(entry->value(), value, value_len);
+    set_referenced(entry, 1);
+    return true;
+  }
+
+  kv_entry *new_entry = alloc_entry(store, key_len, value_len);
+  if (!new_entry) return false;
+
+  ::memcpy(new_entry->key(), key, key_len);
+  ::memcpy(new_entry->value(), value, value_len);
+
+  // New entries start out referenced so that they get a full turn of the
+  // clock before they can be evicted.
+
+  new_entry->referenced = 1;
+
+  if (entry) free_entry(store, entry);
+  else ++store->count;
+
+  store->slots[i].hash = hash;
+  store->slots[i].entry = new_entry;
+  return true;
+}
+
+
+static void remove_slot(kv_store *store, size_t i)
+{
+  // Removes the entry in slot [i].
+
+  free_entry(store, store->slots[i].entry);
+  --store->count;
+
+  // Shift back the entries following the removed one that would otherwise
+  // no longer be reachable from their home slot.
+
+  size_t j = i;
+  for (;;)
+  {
+    j = (j + 1) & store->mask;
+    if (!store->slots[j].entry) break;
+
+    size_t home = store->slots[j].hash & store->mask;
+    bool in_place = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if (in_place) continue;
+
+    store->slots[i] = store->slots[j];
+    i = j;
+  }
+
+  store->slots[i].entry = NULL;
+}
+
+
+bool kv_del(kv_store *store, uint64_t hash, const char *key, size_t key_len)
+{
+  if (store->count == 0) return false;
+
+  size_t i = find_slot(store, hash, key, key_len);
+  if (!store->slots[i].entry) return false;
+
+  remove_slot(store, i);
+  return true;
+}
+
+
+bool kv_evict(kv_store *store, uint64_t keep_hash,
+              const char *keep_key, size_t keep_key_len)
+{
+  if (store->count == 0) return false;
+
+  size_t keep = find_slot(store, keep_hash, keep_key, keep_key_len);
+  kv_entry *kept = store->slots[keep].entry;
+  if (kept && store->count == 1) return false;
+
+  // The hand stays on a slot it has removed from, as another entry may have
+  // been shifted into it.
+
+  for (;;)
+  {
+    size_t i = store->clock_hand & store->mask;
+    kv_entry *entry = store->slots[i].entry;
+
+    if (entry && entry != kept && !is_referenced(entry))
+    {
+      remove_slot(store, i);
+      return true;
+    }
+
+    if (entry) set_referenced(entry, 0);
+    store->clock_hand = i + 1;
+  }
+}
+
+} // namespace echo_server
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace echo_server {
+
+//
+// In-memory key-value store.
+//
+// Keys are looked up in an open addressing hash table (linear probing,
+// backward shift deletion so there are no tombstones). The table only holds
+// the hash and a pointer to the entry; keys and values are stored together in
+// entries allocated from an arena of chunks. Blocks of the arena come in power
+// of two size classes and are managed as buddies: a free block is split to
+// serve a smaller class and is merged with its buddy when both are free, so
+// freed memory is reused by entries of any class and a chunk whose entries
+// have all been removed is returned to the system. Entries larger than a
+// chunk are allocated on their own.
+//
+// Each entry has a reference bit for CLOCK eviction ([kv_evict]). The bit is
+// set by [kv_get] with a relaxed atomic store, so lookups may run
+// concurrently with each other (but not with modifications).
+//
+// Functions taking a [hash] expect the [kv_hash] of the key.
+//
+
+enum { KV_SIZE_CLASSES = 16 }; // Block sizes 32 B to 1 MiB.
+
+struct kv_entry;
+
+struct kv_slot
+{
+  uint64_t hash;
+  kv_entry *entry; // NULL if the slot is empty.
+};
+
+struct kv_store
+{
+  kv_slot *slots; // Cache line aligned, so are groups of four slots.
+  size_t mask;    // Number of slots - 1. Number of slots is a power of two.
+  size_t count;
+  size_t clock_hand; // Next slot to be considered by [kv_evict].
+
+  uint32_t chunk_class; // Size class of the arena chunks.
+  kv_entry *free_blocks[KV_SIZE_CLASSES];
+
+  size_t memory; // Bytes of the chunks and of the entries allocated alone.
+  size_t used;   // Bytes in blocks that hold entries.
+};
+
+
+extern void kv_init(kv_store *store);
+
+extern void kv_free(kv_store *store);
+
+//
+// Limits the arena chunks to [size] bytes (rounded down to a block size, 1 MiB
+// by default), so that a store kept small does not hold a large chunk for a
+// few entries. Must be called while the store is empty.
+//
+extern void kv_set_chunk_size(kv_store *store, size_t size);
+
+extern uint64_t kv_hash(const char *key, size_t key_len);
+
+//
+// Looks up [key]. On success [value] points into the store and is valid until
+// the store is next modified.
+//
+extern bool kv_get(kv_store *store, uint64_t hash,
+                   const char *key, size_t key_len,
+                   const char **value, size_t *value_len);
+
+//
+// Sets [key] to [value]. Returns false if out of memory.
+//
+extern bool kv_set(kv_store *store, uint64_t hash,
+                   const char *key, size_t key_len,
+                   const char *value, size_t value_len);
+
+//
+// Removes [key]. Returns false if there was no such key.
+//
+extern bool kv_del(kv_store *store, uint64_t hash,
+                   const char *key, size_t key_len);
+
+//
+// Removes an entry other than [keep_key] that has not been looked up since the
+// clock hand last passed it. Returns false if there is no other entry.
+//
+extern bool kv_evict(kv_store *store, uint64_t keep_hash,
+                     const char *keep_key, size_t keep_key_len);
+
+} // namespace echo_server
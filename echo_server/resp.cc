@@ -0,0 +1,411 @@
+#include "resp.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+
+namespace echo_server {
+
+
+static const size_t max_args = 1024;
+
+static const long long max_bulk_len = 512 * 1024 * 1024;
+
+
+enum parse_status
+{
+  PARSE_OK,
+  PARSE_INCOMPLETE,
+  PARSE_ERROR,
+};
+
+
+struct command
+{
+  size_t argc;
+  const char *argv[max_args];
+  size_t argv_len[max_args];
+};
+
+
+static parse_status parse_line_integer(const char **p,
+                                       const char *end,
+                                       long long *value)
+{
+  // Parses the integer terminated by CRLF at [p] and moves [p] past the CRLF.
+
+  const char *q = *p;
+  bool negative = false;
+  long long v = 0;
+
+  if (q < end && *q == '-')
+  {
+    negative = true;
+    ++q;
+  }
+
+  const char *digits = q;
+  while (q < end && *q >= '0' && *q <= '9')
+  {
+    v = v * 10 + (*q - '0');
+    if (v > max_bulk_len) return PARSE_ERROR;
+    ++q;
+  }
+
+  if (end - q < 2) return PARSE_INCOMPLETE;
+  if (q == digits || q[0] != '\r' || q[1] != '\n') return PARSE_ERROR;
+
+  *value = negative ? -v : v;
+  *p = q + 2;
+  return PARSE_OK;
+}
+
+
+static parse_status parse_command(const char **p,
+                                  const char *end,
+                                  command *cmd)
+{
+  // Parses an array of bulk strings at [p] and moves [p] past it.
+
+  const char *q = *p;
+
+  if (q == end) return PARSE_INCOMPLETE;
+  if (*q++ != '*') return PARSE_ERROR;
+
+  long long argc;
+  parse_status status = parse_line_integer(&q, end, &argc);
+  if (status != PARSE_OK) return status;
+  if (argc < 1 || argc > static_cast<long long>(max_args)) return PARSE_ERROR;
+
+  for (long long i = 0; i < argc; ++i)
+  {
+    if (q == end) return PARSE_INCOMPLETE;
+    if (*q++ != '$') return PARSE_ERROR;
+
+    long long len;
+    status = parse_line_integer(&q, end, &len);
+    if (status != PARSE_OK) return status;
+    if (len < 0) return PARSE_ERROR;
+
+    if (end - q < len + 2) return PARSE_INCOMPLETE;
+    if (q[len] != '\r' || q[len + 1] != '\n') return PARSE_ERROR;
+
+    cmd->argv[i] = q;
+    cmd->argv_len[i] = len;
+    q += len + 2;
+  }
+
+  cmd->argc = argc;
+  *p = q;
+  return PARSE_OK;
+}
+
+
+static bool reply_literal(buffer *out, const char *s)
+{
+  return buffer_append(out, s, ::strlen(s));
+}
+
+
+static bool reply_integer(buffer *out, long long value)
+{
+  char line[32];
+  int n = ::snprintf(line, sizeof(line), ":%lld\r\n", value);
+  return buffer_append(out, line, n);
+}
+
+
+static bool reply_array(buffer *out, size_t count)
+{
+  char line[32];
+  int n = ::snprintf(line, sizeof(line), "*%zu\r\n", count);
+  return buffer_append(out, line, n);
+}
+
+
+static bool reply_bulk(buffer *out, const char *data, size_t len)
+{
+  char line[32];
+  int n = ::snprintf(line, sizeof(line), "$%zu\r\n", len);
+
+  return buffer_reserve(out, n + len + 2) &&
+    buffer_append(out, line, n) &&
+    buffer_append(out, data, len) &&
+    buffer_append(out, "\r\n", 2);
+}
+
+
+struct bulk_reply
+{
+  buffer *out;
+  bool ok;
+};
+
+
+static void reply_bulk_cb(void *arg, const char *value, size_t value_len)
+{
+  bulk_reply *reply = reinterpret_cast<bulk_reply *>(arg);
+  reply->ok = reply_bulk(reply->out, value, value_len);
+}
+
+
+static bool reply_value(kv_shards *store,
+                        const char *key, size_t key_len,
+                        buffer *out)
+{
+  // Replies with the value of [key] or a null bulk string if there is no such
+  // key.
+
+  bulk_reply reply = { out, true };
+  if (!kv_shards_get(store, key, key_len, reply_bulk_cb, &reply))
+    return reply_literal(out, "$-1\r\n");
+
+  return reply.ok;
+}
+
+
+static bool reply_error(buffer *out, const char *format, const command *cmd)
+{
+  // [format] may contain one %.*s which is replaced by the command name.
+
+  char line[128];
+  int name_len = cmd->argv_len[0] > 32 ? 32 : cmd->argv_len[0];
+  int n = ::snprintf(line, sizeof(line), format, name_len, cmd->argv[0]);
+  if (n >= static_cast<int>(sizeof(line))) n = sizeof(line) - 1;
+
+  return buffer_append(out, line, n);
+}
+
+
+static bool is_command(const command *cmd, const char *name)
+{
+  return cmd->argv_len[0] == ::strlen(name) &&
+    ::strncasecmp(cmd->argv[0], name, cmd->argv_len[0]) == 0;
+}
+
+
+static bool reply_subscription(buffer *out,
+                               const char *kind,
+                               const char *channel, size_t channel_len,
+                               long long count)
+{
+  // Replies to (un)subscribing from a channel. A NULL [channel] is replied as
+  // a null bulk string.
+
+  return reply_array(out, 3) &&
+    reply_bulk(out, kind, ::strlen(kind)) &&
+    (channel
+      ? reply_bulk(out, channel, channel_len)
+      : reply_literal(out, "$-1\r\n")) &&
+    reply_integer(out, count);
+}
+
+
+static bool execute_pubsub(const resp_pubsub *pubsub,
+                           const command *cmd,
+                           buffer *out,
+                           bool *handled)
+{
+  // Executes [cmd] if it is a pub/sub command.
+
+  const char *const *argv = cmd->argv;
+  const size_t *argv_len = cmd->argv_len;
+  size_t argc = cmd->argc;
+
+  *handled = true;
+
+  if (is_command(cmd, "subscribe"))
+  {
+    if (argc >= 2)
+    {
+      bool ok = true;
+      for (size_t i = 1; i < argc && ok; ++i)
+      {
+        long long count = pubsub->subscribe(pubsub->arg, argv[i], argv_len[i]);
+        ok = count >= 0 &&
+          reply_subscription(out, "subscribe", argv[i], argv_len[i], count);
+      }
+      return ok;
+    }
+  }
+  else if (is_command(cmd, "unsubscribe"))
+  {
+    // Without channels, unsubscribes from all of them.
+
+    if (argc == 1)
+    {
+      const char *channel;
+      size_t channel_len;
+      bool any = false;
+
+      while (pubsub->any_channel(pubsub->arg, &channel, &channel_len))
+      {
+        // Reply before unsubscribing, which invalidates [channel].
+
+        any = true;
+        if (!reply_array(out, 3) ||
+            !reply_bulk(out, "unsubscribe", 11) ||
+            !reply_bulk(out, channel, channel_len))
+          return false;
+
+        long long count =
+          pubsub->unsubscribe(pubsub->arg, channel, channel_len);
+        if (!reply_integer(out, count)) return false;
+      }
+
+      return any || reply_subscription(out, "unsubscribe", NULL, 0, 0);
+    }
+
+    bool ok = true;
+    for (size_t i = 1; i < argc && ok; ++i)
+    {
+      long long count = pubsub->unsubscribe(pubsub->arg, argv[i], argv_len[i]);
+      ok = reply_subscription(out, "unsubscribe", argv[i], argv_len[i], count);
+    }
+    return ok;
+  }
+  else if (is_command(cmd, "publish"))
+  {
+    if (argc == 3)
+    {
+      long long receivers = pubsub->publish(
+        pubsub->arg, argv[1], argv_len[1], argv[2], argv_len[2]);
+      if (receivers < 0) return reply_literal(out, "-OOM out of memory\r\n");
+      return reply_integer(out, receivers);
+    }
+  }
+  else
+  {
+    *handled = false;
+    return true;
+  }
+
+  return reply_error(
+    out, "-ERR wrong number of arguments for '%.*s' command\r\n", cmd);
+}
+
+
+static bool execute(kv_shards *store,
+                    const resp_pubsub *pubsub,
+                    const command *cmd,
+                    buffer *out)
+{
+  // Executes [cmd] and appends its reply to [out]. Returns false if out of
+  // memory.
+
+  const char *const *argv = cmd->argv;
+  const size_t *argv_len = cmd->argv_len;
+  size_t argc = cmd->argc;
+
+  bool handled;
+  bool ok = execute_pubsub(pubsub, cmd, out, &handled);
+  if (handled) return ok;
+
+  if (is_command(cmd, "get"))
+  {
+    if (argc == 2) return reply_value(store, argv[1], argv_len[1], out);
+  }
+  else if (is_command(cmd, "set"))
+  {
+    if (argc == 3)
+    {
+      if (!kv_shards_set(store, argv[1], argv_len[1], argv[2], argv_len[2]))
+        return reply_literal(out, "-OOM out of memory\r\n");
+      return reply_literal(out, "+OK\r\n");
+    }
+    if (argc > 3) return reply_literal(out, "-ERR syntax error\r\n");
+  }
+  else if (is_command(cmd, "mget"))
+  {
+    if (argc >= 2)
+    {
+      ok = reply_array(out, argc - 1);
+      for (size_t i = 1; i < argc && ok; ++i)
+        ok = reply_value(store, argv[i], argv_len[i], out);
+      return ok;
+    }
+  }
+  else if (is_command(cmd, "del"))
+  {
+    if (argc >= 2)
+    {
+      long long removed = 0;
+      for (size_t i = 1; i < argc; ++i)
+        if (kv_shards_del(store, argv[i], argv_len[i])) ++removed;
+      return reply_integer(out, removed);
+    }
+  }
+  else if (is_command(cmd, "ping"))
+  {
+    if (argc == 1) return reply_literal(out, "+PONG\r\n");
+    if (argc == 2) return reply_bulk(out, argv[1], argv_len[1]);
+  }
+  else if (is_command(cmd, "echo"))
+  {
+    if (argc == 2) return reply_bulk(out, argv[1], argv_len[1]);
+  }
+  else
+  {
+    return reply_error(out, "-ERR unknown command '%.*s'\r\n", cmd);
+  }
+
+  return reply_error(
+    out, "-ERR wrong number of arguments for '%.*s' command\r\n", cmd);
+}
+
+
+resp_status resp_execute(kv_shards *store,
+                         const resp_pubsub *pubsub,
+                         const char *data, size_t len,
+                         buffer *out,
+                         size_t *consumed, size_t *commands)
+{
+  command cmd;
+
+  const char *p = data;
+  const char *end = data + len;
+
+  *commands = 0;
+
+  for (;;)
+  {
+    const char *next = p;
+    parse_status status = parse_command(&next, end, &cmd);
+
+    if (status == PARSE_INCOMPLETE) break;
+
+    if (status == PARSE_ERROR)
+    {
+      *consumed = p - data;
+      return reply_literal(out, "-ERR Protocol error\r\n")
+        ? RESP_PROTOCOL_ERROR
+        : RESP_OUT_OF_MEMORY;
+    }
+
+    if (!execute(store, pubsub, &cmd, out))
+    {
+      *consumed = p - data;
+      return RESP_OUT_OF_MEMORY;
+    }
+
+    ++*commands;
+    p = next;
+  }
+
+  *consumed = p - data;
+  return RESP_OK;
+}
+
+
+bool resp_message(const char *channel, size_t channel_len,
+                  const char *message, size_t message_len,
+                  buffer *out)
+{
+  return reply_array(out, 3) &&
+    reply_bulk(out, "message", 7) &&
+    reply_bulk(out, channel, channel_len) &&
+    reply_bulk(out, message, message_len);
+}
+
+} // namespace echo_server
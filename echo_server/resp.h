@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "buffer.h"
+#include "kv_shards.h"
+
+namespace echo_server {
+
+//
+// RESP (REdis Serialization Protocol) subset on top of [kv_shards].
+//
+// Commands are arrays of bulk strings as sent by Redis clients. Supported
+// commands are PING, ECHO, GET, SET (without options), DEL, MGET, SUBSCRIBE,
+// UNSUBSCRIBE and PUBLISH.
+//
+
+enum resp_status
+{
+  RESP_OK,
+  RESP_PROTOCOL_ERROR, // An error reply has been appended to the output.
+  RESP_OUT_OF_MEMORY,
+};
+
+//
+// Pub/sub commands act on the connection executing them through these
+// callbacks, which are passed [arg].
+//
+struct resp_pubsub
+{
+  void *arg;
+
+  // Return the number of channels subscribed to afterwards, or -1 if out of
+  // memory.
+  long long (*subscribe)(void *arg, const char *channel, size_t len);
+  long long (*unsubscribe)(void *arg, const char *channel, size_t len);
+
+  // Sets [channel] to one of the channels subscribed to, valid until it is
+  // unsubscribed. Returns false if there is none.
+  bool (*any_channel)(void *arg, const char **channel, size_t *len);
+
+  // Returns the number of subscribers the message was written to, or -1 if
+  // out of memory.
+  long long (*publish)(void *arg,
+                       const char *channel, size_t len,
+                       const char *message, size_t message_len);
+};
+
+//
+// Executes the complete commands at the start of [data] and appends their
+// replies to [out]. [consumed] is set to the number of bytes of the executed
+// commands; the rest is an incomplete command that has to be passed again once
+// more data has arrived. [commands] is set to the number of commands executed.
+//
+extern resp_status resp_execute(kv_shards *store,
+                                const resp_pubsub *pubsub,
+                                const char *data, size_t len,
+                                buffer *out,
+                                size_t *consumed, size_t *commands);
+
+//
+// Appends the message pushed to subscribers of [channel] to [out]. Returns
+// false if out of memory.
+//
+extern bool resp_message(const char *channel, size_t channel_len,
+                         const char *message, size_t message_len,
+                         buffer *out);
+
+} // namespace echo_server
@@ -1,7 +1,1167 @@
 'use strict';
 const echo = require('./build/Release/echo_server');
 //const echo = require('./build/Debug/echo_server');
+const assert = require('assert');
+const child_process = require('child_process');
+const crypto = require('crypto');
+const fs = require('fs');
+const net = require('net');
+const os = require('os');
+const path = require('path');
 
-echo.start(3000);
+// A process serves at most one server, so each test runs in a child process
+// of its own: `node test.js <name>` runs one test, `node test.js` all of them.
+// Tests that need another server start one of the [servers] the same way.
 
-console.log("Echo listening on port 3000.");
+const tests = {};
+const servers = {};
+
+const sleep = ms => new Promise(resolve => setTimeout(resolve, ms));
+
+async function until(condition, what)
+{
+  const deadline = Date.now() + 10000;
+  while (!condition())
+  {
+    if (Date.now() > deadline)
+      throw new Error("Timed out waiting for " + what);
+    await sleep(5);
+  }
+}
+
+function connect(port)
+{
+  // Returns a socket collecting what it reads in [received].
+
+  const socket = net.connect(port);
+
+  let chunks = [];
+  socket.on('data', data => chunks.push(data));
+  Object.defineProperty(socket, 'received', {
+    get() {
+      if (chunks.length != 1) chunks = [Buffer.concat(chunks)];
+      return chunks[0];
+    },
+    set(data) { chunks = [data]; }
+  });
+
+  socket.on('error', () => {});
+  socket.ended = new Promise(resolve => socket.on('close', resolve));
+  return socket;
+}
+
+async function exchange(socket, request, response)
+{
+  // Sends [request] and checks that exactly [response] comes back.
+
+  const start = socket.received.length;
+  socket.write(request);
+  await until(() => socket.received.length - start >= response.length,
+              JSON.stringify(response.toString().slice(0, 40)));
+  assert.strictEqual(socket.received.subarray(start).toString('latin1'),
+                     Buffer.from(response).toString('latin1'));
+}
+
+
+tests.readBudget = async () => {
+  echo.start(3012, { readBudget: 16 * 1024 });
+
+  // A client sending a lot, and reading it back, is throttled to its read
+  // budget per loop iteration, so another one is still answered promptly.
+
+  const bulk = connect(3012);
+  let echoed = 0;
+  bulk.on('data', data => { echoed += data.length; });
+  const data = Buffer.alloc(256 * 1024 * 1024, 'z');
+  bulk.write(data);
+  await until(() => echoed > 0, "bulk echo");
+
+  const interactive = connect(3012);
+  for (let i = 0; i < 20; ++i) await exchange(interactive, 'ping', 'ping');
+  assert(echoed < data.length, "Bulk transfer done before interactive one");
+
+  await until(() => echoed == data.length, "bulk echo");
+  assert(echo.stats().throttled > 0);
+};
+
+
+tests.rateLimits = async () => {
+  echo.start(3001, {
+    connectionBytesPerSecond: 1024 * 1024,
+    connectionBytesBurst: 256 * 1024,
+    serverMessagesPerSecond: 20,
+    serverMessagesBurst: 5
+  });
+
+  // 1 MiB at 1 MiB/s, of which the burst is echoed at once: reading pauses
+  // for most of the rest.
+
+  const bytes = connect(3001);
+  const data = Buffer.alloc(1024 * 1024, 'x');
+  let start = Date.now();
+  await exchange(bytes, data, data);
+  assert(Date.now() - start >= 600, "Echoed 1 MiB within " +
+         (Date.now() - start) + " ms");
+  bytes.destroy();
+
+  // Messages beyond the burst of the server bucket come back at its rate.
+
+  const chatty = connect(3001);
+  start = Date.now();
+  for (let i = 0; i < 15; ++i) await exchange(chatty, 'a', 'a');
+  assert(Date.now() - start >= 400, "Echoed 15 messages within " +
+         (Date.now() - start) + " ms");
+
+  // Lifting the limits takes effect on open connections.
+
+  echo.setLimits({ connectionBytesPerSecond: 0, serverMessagesPerSecond: 0 });
+  start = Date.now();
+  for (let i = 0; i < 50; ++i) await exchange(chatty, 'b', 'b');
+  assert(Date.now() - start < 400);
+
+  assert(echo.stats().rateLimited > 0);
+};
+
+
+tests.maxConnections = async () => {
+  echo.start(3013, { maxConnections: 4, connectionsLowWatermark: 2 });
+
+  const clients = [];
+  for (let i = 0; i < 4; ++i)
+  {
+    clients.push(connect(3013));
+    await exchange(clients[i], 'a', 'a');
+  }
+
+  // Connections beyond the cap wait in the backlog until fewer than the low
+  // watermark are open.
+
+  const waiting = [connect(3013), connect(3013)];
+  for (const socket of waiting) socket.write('b');
+  await until(() => echo.stats().overloaded == 1, "overload");
+
+  for (let i = 0; i < 2; ++i)
+  {
+    await sleep(200);
+    assert.strictEqual(echo.stats().connections, 4 - i);
+    assert(waiting.every(socket => socket.received.length == 0));
+
+    clients[i].destroy();
+    await until(() => echo.stats().connections == 3 - i, "closed connection");
+  }
+
+  await sleep(200);
+  assert(waiting.every(socket => socket.received.length == 0));
+  clients[2].destroy();
+
+  for (const socket of waiting)
+    await until(() => socket.received.toString() == 'b', "accepted connection");
+  assert.strictEqual(echo.stats().connections, 3);
+  assert.strictEqual(echo.stats().rejected, 0);
+};
+
+tests.maxConnectionsClose = async () => {
+  echo.start(3014, { maxConnections: 2, overloadPolicy: 'close' });
+
+  const clients = [connect(3014), connect(3014)];
+  for (const client of clients) await exchange(client, 'a', 'a');
+
+  // Connections beyond the cap are accepted and closed at once until fewer
+  // than the cap, the default low watermark, are open.
+
+  for (let i = 1; i <= 2; ++i)
+  {
+    const rejected = connect(3014);
+    rejected.write('b');
+    await rejected.ended;
+    assert.strictEqual(rejected.received.length, 0);
+    await until(() => echo.stats().rejected == i, "rejected connection");
+  }
+  assert.strictEqual(echo.stats().overloaded, 1);
+
+  clients[0].destroy();
+  await until(() => echo.stats().connections == 1, "closed connection");
+  await exchange(connect(3014), 'c', 'c');
+  assert.strictEqual(echo.stats().rejected, 2);
+};
+
+
+tests.slowConsumers = async () => {
+  echo.start(3002, { writeTimeout: 300 });
+
+  const evicted = [];
+  echo.on('evict', info => evicted.push(info));
+
+  async function flood(count)
+  {
+    // Sends much more than it reads back, so the echoes queue up on the
+    // server until it evicts the connection.
+
+    const socket = connect(3002);
+    socket.pause();
+    const chunk = Buffer.alloc(1024 * 1024);
+    for (let i = 0; i < 64 && evicted.length < count; ++i)
+    {
+      socket.write(chunk);
+      await sleep(1);
+    }
+    await until(() => evicted.length === count, "eviction");
+    socket.destroy();
+  }
+
+  await flood(1);
+  assert.strictEqual(evicted[0].reason, 'writeTimeout');
+  assert(evicted[0].oldestWriteAge >= 300);
+
+  echo.setLimits({
+    writeTimeout: 0, maxQueuedBytes: 1024 * 1024, maxQueuedTime: 200
+  });
+
+  await flood(2);
+  assert.strictEqual(evicted[1].reason, 'maxQueuedBytes');
+  assert(evicted[1].queuedBytes > 1024 * 1024);
+
+  // A consumer that keeps up is left alone.
+
+  const reader = connect(3002);
+  const data = Buffer.alloc(8 * 1024 * 1024, 'y');
+  await exchange(reader, data, data);
+  assert.strictEqual(echo.stats().evicted, 2);
+};
+
+
+function command(...argv)
+{
+  // Encodes [argv] as a RESP array of bulk strings.
+
+  return `*${argv.length}\r\n` +
+    argv.map(arg => `$${Buffer.byteLength(arg)}\r\n${arg}\r\n`).join('');
+}
+
+function bulk(value)
+{
+  return value === null ? "$-1\r\n" : `$${value.length}\r\n${value}\r\n`;
+}
+
+
+tests.resp = async () => {
+  echo.start(3003, { mode: 'resp' });
+
+  const client = connect(3003);
+
+  await exchange(client, command('PING'), "+PONG\r\n");
+  await exchange(client, command('GET', 'a'), bulk(null));
+  await exchange(client, command('SET', 'a', '1'), "+OK\r\n");
+  await exchange(client, command('GET', 'a'), bulk('1'));
+
+  // Pipelined commands are answered in order, also when they arrive split
+  // at arbitrary points.
+
+  const big = 'v'.repeat(300000);
+  const request =
+    command('SET', 'b', 'hello') +
+    command('SET', 'big', big) +
+    command('MGET', 'a', 'b', 'c') +
+    command('DEL', 'a', 'c') +
+    command('GET', 'a') +
+    command('set', 'a', 'again') +
+    command('GET', 'big') +
+    command('GET', 'a');
+  const response =
+    "+OK\r\n" +
+    "+OK\r\n" +
+    "*3\r\n" + bulk('1') + bulk('hello') + bulk(null) +
+    ":1\r\n" +
+    bulk(null) +
+    "+OK\r\n" +
+    bulk(big) +
+    bulk('again');
+
+  const start = client.received.length;
+  for (let i = 0; i < request.length; i += 7777)
+  {
+    client.write(request.slice(i, i + 7777));
+    await sleep(1);
+  }
+  await until(() => client.received.length - start >= response.length,
+              "pipelined responses");
+  assert.strictEqual(client.received.subarray(start).toString(), response);
+
+  // Errors leave the connection usable.
+
+  await exchange(
+    client, command('GET', 'x', 'y') + command('FOO') + command('GET', 'b'),
+    "-ERR wrong number of arguments for 'GET' command\r\n" +
+    "-ERR unknown command 'FOO'\r\n" +
+    bulk('hello'));
+
+  // Many keys, half of them deleted again.
+
+  let sets = '', set = '', gets = '', found = '';
+  for (let i = 0; i < 10000; ++i)
+  {
+    sets += command('SET', 'k' + i, 'v' + i);
+    set += "+OK\r\n";
+    if (i % 2 == 0)
+    {
+      sets += command('DEL', 'k' + i);
+      set += ":1\r\n";
+    }
+    gets += command('GET', 'k' + i);
+    found += bulk(i % 2 == 0 ? null : 'v' + i);
+  }
+  await exchange(client, sets, set);
+  await exchange(client, gets, found);
+  assert.strictEqual(echo.stats().keys, 5003);
+
+  // A request that is not RESP closes the connection.
+
+  client.write("garbage\r\n");
+  await client.ended;
+};
+
+
+tests.sharedStore = async () => {
+  const budget = 256 * 1024;
+  echo.start(3004, { mode: 'resp', threads: 4, storeMemory: budget });
+
+  // Connections are spread over the workers, which share the store.
+
+  const clients = [];
+  for (let i = 0; i < 8; ++i) clients.push(connect(3004));
+
+  await Promise.all(clients.map((client, i) =>
+    exchange(client, command('SET', 'from' + i, 'x' + i), "+OK\r\n")));
+  await Promise.all(clients.map((client, i) =>
+    exchange(client, command('GET', 'from' + (7 - i)), bulk('x' + (7 - i)))));
+
+  // Entries beyond the budget evict others, but never the one being set.
+
+  const client = clients[0];
+  let sets = '', set = '';
+  for (let i = 0; i < 20000; ++i)
+  {
+    sets += command('SET', 'k' + i, 'v'.repeat(i % 300));
+    set += "+OK\r\n";
+  }
+  await exchange(client, sets, set);
+  await exchange(client, command('GET', 'k19999'), bulk('v'.repeat(199)));
+
+  const stats = echo.stats();
+  assert(stats.storeMemory <= budget, stats.storeMemory + " bytes");
+  assert(stats.storeEvicted > 0);
+  assert.strictEqual(stats.keys + stats.storeEvicted, 20008);
+
+  // An entry that does not fit in the budget is refused.
+
+  await exchange(
+    client,
+    command('SET', 'huge', 'h'.repeat(budget)) + command('GET', 'huge'),
+    "-OOM out of memory\r\n" + bulk(null));
+};
+
+
+const reasons = {
+  200: "OK", 400: "Bad Request", 404: "Not Found", 405: "Method Not Allowed",
+  413: "Content Too Large", 431: "Request Header Fields Too Large",
+  501: "Not Implemented", 503: "Service Unavailable"
+};
+
+function response(status, body, headers = "", type = "text/plain")
+{
+  // Formats a response of the HTTP mode to a GET request.
+
+  return `HTTP/1.1 ${status} ${reasons[status]}\r\n` +
+    `Content-Type: ${type}\r\n` +
+    `Content-Length: ${body.length}\r\n` + headers + "\r\n" + body;
+}
+
+
+tests.http = async () => {
+  echo.start(3005, { mode: 'http', threads: 2 });
+
+  echo.setResponse('/health', "ok\n");
+  echo.setResponse('/metrics', Buffer.from('{"a":1}'),
+                   { contentType: 'application/json' });
+  echo.setResponse('/down', "down\n", { status: 503 });
+  echo.setResponse('/removed', "x");
+  echo.setResponse('/removed', null);
+
+  const ok = response(200, "ok\n");
+  const notFound = response(404, "Not Found\n");
+
+  // Keep-alive: requests on one connection, with the query ignored and
+  // responses removed again answered with 404.
+
+  const client = connect(3005);
+  await exchange(client, "GET /health?x=1 HTTP/1.1\r\nHost: a\r\n\r\n", ok);
+  await exchange(
+    client, "GET /metrics HTTP/1.1\r\n\r\n",
+    response(200, '{"a":1}', "", 'application/json'));
+  await exchange(client, "GET /down HTTP/1.1\r\n\r\n",
+                 response(503, "down\n"));
+  await exchange(client, "GET /removed HTTP/1.1\r\n\r\n", notFound);
+
+  // Pipelined requests are answered in order, HEAD without the body and
+  // methods other than GET and HEAD with 405. A request sent a byte at a
+  // time is answered once complete.
+
+  await exchange(
+    client,
+    "GET /health HTTP/1.1\r\n\r\n".repeat(3) +
+    "HEAD /health HTTP/1.1\r\n\r\n" +
+    "POST /health HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello" +
+    "GET /nothing HTTP/1.1\r\n\r\n",
+    ok + ok + ok + ok.slice(0, -3) +
+    "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\n" +
+    "Content-Type: text/plain\r\nContent-Length: 19\r\n\r\n" +
+    "Method Not Allowed\n" +
+    notFound);
+
+  const request = "GET /health HTTP/1.1\r\nHost: some.host.example.com\r\n" +
+    "User-Agent: probe/1.0\r\n\r\n";
+  for (const c of request.slice(0, -1))
+  {
+    client.write(c);
+    await sleep(1);
+  }
+  await exchange(client, request.slice(-1), ok);
+
+  // HTTP/1.0 closes unless asked to keep alive, HTTP/1.1 when asked to.
+
+  await exchange(
+    client, "GET /health HTTP/1.0\r\nConnection: keep-alive\r\n\r\n",
+    response(200, "ok\n", "Connection: keep-alive\r\n"));
+  await exchange(client, "GET /health HTTP/1.1\r\nConnection: close\r\n\r\n",
+                 response(200, "ok\n", "Connection: close\r\n"));
+  await client.ended;
+
+  const old = connect(3005);
+  await exchange(old, "GET /health HTTP/1.0\r\n\r\n",
+                 response(200, "ok\n", "Connection: close\r\n"));
+  await old.ended;
+
+  // Requests that cannot be served are answered and the connection closed.
+
+  const refused = [
+    [400, "GET /he\x01lth HTTP/1.1\r\n\r\n"],
+    [400, "GET /health HTTP/1.1\r\nX: a\x7f\r\n\r\n"],
+    [413, "POST /health HTTP/1.1\r\nContent-Length: 2000000\r\n\r\n"],
+    [431, "GET /health HTTP/1.1\r\nX: " + "a".repeat(9000) + "\r\n\r\n"],
+    [501, "GET /health HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"]
+  ];
+
+  for (const [status, request] of refused)
+  {
+    const socket = connect(3005);
+    socket.write(request);
+    await socket.ended;
+
+    const text = socket.received.toString();
+    assert(text.startsWith(`HTTP/1.1 ${status} `), text);
+    assert(text.endsWith("\r\n\r\n" + reasons[status] + "\n"), text);
+  }
+};
+
+
+function frame(opcode, payload, fin = true)
+{
+  // Encodes a masked WebSocket frame, as sent by clients.
+
+  payload = Buffer.from(payload);
+
+  let header;
+  if (payload.length < 126)
+  {
+    header = Buffer.from([0, 0x80 | payload.length]);
+  }
+  else if (payload.length < 65536)
+  {
+    header = Buffer.from([0, 0x80 | 126, 0, 0]);
+    header.writeUInt16BE(payload.length, 2);
+  }
+  else
+  {
+    header = Buffer.alloc(10);
+    header[1] = 0x80 | 127;
+    header.writeBigUInt64BE(BigInt(payload.length), 2);
+  }
+  header[0] = (fin ? 0x80 : 0) | opcode;
+
+  const mask = crypto.randomBytes(4);
+  const masked = Buffer.from(payload);
+  for (let i = 0; i < masked.length; ++i) masked[i] ^= mask[i & 3];
+
+  return Buffer.concat([header, mask, masked]);
+}
+
+function frames(data)
+{
+  // Decodes the unmasked frames sent by the server.
+
+  const result = [];
+  for (let p = 0; data.length - p >= 2; )
+  {
+    let length = data[p + 1] & 127, header = 2;
+    if (length == 126)
+    {
+      length = data.readUInt16BE(p + 2);
+      header = 4;
+    }
+    else if (length == 127)
+    {
+      length = Number(data.readBigUInt64BE(p + 2));
+      header = 10;
+    }
+    if (data.length - p < header + length) break;
+
+    result.push({
+      opcode: data[p] & 15,
+      payload: data.subarray(p + header, p + header + length)
+    });
+    p += header + length;
+  }
+  return result;
+}
+
+async function upgrade(port, key = crypto.randomBytes(16).toString('base64'))
+{
+  // Connects and completes the opening handshake. [received] then holds
+  // only what follows the handshake response.
+
+  const socket = connect(port);
+  socket.write("GET /chat HTTP/1.1\r\nHost: a\r\nUpgrade: websocket\r\n" +
+               "Connection: keep-alive, Upgrade\r\n" +
+               `Sec-WebSocket-Key: ${key}\r\n` +
+               "Sec-WebSocket-Version: 13\r\n\r\n");
+  await until(() => socket.received.includes("\r\n\r\n"), "handshake");
+
+  const end = socket.received.indexOf("\r\n\r\n") + 4;
+  socket.head = socket.received.subarray(0, end).toString();
+  socket.received = socket.received.subarray(end);
+  return socket;
+}
+
+
+tests.ws = async () => {
+  echo.start(3006, { mode: 'ws', threads: 2 });
+
+  const messages = [];
+  echo.on('messages', batch => messages.push(...batch));
+
+  // The accept value of the example in RFC 6455.
+
+  const client = await upgrade(3006, 'dGhlIHNhbXBsZSBub25jZQ==');
+  assert(client.head.startsWith("HTTP/1.1 101 "), client.head);
+  assert(client.head.includes(
+    "\r\nSec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"), client.head);
+
+  // Masked frames with each length encoding, and a fragmented message with
+  // a ping between its fragments, which is answered with a pong.
+
+  const medium = crypto.randomBytes(300);
+  const large = crypto.randomBytes(200000);
+  client.write(Buffer.concat([
+    frame(1, "hello"),
+    frame(2, medium),
+    frame(2, large),
+    frame(1, "frag", false),
+    frame(9, "ping me"),
+    frame(0, "ment", false),
+    frame(0, "ed")
+  ]));
+
+  await until(() => messages.length == 4, "messages");
+  assert(messages.every(message => message.id === messages[0].id));
+  assert.deepStrictEqual(messages.map(message => message.data),
+                         ["hello", medium, large, "fragmented"]);
+
+  await until(() => frames(client.received).length == 1, "pong");
+  assert.deepStrictEqual(frames(client.received)[0],
+                         { opcode: 10, payload: Buffer.from("ping me") });
+
+  // Messages from JavaScript, to one connection and to all of them.
+
+  const other = await upgrade(3006);
+  echo.send(messages[0].id, "direct");
+  echo.broadcast(Buffer.from("all"));
+
+  await until(() => frames(client.received).length == 3 &&
+              frames(other.received).length == 1, "sent messages");
+  assert.deepStrictEqual(frames(client.received).slice(1), [
+    { opcode: 1, payload: Buffer.from("direct") },
+    { opcode: 2, payload: Buffer.from("all") }
+  ]);
+
+  // A close frame is answered with one echoing its status code, an unmasked
+  // frame with a protocol error.
+
+  client.write(frame(8, Buffer.from([0x03, 0xe8])));
+  await client.ended;
+  assert.deepStrictEqual(frames(client.received).pop(),
+                         { opcode: 8, payload: Buffer.from([0x03, 0xe8]) });
+
+  other.write(Buffer.from([0x81, 0x02, 0x61, 0x62]));
+  await other.ended;
+  assert.deepStrictEqual(frames(other.received).pop(),
+                         { opcode: 8, payload: Buffer.from([0x03, 0xea]) });
+};
+
+
+function subscription(kind, channel, count)
+{
+  return "*3\r\n" + bulk(kind) + bulk(channel) + `:${count}\r\n`;
+}
+
+function message(channel, data)
+{
+  return "*3\r\n" + bulk('message') + bulk(channel) + bulk(data);
+}
+
+async function expect(socket, data)
+{
+  // Checks that exactly [data] has been received, and forgets it.
+
+  await until(() => socket.received.length >= data.length,
+              JSON.stringify(data.slice(0, 40)));
+  assert.strictEqual(socket.received.toString('latin1'), data);
+  socket.received = Buffer.alloc(0);
+}
+
+
+tests.pubSub = async () => {
+  echo.start(3011, { mode: 'resp' });
+
+  const a = connect(3011);
+  const b = connect(3011);
+  const publisher = connect(3011);
+
+  // Subscribing replies with the number of channels of the connection,
+  // which subscribing twice leaves unchanged.
+
+  await exchange(a, command('SUBSCRIBE', 'news', 'sport'),
+                 subscription('subscribe', 'news', 1) +
+                 subscription('subscribe', 'sport', 2));
+  await exchange(a, command('SUBSCRIBE', 'news'),
+                 subscription('subscribe', 'news', 2));
+  await exchange(b, command('SUBSCRIBE', 'news'),
+                 subscription('subscribe', 'news', 1));
+  a.received = b.received = Buffer.alloc(0);
+
+  // Each subscriber gets the messages of its channels, published by clients
+  // or from JavaScript. PUBLISH replies with the number of receivers.
+
+  await exchange(publisher, command('PUBLISH', 'news', 'hello'), ":2\r\n");
+  await exchange(publisher, command('PUBLISH', 'sport', 'goal'), ":1\r\n");
+  await exchange(publisher, command('PUBLISH', 'weather', 'rain'), ":0\r\n");
+  echo.publish('news', Buffer.from("from js"));
+
+  await expect(a, message('news', 'hello') + message('sport', 'goal') +
+               message('news', 'from js'));
+  await expect(b, message('news', 'hello') + message('news', 'from js'));
+
+  // Unsubscribing from some channels, then from all of them, and once more
+  // when there are none left.
+
+  await exchange(a, command('UNSUBSCRIBE', 'sport', 'weather'),
+                 subscription('unsubscribe', 'sport', 1) +
+                 subscription('unsubscribe', 'weather', 1));
+  await exchange(publisher, command('PUBLISH', 'sport', 'again'), ":0\r\n");
+  await exchange(a, command('UNSUBSCRIBE'),
+                 subscription('unsubscribe', 'news', 0));
+  await exchange(a, command('UNSUBSCRIBE'),
+                 subscription('unsubscribe', null, 0));
+  a.received = Buffer.alloc(0);
+  await exchange(publisher, command('PUBLISH', 'news', 'b only'), ":1\r\n");
+  await expect(b, message('news', 'b only'));
+  assert.strictEqual(a.received.length, 0);
+
+  // A subscriber that does not read is skipped once it has more than
+  // maxSubscriberQueuedBytes queued, while the others get every message. It
+  // gets the messages written before once it reads again, after which every
+  // message is released.
+
+  echo.setLimits({
+    maxSubscriberQueuedBytes: 1024 * 1024, slowSubscriberPolicy: 'skip'
+  });
+
+  const slow = connect(3011);
+  await exchange(slow, command('SUBSCRIBE', 'big'),
+                 subscription('subscribe', 'big', 1));
+  slow.received = Buffer.alloc(0);
+  slow.pause();
+  await exchange(b, command('SUBSCRIBE', 'big'),
+                 subscription('subscribe', 'big', 2));
+  b.received = Buffer.alloc(0);
+
+  const data = 'x'.repeat(256 * 1024);
+  const big = message('big', data);
+
+  async function publishUntil(condition)
+  {
+    // Publishes [data] on 'big', a message at a time, until [condition].
+    // Returns the number of messages published.
+
+    let published = 0;
+    while (!condition())
+    {
+      assert(published < 1000, "Published " + published + " messages");
+      echo.publish('big', data);
+      ++published;
+      await expect(b, big);
+    }
+    return published;
+  }
+
+  let published = await publishUntil(() => echo.stats().skipped > 0);
+  assert(echo.stats().sharedBuffers > 0);
+
+  let skipped = echo.stats().skipped;
+  published += await publishUntil(() => echo.stats().skipped >= skipped + 3);
+  skipped = echo.stats().skipped;
+
+  slow.resume();
+  const delivered = published - skipped;
+  await until(() => slow.received.length >= delivered * big.length,
+              "queued messages");
+  assert(slow.received.equals(Buffer.from(big.repeat(delivered))));
+  await until(() => echo.stats().sharedBuffers == 0, "released messages");
+
+  // With the drop policy, it is closed instead, and what was queued for it
+  // released.
+
+  echo.setLimits({ slowSubscriberPolicy: 'drop' });
+
+  const dropped = connect(3011);
+  await exchange(dropped, command('SUBSCRIBE', 'big'),
+                 subscription('subscribe', 'big', 1));
+  dropped.pause();
+
+  await publishUntil(() => echo.stats().dropped == 1);
+  dropped.resume();
+  await dropped.ended;
+  assert.strictEqual(echo.stats().skipped, skipped);
+
+  await exchange(publisher, command('PUBLISH', 'big', 'small'), ":2\r\n");
+  await expect(b, message('big', 'small'));
+  await until(() => echo.stats().sharedBuffers == 0, "released messages");
+};
+
+
+tests.proxy = async () => {
+  // The upstream server echoes, without reading while its writes are
+  // queued, and counts what it reads.
+
+  let upstreamRead = 0;
+  const upstreamSockets = new Set();
+  const upstream = net.createServer(socket => {
+    upstreamSockets.add(socket);
+    socket.on('data', data => { upstreamRead += data.length; });
+    socket.on('error', () => {});
+    socket.pipe(socket);
+  });
+  await new Promise(resolve => upstream.listen(3007, '127.0.0.1', resolve));
+
+  echo.start(3008, {
+    mode: 'proxy', threads: 2, upstreamPort: 3007, upstreamPool: 4
+  });
+  await until(() => echo.stats().pooled == 4, "pooled connections");
+
+  const logged = [];
+  echo.on('log', info => logged.push(info));
+
+  // Concurrent clients get back exactly what they send.
+
+  const size = 2 * 1024 * 1024;
+  await Promise.all(Array.from({ length: 8 }, async (_, i) => {
+    const data = crypto.randomBytes(size);
+    await exchange(connect(3008), data, data);
+  }));
+
+  // A client that does not read is relayed no further than the buffers in
+  // between hold, and gets everything once it reads again.
+
+  const data = crypto.randomBytes(64 * 1024 * 1024);
+  const slow = connect(3008);
+  slow.pause();
+  slow.write(data);
+
+  const before = upstreamRead;
+  await sleep(500);
+  const relayed = upstreamRead - before;
+  assert(relayed < data.length / 2, relayed + " bytes relayed");
+  await sleep(200);
+  assert(upstreamRead - before - relayed < 1024 * 1024);
+
+  slow.resume();
+  await until(() => slow.received.length >= data.length, "relayed data");
+  assert(slow.received.equals(data));
+
+  // A half-closed client still gets the response.
+
+  const half = connect(3008);
+  half.end("hello");
+  await half.ended;
+  assert.strictEqual(half.received.toString(), "hello");
+
+  // Clients are closed when the upstream server is gone.
+
+  upstream.close();
+  for (const socket of upstreamSockets) socket.destroy();
+  await sleep(100);
+
+  const orphan = connect(3008);
+  orphan.write("x");
+  await orphan.ended;
+  assert(echo.stats().upstreamErrors > 0);
+  await until(() => logged.some(info => info.code == 'ECONNREFUSED'),
+              "logged error");
+};
+
+
+servers.inherited = async () => {
+  echo.start({ fd: 3, mode: 'resp' });
+  process.send('started');
+};
+
+servers.received = async () => {
+  const received = echo.receiveListener(process.argv[3]);
+  process.send('waiting');
+  echo.start({ fd: await received, mode: 'resp', threads: 2 });
+  process.send('started');
+};
+
+function startServer(name, options = {}, ...args)
+{
+  // Starts [servers][name] in a child process and returns it once it has
+  // sent its first message.
+
+  const child = child_process.spawn(
+    process.execPath, [__filename, name, ...args],
+    { stdio: ['inherit', 'inherit', 'inherit', 'ipc'], ...options });
+  child.next = () => new Promise(resolve => child.once('message', resolve));
+  return child.next().then(() => child);
+}
+
+async function handOverTo(startNext)
+{
+  // Serves echo mode while [startNext] starts a RESP server on the same
+  // listening socket. Connections keep being accepted throughout, by one
+  // server or the other, and once this one stops listening only by the
+  // other. Returns the other server.
+
+  const ping = command('PING');
+  const served = { echo: 0, resp: 0 };
+  let running = true;
+
+  async function client()
+  {
+    while (running)
+    {
+      const socket = connect(3010);
+      socket.write(ping);
+      await until(() => socket.received.length >= 7 || socket.destroyed,
+                  "reply");
+      const reply = socket.received.toString();
+      if (reply === ping) ++served.echo;
+      else if (reply === "+PONG\r\n") ++served.resp;
+      else assert.fail("Unexpected reply " + JSON.stringify(reply));
+      socket.destroy();
+    }
+  }
+
+  echo.start(3010, { backlog: 1024 });
+  const clients = [client(), client(), client()];
+  await sleep(100);
+
+  const next = await startNext();
+  await sleep(100);
+  echo.stopListening();
+
+  const servedBefore = served.resp;
+  await sleep(200);
+  running = false;
+  await Promise.all(clients);
+
+  assert(served.echo > 0 && servedBefore > 0);
+  const echoed = served.echo;
+  await exchange(connect(3010), ping, "+PONG\r\n");
+  assert.strictEqual(served.echo, echoed);
+
+  return next;
+}
+
+
+tests.inheritedListener = async () => {
+  const child = await handOverTo(() => startServer(
+    'inherited',
+    { stdio: ['inherit', 'inherit', 'inherit', echo.listenerFd(), 'ipc'] }));
+  child.kill();
+};
+
+tests.handOff = async () => {
+  const socketPath = path.join(os.tmpdir(), `echo_server_${process.pid}.sock`);
+
+  // Anything but a socket at the path is left alone. The error is logged
+  // once the server is started.
+
+  const logged = [];
+  echo.on('log', info => logged.push(info));
+
+  fs.writeFileSync(socketPath, "keep");
+  assert.throws(() => echo.receiveListener(socketPath), /exists/);
+  assert.strictEqual(fs.readFileSync(socketPath, 'utf8'), "keep");
+  fs.unlinkSync(socketPath);
+
+  const child = await handOverTo(async () => {
+    const child = await startServer('received', {}, socketPath);
+    echo.handOff(socketPath);
+    await child.next();
+    return child;
+  });
+  assert(!fs.existsSync(socketPath));
+  child.kill();
+
+  await until(() => logged.some(info => info.code == 'EEXIST'),
+              "logged error");
+};
+
+
+function counter(counters, layout, name)
+{
+  // Sums counter [name] of [counters], as laid out by [layout], over the
+  // workers.
+
+  let total = 0n;
+  for (let row = 0; row < layout.rows; ++row)
+    total += counters[row * layout.rowLength + layout.fields[name]];
+  return total;
+}
+
+
+tests.statsBuffer = async () => {
+  echo.start(3015, { threads: 2 });
+
+  const counters = echo.statsBuffer();
+  const layout = echo.statsLayout();
+  assert(counters instanceof BigUint64Array);
+  assert.strictEqual(layout.rows, 2);
+  assert.strictEqual(counters.length, layout.rows * layout.rowLength);
+
+  // The counters change as the workers count, without calling stats.
+
+  const client = connect(3015);
+  const data = Buffer.alloc(1024 * 1024, 's');
+  await exchange(client, data, data);
+  await until(
+    () => counter(counters, layout, 'bytesWritten') == BigInt(data.length),
+    "published counters");
+  assert.strictEqual(counter(counters, layout, 'bytesRead'),
+                     BigInt(data.length));
+  assert.strictEqual(counter(counters, layout, 'connections'), 1n);
+
+  // Each field is that of the statistic of the same name, and the buckets
+  // those of the write latency histogram.
+
+  const stats = echo.stats();
+  for (const name of Object.keys(layout.fields))
+  {
+    assert.strictEqual(Number(counter(counters, layout, name)), stats[name],
+                       name);
+  }
+  assert.strictEqual(layout.writeLatencyBuckets, stats.writeLatency.length);
+  for (let b = 0; b < layout.writeLatencyBuckets; ++b)
+  {
+    let total = 0n;
+    for (let row = 0; row < layout.rows; ++row)
+      total += counters[row * layout.rowLength + layout.writeLatency + b];
+    assert.strictEqual(Number(total), stats.writeLatency[b]);
+  }
+};
+
+
+function readRows(counters, layout)
+{
+  // Returns a copy of each row of [counters], read as statsBuffer describes.
+
+  const rows = [];
+  for (let row = 0; row < layout.rows; ++row)
+  {
+    const start = row * layout.rowLength;
+    for (;;)
+    {
+      const sequence = counters[start + layout.sequence];
+      const copy = counters.slice(start, start + layout.rowLength);
+      if (sequence % 2n == 0n &&
+          counters[start + layout.sequence] == sequence)
+      {
+        rows.push(copy);
+        break;
+      }
+    }
+  }
+  return rows;
+}
+
+
+tests.statsSequence = async () => {
+  echo.start(3016, { threads: 4 });
+
+  const counters = echo.statsBuffer();
+  const layout = echo.statsLayout();
+  const read = layout.fields.bytesRead;
+  const written = layout.fields.bytesWritten;
+
+  // While clients on every worker are echoed, each row read is from one
+  // point in time: it never has more written than read, nor counters going
+  // back.
+
+  let done = false;
+  const clients = Promise.all(Array.from({ length: 16 }, async () => {
+    const data = crypto.randomBytes(8 * 1024 * 1024);
+    await exchange(connect(3016), data, data);
+  })).then(() => { done = true; });
+
+  let previous = readRows(counters, layout);
+  let snapshots = 0;
+  while (!done)
+  {
+    const rows = readRows(counters, layout);
+    rows.forEach((row, i) => {
+      assert(row[written] <= row[read]);
+      assert(row[read] >= previous[i][read]);
+      assert(row[written] >= previous[i][written]);
+    });
+    previous = rows;
+    ++snapshots;
+    await sleep(0);
+  }
+  await clients;
+  assert(snapshots > 10, snapshots + " snapshots");
+
+  const total = BigInt(16 * 8 * 1024 * 1024);
+  await until(() => counter(counters, layout, 'bytesWritten') == total,
+              "published counters");
+  assert.strictEqual(echo.stats().bytesRead, Number(total));
+  assert(readRows(counters, layout).filter(row => row[read] != 0n).length > 1,
+         "Served by a single worker");
+};
+
+
+tests.trace = async () => {
+  // 10 events are rounded up to 16.
+
+  const begin = process.hrtime.bigint();
+  echo.start(3017, { traceEvents: 10 });
+
+  // The events of a connection, in order.
+
+  const client = connect(3017);
+  await exchange(client, 'hello', 'hello');
+  client.end();
+  await client.ended;
+  await until(() => echo.trace().some(e => e.type == 'close'), "close");
+
+  const events = echo.trace();
+  const end = process.hrtime.bigint();
+  assert.deepStrictEqual(
+    events.map(({ worker, type, value, code }) =>
+      ({ worker, type, value, code })),
+    [
+      { worker: 0, type: 'accept', value: 0, code: undefined },
+      { worker: 0, type: 'read', value: 5, code: undefined },
+      { worker: 0, type: 'write', value: 5, code: undefined },
+      { worker: 0, type: 'error', value: events[3].value, code: 'EOF' },
+      { worker: 0, type: 'close', value: 0, code: undefined }
+    ]);
+  assert(events.every(e => e.connection === events[0].connection));
+  assert(events[0].time >= begin && events[4].time <= end);
+  for (let i = 1; i < events.length; ++i)
+    assert(events[i].time > events[i - 1].time);
+
+  // Only the latest events are kept, but for the oldest one that a full
+  // ring holds, which the worker could be overwriting while it is read.
+
+  const other = connect(3017);
+  for (let i = 0; i < 20; ++i) await exchange(other, 'x', 'x');
+  const latest = echo.trace();
+  assert.strictEqual(latest.length, 15);
+  assert(latest.every(e => e.connection !== events[0].connection));
+  for (let i = 1; i < latest.length; ++i)
+    assert(latest[i].time > latest[i - 1].time);
+
+  // The dump has a line per event.
+
+  const file = path.join(os.tmpdir(), `echo_server_${process.pid}.trace`);
+  assert.strictEqual(echo.dumpTrace(file), 15);
+  const lines = fs.readFileSync(file, 'utf8').split('\n');
+  fs.unlinkSync(file);
+  assert.strictEqual(lines.pop(), '');
+  assert.deepStrictEqual(
+    lines,
+    latest.map(e =>
+      `${e.time} ${e.worker} ${e.connection} ${e.type} ${e.code ?? e.value}`));
+};
+
+
+tests.log = async () => {
+  // Nothing listens on the upstream port, so each client fails the same way.
+
+  const logged = [];
+  echo.on('log', info => logged.push(info));
+  echo.start(3018, { mode: 'proxy', upstreamPort: 3019, upstreamPool: 0 });
+
+  await Promise.all(Array.from({ length: 50 }, () => {
+    const client = connect(3018);
+    client.write("x");
+    return client.ended;
+  }));
+  assert.strictEqual(echo.stats().upstreamErrors, 50);
+
+  // A burst of the same error is logged 10 times, then summarized once the
+  // interval of the rate limit is over.
+
+  const message = "Error on connecting upstream: connection refused";
+  await until(() => logged.some(info => info.suppressed != 0), "summary");
+  assert.deepStrictEqual(logged, [
+    ...Array(10).fill(
+      { message: message + ".", code: 'ECONNREFUSED', suppressed: 0 }),
+    {
+      message: message + " (40 more suppressed).", code: 'ECONNREFUSED',
+      suppressed: 40
+    }
+  ]);
+
+  // The next interval starts afresh.
+
+  const client = connect(3018);
+  client.write("x");
+  await client.ended;
+  await until(() => logged.length == 12, "error");
+  assert.strictEqual(logged[11].suppressed, 0);
+};
+
+
+if (servers[process.argv[2]])
+{
+  process.on('disconnect', () => process.exit(0));
+  servers[process.argv[2]]();
+}
+else if (process.argv[2])
+{
+  tests[process.argv[2]]().then(
+    () => process.exit(0),
+    err => { console.error(err); process.exit(1); });
+}
+else
+{
+  let failed = 0;
+  for (const name of Object.keys(tests))
+  {
+    const result = child_process.spawnSync(
+      process.execPath, [__filename, name], { stdio: 'inherit' });
+    console.log((result.status === 0 ? "ok " : "FAILED ") + name);
+    if (result.status !== 0) ++failed;
+  }
+  process.exit(failed ? 1 : 0);
+}
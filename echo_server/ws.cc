@@ -0,0 +1,492 @@
+#include "ws.h"
+
+#include <openssl/evp.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WS_SIMD_X86
+#endif
+
+
+namespace echo_server {
+
+
+static const size_t max_handshake_size = 8 * 1024;
+
+static const size_t max_message_size = 16 * 1024 * 1024;
+
+static const char websocket_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+//
+// Close status codes.
+//
+enum
+{
+  CLOSE_PROTOCOL_ERROR = 1002,
+  CLOSE_TOO_BIG = 1009,
+};
+
+
+//
+// Unmasking.
+//
+// Payload byte i is XORed with byte i % 4 of the masking key. The vector
+// kernels XOR whole registers with the key repeated across them, which keeps
+// the key aligned with the payload as long as they advance by multiples of 4.
+//
+
+static void unmask_scalar(char *p, size_t len, const char *key)
+{
+  for (size_t i = 0; i < len; ++i) p[i] ^= key[i & 3];
+}
+
+
+#ifdef WS_SIMD_X86
+
+__attribute__((target("sse2")))
+static void unmask_sse2(char *p, size_t len, const char *key)
+{
+  int32_t k;
+  ::memcpy(&k, key, 4);
+  const __m128i mask = _mm_set1_epi32(k);
+
+  size_t i = 0;
+  for (; len - i >= 16; i += 16)
+  {
+    __m128i *q = reinterpret_cast<__m128i *>(p + i);
+    _mm_storeu_si128(q, _mm_xor_si128(_mm_loadu_si128(q), mask));
+  }
+
+  unmask_scalar(p + i, len - i, key);
+}
+
+
+__attribute__((target("avx2")))
+static void unmask_avx2(char *p, size_t len, const char *key)
+{
+  int32_t k;
+  ::memcpy(&k, key, 4);
+  const __m256i mask = _mm256_set1_epi32(k);
+
+  size_t i = 0;
+  for (; len - i >= 64; i += 64)
+  {
+    __m256i *q = reinterpret_cast<__m256i *>(p + i);
+    _mm256_storeu_si256(q, _mm256_xor_si256(_mm256_loadu_si256(q), mask));
+    _mm256_storeu_si256(
+      q + 1, _mm256_xor_si256(_mm256_loadu_si256(q + 1), mask));
+  }
+  for (; len - i >= 32; i += 32)
+  {
+    __m256i *q = reinterpret_cast<__m256i *>(p + i);
+    _mm256_storeu_si256(q, _mm256_xor_si256(_mm256_loadu_si256(q), mask));
+  }
+
+  unmask_scalar(p + i, len - i, key);
+}
+
+#endif
+
+
+typedef void (*unmask_fn)(char *p, size_t len, const char *key);
+
+
+static unmask_fn select_unmask()
+{
+#ifdef WS_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return unmask_avx2;
+  if (__builtin_cpu_supports("sse2")) return unmask_sse2;
+#endif
+
+  return unmask_scalar;
+}
+
+
+static const unmask_fn unmask = select_unmask();
+
+
+//
+// Opening handshake.
+//
+
+static const char *find_crlf(const char *p, const char *end)
+{
+  return reinterpret_cast<const char *>(::memmem(p, end - p, "\r\n", 2));
+}
+
+
+static bool has_token(const char *value, const char *end, const char *token)
+{
+  // Looks for [token] in the comma separated list [value], ignoring case.
+
+  size_t token_len = ::strlen(token);
+
+  while (value < end)
+  {
+    const char *comma =
+      reinterpret_cast<const char *>(::memchr(value, ',', end - value));
+    const char *item_end = comma ? comma : end;
+
+    while (value < item_end && (*value == ' ' || *value == '\t')) ++value;
+    while (item_end > value && (item_end[-1] == ' ' || item_end[-1] == '\t'))
+      --item_end;
+
+    if (static_cast<size_t>(item_end - value) == token_len &&
+        ::strncasecmp(value, token, token_len) == 0)
+      return true;
+
+    value = comma ? comma + 1 : end;
+  }
+
+  return false;
+}
+
+
+static bool is_header(const char *line, const char *colon, const char *name)
+{
+  return static_cast<size_t>(colon - line) == ::strlen(name) &&
+    ::strncasecmp(line, name, colon - line) == 0;
+}
+
+
+enum handshake_status
+{
+  HANDSHAKE_OK,
+  HANDSHAKE_INCOMPLETE,
+  HANDSHAKE_BAD_REQUEST,
+  HANDSHAKE_BAD_VERSION,
+};
+
+
+static handshake_status parse_handshake(const char *data, size_t len,
+                                        size_t *consumed,
+                                        const char **key, size_t *key_len)
+{
+  const char *end =
+    data + (len > max_handshake_size ? max_handshake_size : len);
+
+  const char *head_end =
+    reinterpret_cast<const char *>(::memmem(data, end - data, "\r\n\r\n", 4));
+  if (!head_end)
+    return end - data == static_cast<ptrdiff_t>(max_handshake_size)
+      ? HANDSHAKE_BAD_REQUEST
+      : HANDSHAKE_INCOMPLETE;
+  head_end += 2; // Keep the CRLF of the last header line.
+
+  // GET request-target HTTP/1.1
+
+  const char *line_end = find_crlf(data, head_end);
+  if (line_end - data < 14 || ::memcmp(data, "GET ", 4) != 0 ||
+      ::memcmp(line_end - 9, " HTTP/1.1", 9) != 0)
+    return HANDSHAKE_BAD_REQUEST;
+
+  bool upgrade = false;
+  bool connection = false;
+  bool version = false;
+  *key = NULL;
+  *key_len = 0;
+
+  for (const char *line = line_end + 2; line < head_end; line = line_end + 2)
+  {
+    line_end = find_crlf(line, head_end);
+
+    const char *colon =
+      reinterpret_cast<const char *>(::memchr(line, ':', line_end - line));
+    if (!colon) return HANDSHAKE_BAD_REQUEST;
+
+    const char *value = colon + 1;
+    const char *value_end = line_end;
+    while (value < value_end && (*value == ' ' || *value == '\t')) ++value;
+    while (value_end > value &&
+           (value_end[-1] == ' ' || value_end[-1] == '\t'))
+      --value_end;
+
+    if (is_header(line, colon, "upgrade"))
+      upgrade = has_token(value, value_end, "websocket");
+    else if (is_header(line, colon, "connection"))
+      connection = has_token(value, value_end, "upgrade");
+    else if (is_header(line, colon, "sec-websocket-version"))
+      version = value_end - value == 2 && ::memcmp(value, "13", 2) == 0;
+    else if (is_header(line, colon, "sec-websocket-key"))
+    {
+      *key = value;
+      *key_len = value_end - value;
+    }
+  }
+
+  if (!upgrade || !connection || !*key || *key_len != 24)
+    return HANDSHAKE_BAD_REQUEST;
+  if (!version) return HANDSHAKE_BAD_VERSION;
+
+  *consumed = head_end + 2 - data;
+  return HANDSHAKE_OK;
+}
+
+
+static bool accept_handshake(const char *key, size_t key_len, buffer *out)
+{
+  // Sec-WebSocket-Accept is the base64 of the SHA-1 of the key followed by
+  // the WebSocket GUID.
+
+  char input[24 + sizeof(websocket_guid) - 1];
+  ::memcpy(input, key, key_len);
+  ::memcpy(input + key_len, websocket_guid, sizeof(websocket_guid) - 1);
+
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  if (!EVP_Digest(input, sizeof(input), digest, &digest_len, EVP_sha1(), NULL))
+    return false;
+
+  unsigned char accept[32];
+  int accept_len = EVP_EncodeBlock(accept, digest, digest_len);
+
+  static const char head[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: ";
+
+  return buffer_append(out, head, sizeof(head) - 1) &&
+    buffer_append(out, reinterpret_cast<char *>(accept), accept_len) &&
+    buffer_append(out, "\r\n\r\n", 4);
+}
+
+
+//
+// Frames.
+//
+
+void ws_init(ws_connection *ws)
+{
+  ws->open = false;
+  ws->message_opcode = WS_CONTINUATION;
+  ws->message.data = NULL;
+  ws->message.len = 0;
+  ws->message.cap = 0;
+}
+
+
+void ws_free(ws_connection *ws)
+{
+  buffer_free(&ws->message);
+}
+
+
+bool ws_frame(ws_opcode opcode, const char *payload, size_t len, buffer *out)
+{
+  unsigned char header[10];
+  size_t header_len;
+
+  header[0] = 0x80 | opcode; // FIN
+  if (len < 126)
+  {
+    header[1] = len;
+    header_len = 2;
+  }
+  else if (len < 65536)
+  {
+    header[1] = 126;
+    header[2] = len >> 8;
+    header[3] = len;
+    header_len = 4;
+  }
+  else
+  {
+    header[1] = 127;
+    for (int i = 0; i < 8; ++i) header[2 + i] = uint64_t(len) >> (56 - 8 * i);
+    header_len = 10;
+  }
+
+  return buffer_reserve(out, header_len + len) &&
+    buffer_append(out, reinterpret_cast<char *>(header), header_len) &&
+    buffer_append(out, payload, len);
+}
+
+
+static bool close_frame(int code, buffer *out)
+{
+  char payload[2] = { static_cast<char>(code >> 8), static_cast<char>(code) };
+  return ws_frame(WS_CLOSE_FRAME, payload, 2, out);
+}
+
+
+static ws_status fail(int code, buffer *out)
+{
+  return close_frame(code, out) ? WS_CLOSE : WS_OUT_OF_MEMORY;
+}
+
+
+ws_status ws_execute(ws_connection *ws,
+                     char *data, size_t len,
+                     buffer *out,
+                     size_t *consumed, size_t *messages,
+                     ws_message_cb cb, void *arg)
+{
+  char *p = data;
+  char *end = data + len;
+
+  *consumed = 0;
+  *messages = 0;
+
+  if (!ws->open)
+  {
+    const char *key;
+    size_t key_len;
+    size_t handshake_len;
+    handshake_status status =
+      parse_handshake(data, len, &handshake_len, &key, &key_len);
+
+    if (status == HANDSHAKE_INCOMPLETE) return WS_OK;
+
+    if (status == HANDSHAKE_BAD_VERSION)
+    {
+      static const char response[] =
+        "HTTP/1.1 426 Upgrade Required\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+      return buffer_append(out, response, sizeof(response) - 1)
+        ? WS_CLOSE
+        : WS_OUT_OF_MEMORY;
+    }
+
+    if (status != HANDSHAKE_OK)
+    {
+      static const char response[] =
+        "HTTP/1.1 400 Bad Request\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+      return buffer_append(out, response, sizeof(response) - 1)
+        ? WS_CLOSE
+        : WS_OUT_OF_MEMORY;
+    }
+
+    if (!accept_handshake(key, key_len, out)) return WS_OUT_OF_MEMORY;
+
+    ws->open = true;
+    p += handshake_len;
+    *consumed = handshake_len;
+  }
+
+  for (;;)
+  {
+    *consumed = p - data;
+
+    if (end - p < 2) return WS_OK;
+
+    unsigned char b0 = p[0];
+    unsigned char b1 = p[1];
+
+    bool fin = b0 & 0x80;
+    unsigned opcode = b0 & 0x0f;
+    uint64_t payload_len = b1 & 0x7f;
+    size_t header_len = 2;
+
+    if (payload_len == 126)
+    {
+      if (end - p < 4) return WS_OK;
+      payload_len = (uint64_t(uint8_t(p[2])) << 8) | uint8_t(p[3]);
+      header_len = 4;
+    }
+    else if (payload_len == 127)
+    {
+      if (end - p < 10) return WS_OK;
+      payload_len = 0;
+      for (int i = 0; i < 8; ++i)
+        payload_len = (payload_len << 8) | uint8_t(p[2 + i]);
+      header_len = 10;
+    }
+
+    // Client frames must be masked, and without extensions the reserved
+    // bits must be clear.
+
+    if ((b0 & 0x70) != 0 || (b1 & 0x80) == 0)
+      return fail(CLOSE_PROTOCOL_ERROR, out);
+
+    if (payload_len > max_message_size) return fail(CLOSE_TOO_BIG, out);
+
+    header_len += 4;
+    if (static_cast<uint64_t>(end - p) < header_len + payload_len)
+      return WS_OK;
+
+    const char *key = p + header_len - 4;
+    char *payload = p + header_len;
+    unmask(payload, payload_len, key);
+
+    p += header_len + payload_len;
+
+    if (opcode >= WS_CLOSE_FRAME)
+    {
+      // Control frames may come between the fragments of a message.
+
+      if (!fin || payload_len > 125) return fail(CLOSE_PROTOCOL_ERROR, out);
+
+      if (opcode == WS_CLOSE_FRAME)
+      {
+        // Echo the status code, if any, and close.
+
+        *consumed = p - data;
+        return ws_frame(
+          WS_CLOSE_FRAME, payload, payload_len >= 2 ? 2 : 0, out)
+          ? WS_CLOSE
+          : WS_OUT_OF_MEMORY;
+      }
+      else if (opcode == WS_PING)
+      {
+        if (!ws_frame(WS_PONG, payload, payload_len, out))
+          return WS_OUT_OF_MEMORY;
+      }
+      else if (opcode != WS_PONG)
+      {
+        return fail(CLOSE_PROTOCOL_ERROR, out);
+      }
+
+      continue;
+    }
+
+    if (opcode == WS_TEXT || opcode == WS_BINARY)
+    {
+      if (ws->message_opcode != WS_CONTINUATION)
+        return fail(CLOSE_PROTOCOL_ERROR, out);
+
+      if (fin)
+      {
+        if (!cb(arg, static_cast<ws_opcode>(opcode), payload, payload_len))
+          return WS_OUT_OF_MEMORY;
+        ++*messages;
+        continue;
+      }
+
+      ws->message_opcode = opcode;
+    }
+    else if (opcode != WS_CONTINUATION ||
+             ws->message_opcode == WS_CONTINUATION)
+    {
+      return fail(CLOSE_PROTOCOL_ERROR, out);
+    }
+
+    if (ws->message.len + payload_len > max_message_size)
+      return fail(CLOSE_TOO_BIG, out);
+
+    if (!buffer_append(&ws->message, payload, payload_len))
+      return WS_OUT_OF_MEMORY;
+
+    if (fin)
+    {
+      bool ok = cb(
+        arg, static_cast<ws_opcode>(ws->message_opcode),
+        ws->message.data, ws->message.len);
+
+      ws->message_opcode = WS_CONTINUATION;
+      buffer_free(&ws->message);
+
+      if (!ok) return WS_OUT_OF_MEMORY;
+      ++*messages;
+    }
+  }
+}
+
+} // namespace echo_server
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer.h"
+
+namespace echo_server {
+
+//
+// WebSocket (RFC 6455) server side framing.
+//
+// A connection starts with the HTTP opening handshake and then carries
+// frames. Client frames are masked; payloads are unmasked in place with SSE2
+// or AVX2 when the CPU has them. Fragmented messages are reassembled, pings are
+// answered and a close frame is echoed before the connection is closed.
+// Extensions and subprotocols are not negotiated, and text messages are not
+// validated as UTF-8.
+//
+
+enum ws_status
+{
+  WS_OK,
+  WS_CLOSE, // The connection is to be closed after the output is written.
+  WS_OUT_OF_MEMORY,
+};
+
+enum ws_opcode
+{
+  WS_CONTINUATION = 0x0,
+  WS_TEXT = 0x1,
+  WS_BINARY = 0x2,
+  WS_CLOSE_FRAME = 0x8,
+  WS_PING = 0x9,
+  WS_PONG = 0xa,
+};
+
+struct ws_connection
+{
+  bool open;              // The handshake has been completed.
+  uint8_t message_opcode; // Of the fragmented message in [message].
+  buffer message;         // Fragments received so far.
+};
+
+//
+// Called with each complete text or binary message. [data] is only valid
+// during the call. Returns false if out of memory.
+//
+typedef bool (*ws_message_cb)(void *arg,
+                              ws_opcode opcode,
+                              const char *data, size_t len);
+
+
+extern void ws_init(ws_connection *ws);
+
+extern void ws_free(ws_connection *ws);
+
+//
+// Executes the handshake and the complete frames at the start of [data],
+// which is modified by unmasking, and appends the responses to [out].
+// [consumed] is set to the number of bytes processed; the rest is an
+// incomplete frame that has to be passed again once more data has arrived.
+// [messages] is set to the number of messages passed to [cb].
+//
+extern ws_status ws_execute(ws_connection *ws,
+                            char *data, size_t len,
+                            buffer *out,
+                            size_t *consumed, size_t *messages,
+                            ws_message_cb cb, void *arg);
+
+//
+// Appends a server frame with [payload] to [out]. Returns false if out of
+// memory.
+//
+extern bool ws_frame(ws_opcode opcode,
+                     const char *payload, size_t len,
+                     buffer *out);
+
+} // namespace echo_server
@@ -0,0 +1,155 @@
+# This file is generated by gyp; do not edit.
+
+TOOLSET := target
+TARGET := native_wrap
+DEFS_Debug := \
+	'-DNODE_GYP_MODULE_NAME=native_wrap' \
+	'-DUSING_UV_SHARED=1' \
+	'-DUSING_V8_SHARED=1' \
+	'-DV8_DEPRECATION_WARNINGS=1' \
+	'-D_GLIBCXX_USE_CXX11_ABI=1' \
+	'-D_FILE_OFFSET_BITS=64' \
+	'-D_LARGEFILE_SOURCE' \
+	'-D__STDC_FORMAT_MACROS' \
+	'-DOPENSSL_NO_PINSHARED' \
+	'-DOPENSSL_THREADS' \
+	'-DBUILDING_NODE_EXTENSION' \
+	'-DDEBUG' \
+	'-D_DEBUG'
+
+# Flags passed to all source files.
+CFLAGS_Debug := \
+	-fPIC \
+	-pthread \
+	-Wall \
+	-Wextra \
+	-Wno-unused-parameter \
+	-m64 \
+	-g \
+	-O0
+
+# Flags passed to only C files.
+CFLAGS_C_Debug :=
+
+# Flags passed to only C++ files.
+CFLAGS_CC_Debug := \
+	-fno-rtti \
+	-fno-exceptions \
+	-std=gnu++17
+
+INCS_Debug := \
+	-I/root/.nvm/versions/node/v20.19.5/include/node \
+	-I/root/.nvm/versions/node/v20.19.5/src \
+	-I/root/.nvm/versions/node/v20.19.5/deps/openssl/config \
+	-I/root/.nvm/versions/node/v20.19.5/deps/openssl/openssl/include \
+	-I/root/.nvm/versions/node/v20.19.5/deps/uv/include \
+	-I/root/.nvm/versions/node/v20.19.5/deps/zlib \
+	-I/root/.nvm/versions/node/v20.19.5/deps/v8/include
+
+DEFS_Release := \
+	'-DNODE_GYP_MODULE_NAME=native_wrap' \
+	'-DUSING_UV_SHARED=1' \
+	'-DUSING_V8_SHARED=1' \
+	'-DV8_DEPRECATION_WARNINGS=1' \
+	'-D_GLIBCXX_USE_CXX11_ABI=1' \
+	'-D_FILE_OFFSET_BITS=64' \
+	'-D_LARGEFILE_SOURCE' \
+	'-D__STDC_FORMAT_MACROS' \
+	'-DOPENSSL_NO_PINSHARED' \
+	'-DOPENSSL_THREADS' \
+	'-DBUILDING_NODE_EXTENSION'
+
+# Flags passed to all source files.
+CFLAGS_Release := \
+	-fPIC \
+	-pthread \
+	-Wall \
+	-Wextra \
+	-Wno-unused-parameter \
+	-m64 \
+	-O3 \
+	-fno-omit-frame-pointer
+
+# Flags passed to only C files.
+CFLAGS_C_Release :=
+
+# Flags passed to only C++ files.
+CFLAGS_CC_Release := \
+	-fno-rtti \
+	-fno-exceptions \
+	-std=gnu++17
+
+INCS_Release := \
+	-I/root/.nvm/versions/node/v20.19.5/include/node \
+	-I/root/.nvm/versions/node/v20.19.5/src \
+	-I/root/.nvm/versions/node/v20.19.5/deps/openssl/config \
+	-I/root/.nvm/versions/node/v20.19.5/deps/openssl/openssl/include \
+	-I/root/.nvm/versions/node/v20.19.5/deps/uv/include \
+	-I/root/.nvm/versions/node/v20.19.5/deps/zlib \
+	-I/root/.nvm/versions/node/v20.19.5/deps/v8/include
+
+OBJS := \
+	$(obj).target/$(TARGET)/native_wrap.o \
+	$(obj).target/$(TARGET)/third_party.o
+
+# Add to the list of files we specially track dependencies for.
+all_deps += $(OBJS)
+
+# CFLAGS et al overrides must be target-local.
+# See "Target-specific Variable Values" in the GNU Make manual.
+$(OBJS): TOOLSET := $(TOOLSET)
+$(OBJS): GYP_CFLAGS := $(DEFS_$(BUILDTYPE)) $(INCS_$(BUILDTYPE))  $(CFLAGS_$(BUILDTYPE)) $(CFLAGS_C_$(BUILDTYPE))
+$(OBJS): GYP_CXXFLAGS := $(DEFS_$(BUILDTYPE)) $(INCS_$(BUILDTYPE))  $(CFLAGS_$(BUILDTYPE)) $(CFLAGS_CC_$(BUILDTYPE))
+
+# Suffix rules, putting all outputs into $(obj).
+
+$(obj).$(TOOLSET)/$(TARGET)/%.o: $(srcdir)/%.cpp FORCE_DO_CMD
+	@$(call do_cmd,cxx,1)
+
+# Try building from generated source, too.
+
+$(obj).$(TOOLSET)/$(TARGET)/%.o: $(obj).$(TOOLSET)/%.cpp FORCE_DO_CMD
+	@$(call do_cmd,cxx,1)
+
+$(obj).$(TOOLSET)/$(TARGET)/%.o: $(obj)/%.cpp FORCE_DO_CMD
+	@$(call do_cmd,cxx,1)
+
+# End of this set of suffix rules
+### Rules for final target.
+LDFLAGS_Debug := \
+	-pthread \
+	-rdynamic \
+	-m64
+
+LDFLAGS_Release := \
+	-pthread \
+	-rdynamic \
+	-m64
+
+LIBS :=
+
+$(obj).target/native_wrap.node: GYP_LDFLAGS := $(LDFLAGS_$(BUILDTYPE))
+$(obj).target/native_wrap.node: LIBS := $(LIBS)
+$(obj).target/native_wrap.node: TOOLSET := $(TOOLSET)
+$(obj).target/native_wrap.node: $(OBJS) FORCE_DO_CMD
+	$(call do_cmd,solink_module)
+
+all_deps += $(obj).target/native_wrap.node
+# Add target alias
+.PHONY: native_wrap
+native_wrap: $(builddir)/native_wrap.node
+
+# Copy this to the executable output path.
+$(builddir)/native_wrap.node: TOOLSET := $(TOOLSET)
+$(builddir)/native_wrap.node: $(obj).target/native_wrap.node FORCE_DO_CMD
+	$(call do_cmd,copy)
+
+all_deps += $(builddir)/native_wrap.node
+# Short alias for building this executable.
+.PHONY: native_wrap.node
+native_wrap.node: $(obj).target/native_wrap.node $(builddir)/native_wrap.node
+
+# Add executable to "all" target.
+.PHONY: all
+all: $(builddir)/native_wrap.node
+
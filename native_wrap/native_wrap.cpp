@@ -7,177 +7,342 @@
 // order to get the pointer you need first get the object wrap, which you don't
 // actually need to anything other then reading the pointer.
 //
-// This design stores the handle to both in the object wrap (referred to as the
-// tracker) and the V8 object. When you then invoke a method on the object the
-// implementation reads the handle of the underlying "third party" object
-// directly from the V8 object rather then going through the object wrap.
-// Reducing the number of memory hops by 1.
+// This design stores the handle to both in a tracker and the V8 object. When
+// you then invoke a method on the object the implementation reads the handle
+// of the underlying "third party" object directly from the V8 object rather
+// then going through the tracker. Reducing the number of memory hops by 1.
+//
+// The tracker is not an object wrap but a small record holding a weak handle
+// to the V8 object, taken from a pool, so wrapping an object costs no heap
+// allocation of its own.
+//
+// The "third party" objects are not destroyed during garbage collection but
+// queued and destroyed in batches from the event loop afterwards, so that
+// the cost of destroying them does not add to the GC pauses.
+//
+// Everything the wrapper keeps, from the template to the trackers, belongs
+// to one ThirdParty instance per Node.js environment, so that the addon can
+// be loaded by worker threads. The instance is passed to the functions as
+// their data and destroys the objects still alive when the environment is
+// torn down.
+//
+// The design is implemented for any handle based C API by the NativeWrap
+// template in native_wrap.hpp, which this file uses for the "third party"
+// API.
 //
 
-#include <assert.h>
 #include <node.h>
-#include <node_object_wrap.h>
 
+#include <vector>
+
+#include "native_wrap.hpp"
 #include "third_party.hpp"
 
 namespace native_wrap {
 
-class ThirdParty {
- public:
-  static void Init(v8::Isolate* isolate) {
-    // Prepare template.
-    //
-    // We create two internal fields: One for the tracker (field 0) and one
-    // for the handle to the "third party" object (field 1).
-
-    v8::Local<v8::FunctionTemplate> tpl = v8::FunctionTemplate::New(isolate, 0);
-    tpl->SetClassName(
-        v8::String::NewFromUtf8(isolate, "ThirdParty").ToLocalChecked());
-    tpl->InstanceTemplate()->SetInternalFieldCount(2);
+// The "third party" objects, wrapped as ThirdParty.
+typedef NativeWrap<third_party::handle_t, third_party::destroy,
+                   third_party::size_of>
+    ThirdParty;
 
-    // Register methods.
-
-    NODE_SET_PROTOTYPE_METHOD(tpl, "plusOne", PlusOne);
+static void CreateObject(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate* isolate = args.GetIsolate();
 
-    // Initialize instance factory.
+  double value =
+      args[0]->IsUndefined()
+          ? 0
+          : args[0]->NumberValue(isolate->GetCurrentContext()).ToChecked();
 
-    factory.Reset(isolate, tpl);
+  ThirdParty* wrapper = ThirdParty::From(args);
+  args.GetReturnValue().Set(
+      wrapper->NewInstance(isolate, third_party::create(value)));
+}
 
-    // Create a new instance in order to get a hold of the prototype (which is
-    // later used for type checking).
+static void PlusOne(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate* isolate = args.GetIsolate();
 
-    v8::Local<v8::Object> instance =
-        tpl->InstanceTemplate()
-            ->NewInstance(isolate->GetCurrentContext())
-            .ToLocalChecked();
-    prototype.Reset(isolate, instance->GetPrototype());
+  if (args.Length() != 1) {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong number of arguments")
+            .ToLocalChecked()));
+    return;
   }
 
-  static v8::Local<v8::Object> NewInstance(v8::Isolate* isolate,
-                                           const double value) {
-    // Create the "third party" object and get a handle to it.
+  v8::MaybeLocal<v8::Object> arg_handle =
+      args[0]->ToObject(isolate->GetCurrentContext());
+  v8::Local<v8::Object> handle;
 
-    third_party::handle_t obj = third_party::create(value);
+  ThirdParty* wrapper = ThirdParty::From(args);
+  if (!wrapper->IsInstanceOrThrow(isolate, arg_handle, handle) ||
+      !wrapper->IsAliveOrThrow(isolate, handle))
+    return;
 
-    // Create the V8 object to represent the "third party" object.
+  args.GetReturnValue().Set(third_party::plus_one(ThirdParty::Unwrap(handle)));
+}
 
-    v8::Local<v8::FunctionTemplate> tpl =
-        v8::Local<v8::FunctionTemplate>::New(isolate, factory);
-    v8::Local<v8::Object> handle =
-        tpl->InstanceTemplate()
-            ->NewInstance(isolate->GetCurrentContext())
-            .ToLocalChecked();
+#if V8_MAJOR_VERSION >= 12
+struct CollectHandlesData {
+  ThirdParty* wrapper;
+  third_party::handle_t* handles;
+  uint32_t length;
+  uint32_t collected;  // Elements seen by CollectHandle.
+  bool failed;
+};
 
-    // Store the handle of the "third party" object in an internal field of
-    // the V8 object.
+static v8::Array::CallbackResult CollectHandle(uint32_t index,
+                                               v8::Local<v8::Value> element,
+                                               void* data) {
+  CollectHandlesData* collect = static_cast<CollectHandlesData*>(data);
+
+  // A getter may have grown the array since its length was read.
+  if (index < collect->length) {
+    collect->handles[index] = collect->wrapper->UnwrapIfInstance(element);
+    if (collect->handles[index] != nullptr) {
+      ++collect->collected;
+      return v8::Array::CallbackResult::kContinue;
+    }
+  }
 
-    handle->SetAlignedPointerInInternalField(1, obj);
+  collect->failed = true;
+  return v8::Array::CallbackResult::kBreak;
+}
+#endif
+
+static bool CollectHandlesOrThrow(v8::Isolate* isolate, ThirdParty* wrapper,
+                                  v8::Local<v8::Array> objects,
+                                  third_party::handle_t* handles,
+                                  uint32_t length) {
+  // Sets [handles] to the handles of the "third party" objects of the
+  // ThirdParty objects in the first [length] elements of [objects]. Throws
+  // and returns false if there is anything else in [objects], or a disposed
+  // ThirdParty. Reading the elements can run getters.
+  //
+  // Array::Iterate, where V8 has it (V8 12, Node.js 22), reads the elements
+  // without the lookup that Object::Get does for each, which otherwise costs
+  // more than the call to third_party::plus_one. Builds against older
+  // headers only compile and test the loop with Object::Get.
+
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  bool failed = false;
+
+#if V8_MAJOR_VERSION >= 12
+  CollectHandlesData collect = {wrapper, handles, length, 0, false};
+  if (objects->Iterate(context, CollectHandle, &collect).IsNothing())
+    return false;
 
-    // Create a tracker that destroys the third party object once it goes out
-    // of scope.
+  // Iterate stops early if a getter shrinks the array, leaving handles
+  // unset.
+  failed = collect.failed || collect.collected != length;
+#else
+  for (uint32_t i = 0; i < length && !failed; ++i) {
+    v8::HandleScope handle_scope(isolate);
 
-    Tracker::New(obj, handle);
+    v8::Local<v8::Value> value;
+    if (!objects->Get(context, i).ToLocal(&value)) return false;
 
-    return handle;
+    handles[i] = wrapper->UnwrapIfInstance(value);
+    failed = handles[i] == nullptr;
   }
+#endif
 
-  static bool IsInstanceOrThrow(v8::Isolate* isolate,
-                                v8::MaybeLocal<v8::Object>& maybe_handle,
-                                v8::Local<v8::Object>& handle) {
-    if (maybe_handle.ToLocal(&handle)) {
-      v8::Local<v8::Value> target_prototype = handle->GetPrototype();
-      if (target_prototype == prototype) return true;
-    }
-
+  if (failed) {
     isolate->ThrowException(v8::Exception::TypeError(
-        v8::String::NewFromUtf8(isolate, "<this> is not a ThirdParty")
+        v8::String::NewFromUtf8(
+            isolate, "<objects> has a non-ThirdParty or disposed ThirdParty")
             .ToLocalChecked()));
     return false;
   }
 
-  static double PlusOne(v8::Local<v8::Object>& verified_handle) {
-    third_party::handle_t obj = Unwrap(verified_handle);
-    return third_party::plus_one(obj);
-  }
+  return true;
+}
 
- private:
-  class Tracker : public node::ObjectWrap {
-   public:
-    ~Tracker() { third_party::destroy(obj_); }
+static void PlusOneMany(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  // plusOneMany(objects[, out])
+  //
+  // Calls plusOne on each ThirdParty of the array [objects] and writes the
+  // results to the Float64Array [out], which must have room for them, or to
+  // a new Float64Array if [out] is not passed. Returns the results.
+  //
+  // All objects are checked before any is changed, so if one is not a
+  // ThirdParty the call throws without effect.
 
-    static void New(third_party::handle_t obj, v8::Local<v8::Object>& handle) {
-      Tracker* t = new Tracker(obj);
+  v8::Isolate* isolate = args.GetIsolate();
 
-      // What node::ObjectWrap::Wrap does is that is creates a weak peristent
-      // handle referencing the V8 object. When all non-weak handled
-      // referecing the object goes out of scope a callback registered with
-      // weak handle is called which in turn deletes it. This is how the
-      // destructor of the native object is called.
+  if (args.Length() < 1 || args.Length() > 2 || !args[0]->IsArray() ||
+      (args.Length() == 2 && !args[1]->IsFloat64Array())) {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
+    return;
+  }
 
-      t->Wrap(handle);
-    }
+  v8::Local<v8::Array> objects = args[0].As<v8::Array>();
+  uint32_t length = objects->Length();
 
-   private:
-    explicit Tracker(third_party::handle_t obj) : obj_(obj) {}
+  // Collect the handles of the "third party" objects first, so that the loop
+  // that does the work touches no V8 object. Getters run while collecting
+  // may detach or shrink [out], so it is only checked afterwards. They may
+  // also dispose of objects already collected, so the call throws if any
+  // object was disposed meanwhile.
 
-    third_party::handle_t obj_;
-  };
+  ThirdParty* wrapper = ThirdParty::From(args);
+  uint64_t disposals = wrapper->Disposals();
 
-  static third_party::handle_t Unwrap(v8::Local<v8::Object>& handle) {
-    third_party::handle_t obj = handle->GetAlignedPointerFromInternalField(1);
-    return obj;
+  std::vector<third_party::handle_t> handles(length);
+  if (!CollectHandlesOrThrow(isolate, wrapper, objects, handles.data(),
+                             length))
+    return;
+
+  if (wrapper->Disposals() != disposals) {
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(
+            isolate, "A ThirdParty was disposed while reading <objects>")
+            .ToLocalChecked()));
+    return;
   }
 
-  static void PlusOne(const v8::FunctionCallbackInfo<v8::Value>& args) {
-    v8::Isolate* isolate = args.GetIsolate();
-    v8::Local<v8::Object> this_handle = args.Holder();
-    args.GetReturnValue().Set(v8::Number::New(isolate, PlusOne(this_handle)));
+  v8::Local<v8::Float64Array> out;
+  if (args.Length() == 2) {
+    out = args[1].As<v8::Float64Array>();
+    if (out->Buffer()->WasDetached()) {
+      isolate->ThrowException(v8::Exception::TypeError(
+          v8::String::NewFromUtf8(isolate, "<out> has been detached")
+              .ToLocalChecked()));
+      return;
+    }
+    if (out->Length() < length) {
+      isolate->ThrowException(v8::Exception::RangeError(
+          v8::String::NewFromUtf8(isolate, "<out> is too short")
+              .ToLocalChecked()));
+      return;
+    }
+  } else {
+    out = v8::Float64Array::New(
+        v8::ArrayBuffer::New(isolate, length * sizeof(double)), 0, length);
   }
 
-  static v8::Persistent<v8::FunctionTemplate> factory;
-  static v8::Persistent<v8::Value> prototype;
-};
+  double* results = reinterpret_cast<double*>(
+      static_cast<char*>(out->Buffer()->Data()) + out->ByteOffset());
 
-v8::Persistent<v8::FunctionTemplate> ThirdParty::factory;
-v8::Persistent<v8::Value> ThirdParty::prototype;
+  for (uint32_t i = 0; i < length; ++i) {
+    results[i] = third_party::plus_one(handles[i]);
+  }
+
+  args.GetReturnValue().Set(out);
+}
+
+static void SetStat(v8::Isolate* isolate, v8::Local<v8::Object> obj,
+                    const char* name, size_t value) {
+  obj->Set(isolate->GetCurrentContext(),
+           v8::String::NewFromUtf8(isolate, name).ToLocalChecked(),
+           v8::Number::New(isolate, static_cast<double>(value)))
+      .FromJust();
+}
+
+static void AllocatorStats(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  // allocatorStats()
+  //
+  // Returns { slabs, slots, used, slotSize }: the number of slabs that the
+  // "third party" objects are allocated from, the number of objects that fit
+  // in them, the number of objects alive and the bytes taken by each.
 
-static void CreateObject(const v8::FunctionCallbackInfo<v8::Value>& args) {
   v8::Isolate* isolate = args.GetIsolate();
 
-  double value =
-      args[0]->IsUndefined()
-          ? 0
-          : args[0]->NumberValue(isolate->GetCurrentContext()).ToChecked();
+  third_party::allocator_stats_t stats;
+  third_party::get_allocator_stats(&stats);
 
-  args.GetReturnValue().Set(ThirdParty::NewInstance(isolate, value));
+  v8::Local<v8::Object> obj = v8::Object::New(isolate);
+  SetStat(isolate, obj, "slabs", stats.slabs);
+  SetStat(isolate, obj, "slots", stats.slots);
+  SetStat(isolate, obj, "used", stats.used);
+  SetStat(isolate, obj, "slotSize", stats.slot_size);
+
+  args.GetReturnValue().Set(obj);
 }
 
-static void PlusOne(const v8::FunctionCallbackInfo<v8::Value>& args) {
+static void ExternalMemory(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  // externalMemory()
+  //
+  // Returns the bytes of native memory reported to V8 as kept alive by V8
+  // objects, such as the ThirdParty objects. process.memoryUsage() does not
+  // include them in its external memory.
+
+  args.GetReturnValue().Set(static_cast<double>(
+      args.GetIsolate()->AdjustAmountOfExternalAllocatedMemory(0)));
+}
+
+static void TrackerStats(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  // trackerStats()
+  //
+  // Returns { trackers, free, collected }: the number of trackers allocated
+  // for the ThirdParty objects of this environment, the number of those that
+  // are free to be reused and the number of objects destroyed after being
+  // garbage collected.
+
   v8::Isolate* isolate = args.GetIsolate();
+  ThirdParty* wrap = ThirdParty::From(args);
 
-  if (args.Length() != 1) {
+  v8::Local<v8::Object> obj = v8::Object::New(isolate);
+  SetStat(isolate, obj, "trackers", wrap->Trackers());
+  SetStat(isolate, obj, "free", wrap->FreeTrackers());
+  SetStat(isolate, obj, "collected", wrap->Collections());
+
+  args.GetReturnValue().Set(obj);
+}
+
+static void SetDestroyBudget(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  // setDestroyBudget(budget)
+  //
+  // Sets the maximum number of collected objects whose "third party" object
+  // is destroyed per event loop iteration. Defaults to 1000.
+
+  v8::Isolate* isolate = args.GetIsolate();
+
+  if (args.Length() != 1 || !args[0]->IsUint32() ||
+      args[0].As<v8::Uint32>()->Value() == 0) {
     isolate->ThrowException(v8::Exception::TypeError(
-        v8::String::NewFromUtf8(isolate, "Wrong number of arguments")
-            .ToLocalChecked()));
+        v8::String::NewFromUtf8(isolate, "Wrong arguments").ToLocalChecked()));
     return;
   }
 
-  v8::MaybeLocal<v8::Object> arg_handle =
-      args[0]->ToObject(isolate->GetCurrentContext());
-  v8::Local<v8::Object> handle;
-
-  if (!ThirdParty::IsInstanceOrThrow(isolate, arg_handle, handle)) return;
+  ThirdParty::From(args)->SetDestroyBudget(args[0].As<v8::Uint32>()->Value());
+}
 
-  args.GetReturnValue().Set(
-      v8::Number::New(isolate, ThirdParty::PlusOne(handle)));
+// Like NODE_SET_METHOD but passing [data] to [callback].
+static void SetMethod(v8::Local<v8::Context> context,
+                      v8::Local<v8::Object> exports, const char* name,
+                      v8::FunctionCallback callback,
+                      v8::Local<v8::Value> data) {
+  v8::Isolate* isolate = context->GetIsolate();
+  v8::Local<v8::String> fn_name =
+      v8::String::NewFromUtf8(isolate, name, v8::NewStringType::kInternalized)
+          .ToLocalChecked();
+  v8::Local<v8::Function> fn =
+      v8::FunctionTemplate::New(isolate, callback, data)
+          ->GetFunction(context)
+          .ToLocalChecked();
+  fn->SetName(fn_name);
+  exports->Set(context, fn_name, fn).FromJust();
 }
 
 static void init(v8::Local<v8::Object> exports, v8::Local<v8::Value> module,
                  v8::Local<v8::Context> context) {
-  ThirdParty::Init(exports->GetIsolate());
-
-  NODE_SET_METHOD(exports, "createObject", CreateObject);
-  NODE_SET_METHOD(exports, "plusOne", PlusOne);
+  // Called for each environment that loads the addon, such as each worker
+  // thread. The instance deletes itself when the environment is torn down.
+
+  v8::Isolate* isolate = context->GetIsolate();
+  ThirdParty* third_party_wrap = new ThirdParty(isolate, "ThirdParty");
+  third_party_wrap->SetMethod<third_party::plus_one>("plusOne");
+
+  v8::Local<v8::External> wrapper =
+      v8::External::New(isolate, third_party_wrap);
+
+  SetMethod(context, exports, "createObject", CreateObject, wrapper);
+  SetMethod(context, exports, "plusOne", PlusOne, wrapper);
+  SetMethod(context, exports, "plusOneMany", PlusOneMany, wrapper);
+  SetMethod(context, exports, "allocatorStats", AllocatorStats, wrapper);
+  SetMethod(context, exports, "trackerStats", TrackerStats, wrapper);
+  SetMethod(context, exports, "externalMemory", ExternalMemory, wrapper);
+  SetMethod(context, exports, "setDestroyBudget", SetDestroyBudget, wrapper);
 }
 
 }  // namespace native_wrap
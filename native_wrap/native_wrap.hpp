@@ -0,0 +1,534 @@
+#pragma once
+
+//
+// NativeWrap wraps the objects of a C API that are only known by a pointer,
+// a handle, in V8 objects the way native_wrap.cpp describes: the handle is
+// kept in an internal field of the V8 object and read from there by each
+// method, a pooled tracker with a weak handle destroys the object in batches
+// once the V8 object has been collected, and the memory of the objects is
+// reported to V8.
+//
+// [Handle] is the pointer type of the handles, [Destroy] destroys an object
+// and [SizeOf], if given, returns the bytes of native memory that an object
+// keeps alive. The methods of the V8 objects are C functions that take the
+// handle as their first argument:
+//
+//   typedef NativeWrap<foo_t*, foo_destroy, foo_size> FooWrap;
+//
+//   FooWrap* wrap = new FooWrap(isolate, "Foo");
+//   wrap->SetMethod<foo_get>("get");  // double foo_get(foo_t*)
+//   wrap->SetMethod<foo_set>("set");  // void foo_set(foo_t*, double)
+//
+//   v8::Local<v8::Object> foo = wrap->NewInstance(isolate, foo_create());
+//
+// Each method gets its own callback, and optionally a fast overload (see
+// below), generated at compile time for the C function, so calling it costs
+// no more than the code written by hand. The arguments and return value can
+// be bool, int32_t, uint32_t or double.
+//
+// An instance is created for each environment that loads the addon, and
+// deletes itself when the environment is torn down, destroying the objects
+// still alive.
+//
+
+#include <node.h>
+#include <stdint.h>
+#include <uv.h>
+
+// V8's fast API calls let optimized code call a C++ function directly,
+// without a FunctionCallbackInfo and with raw arguments and return values.
+//
+// The fast overloads are experimental and off unless the addon is built
+// with NATIVE_WRAP_EXPERIMENTAL_FAST_API defined. The header is not among
+// the headers that Node.js releases ship for addons, so they can only be
+// built against a Node.js source tree (node-gyp --nodedir=<source>). Its
+// interface also changed before V8 10 and after V8 12 (which removed
+// FastApiCallbackOptions::fallback), so methods are only given a fast
+// overload where both fit. The regular callbacks always remain as the
+// fallback.
+//
+// This means that builds against a Node.js release have no fast overloads:
+// calling a method costs a regular API callback, and the code below behind
+// NATIVE_WRAP_FAST_API is neither compiled nor tested by them.
+#if defined(NATIVE_WRAP_EXPERIMENTAL_FAST_API) && defined(__has_include) && \
+    V8_MAJOR_VERSION >= 10 && V8_MAJOR_VERSION <= 12
+#if __has_include(<v8-fast-api-calls.h>)
+#include <v8-fast-api-calls.h>
+#define NATIVE_WRAP_FAST_API 1
+#endif
+#endif
+
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace native_wrap {
+
+template <typename Handle, void (*Destroy)(Handle),
+          size_t (*SizeOf)(Handle) = nullptr>
+class NativeWrap {
+  static_assert(std::is_pointer<Handle>::value, "Handle must be a pointer");
+
+ public:
+  NativeWrap(v8::Isolate* isolate, const char* class_name)
+      : isolate_(isolate), class_name_(class_name) {
+    // Prepare template.
+    //
+    // We create three internal fields: One for the tracker, one for the
+    // handle of the wrapped object and one for the brand, which is this
+    // instance and identifies the objects created by it.
+
+    v8::Local<v8::FunctionTemplate> tpl = v8::FunctionTemplate::New(isolate, 0);
+    tpl->SetClassName(
+        v8::String::NewFromUtf8(isolate, class_name).ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(kFieldCount);
+
+    factory_.Reset(isolate, tpl);
+
+    // dispose is also the [Symbol.dispose] method where the runtime has it,
+    // for `using` declarations.
+
+    v8::Local<v8::FunctionTemplate> dispose =
+        SetPrototypeMethod("dispose", Dispose, nullptr);
+
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+    v8::Local<v8::Value> symbol;
+    v8::Local<v8::Value> dispose_symbol;
+    if (context->Global()
+            ->Get(context, v8::String::NewFromUtf8Literal(isolate, "Symbol"))
+            .ToLocal(&symbol) &&
+        symbol->IsObject() &&
+        symbol.As<v8::Object>()
+            ->Get(context, v8::String::NewFromUtf8Literal(isolate, "dispose"))
+            .ToLocal(&dispose_symbol) &&
+        dispose_symbol->IsSymbol()) {
+      tpl->PrototypeTemplate()->Set(dispose_symbol.As<v8::Symbol>(), dispose);
+    }
+
+    // Prepare the destruction of collected objects. The idle handle only runs
+    // while there are objects to destroy, and never keeps the loop alive.
+
+    uv_idle_init(node::GetCurrentEventLoop(isolate), &destroy_idle_);
+    destroy_idle_.data = this;
+    uv_unref(reinterpret_cast<uv_handle_t*>(&destroy_idle_));
+
+    cleanup_hook_ = node::AddEnvironmentCleanupHook(isolate, Cleanup, this);
+  }
+
+  NativeWrap(const NativeWrap&) = delete;
+  NativeWrap& operator=(const NativeWrap&) = delete;
+
+  // Returns the instance passed as the data of a function.
+  static NativeWrap* From(const v8::FunctionCallbackInfo<v8::Value>& args) {
+    return static_cast<NativeWrap*>(args.Data().As<v8::External>()->Value());
+  }
+
+  // Adds the method [name] that calls [Method] with the handle of the object
+  // and the arguments. Must be called before the first NewInstance.
+  template <auto Method>
+  void SetMethod(const char* name) {
+    SetMethod<Method>(name, Method);
+  }
+
+  // Sets the maximum number of objects destroyed per event loop iteration.
+  void SetDestroyBudget(size_t budget) { destroy_budget_ = budget; }
+
+  // Returns the number of objects disposed so far. Handles read before
+  // running JavaScript are only known to be valid afterwards if it has not
+  // changed, since the slot of a disposed object may be reused.
+  uint64_t Disposals() const { return disposals_; }
+
+  // Returns the number of trackers allocated, of those that are free, and of
+  // the objects destroyed after being garbage collected.
+  size_t Trackers() const {
+    return tracker_blocks_.size() * kTrackerBlockSize;
+  }
+  size_t FreeTrackers() const { return free_tracker_count_; }
+  uint64_t Collections() const { return collections_; }
+
+  // Returns a new V8 object wrapping [obj], which it then owns.
+  v8::Local<v8::Object> NewInstance(v8::Isolate* isolate, Handle obj) {
+    v8::Local<v8::FunctionTemplate> tpl = factory_.Get(isolate);
+    v8::Local<v8::Object> handle =
+        tpl->InstanceTemplate()
+            ->NewInstance(isolate->GetCurrentContext())
+            .ToLocalChecked();
+
+    handle->SetAlignedPointerInInternalField(kHandleField, obj);
+    handle->SetAlignedPointerInInternalField(kBrandField, this);
+
+    // Create a tracker that destroys the object once the V8 object goes out
+    // of scope.
+
+    Track(isolate, obj, handle);
+
+    // Let V8 know about the native memory that the V8 object keeps alive, so
+    // that it takes it into account when deciding to collect garbage.
+
+    size_t size = SizeOfObject(obj);
+    if (size != 0) {
+      isolate->AdjustAmountOfExternalAllocatedMemory(
+          static_cast<int64_t>(size));
+    }
+
+    return handle;
+  }
+
+  // Returns true if [handle] was created by this instance. Only reads the
+  // internal fields of [handle], so it is cheaper than comparing prototypes
+  // and still holds if the prototype of [handle] has been changed.
+  bool IsInstance(v8::Local<v8::Object> handle) {
+    return handle->InternalFieldCount() == kFieldCount &&
+           handle->GetAlignedPointerFromInternalField(kBrandField) == this;
+  }
+
+  bool IsInstanceOrThrow(v8::Isolate* isolate,
+                         v8::MaybeLocal<v8::Object>& maybe_handle,
+                         v8::Local<v8::Object>& handle) {
+    if (maybe_handle.ToLocal(&handle) && IsInstance(handle)) return true;
+
+    isolate->ThrowException(v8::Exception::TypeError(
+        NewString(isolate, "<this> is not a " + class_name_)));
+    return false;
+  }
+
+  // Throws and returns false if the object of [handle] has been disposed.
+  bool IsAliveOrThrow(v8::Isolate* isolate, v8::Local<v8::Object>& handle) {
+    if (Unwrap(handle) != nullptr) return true;
+
+    isolate->ThrowException(v8::Exception::Error(
+        NewString(isolate, class_name_ + " has been disposed")));
+    return false;
+  }
+
+  // The checks of IsInstanceOrThrow and IsAliveOrThrow, without throwing.
+  // Returns the handle of the object of [value], or nullptr if [value] was
+  // not created by this instance or has been disposed.
+  Handle UnwrapIfInstance(v8::Local<v8::Value> value) {
+    if (!value->IsObject()) return nullptr;
+
+    v8::Local<v8::Object> handle = value.As<v8::Object>();
+    if (!IsInstance(handle)) return nullptr;
+
+    return Unwrap(handle);
+  }
+
+  // Returns the handle of the object of [handle], which must have been
+  // checked to be an instance, or nullptr if it has been disposed.
+  static Handle Unwrap(v8::Local<v8::Object> handle) {
+    return static_cast<Handle>(
+        handle->GetAlignedPointerFromInternalField(kHandleField));
+  }
+
+ private:
+  enum Field { kTrackerField, kHandleField, kBrandField, kFieldCount };
+
+  // A weak handle referencing the V8 object. When all non-weak handles
+  // referencing the object have gone out of scope, the callback registered
+  // with the weak handle queues the tracker for its object to be destroyed.
+  // Trackers are allocated [kTrackerBlockSize] at a time and reused once
+  // their object is gone.
+  struct Tracker {
+    v8::Global<v8::Object> handle;
+    Handle obj;  // nullptr while the tracker is free.
+    NativeWrap* owner;
+    Tracker* next_free;  // Or the next tracker to destroy.
+  };
+
+  static const size_t kTrackerBlockSize = 1024;
+
+  // The types that methods can take and return.
+  template <typename T>
+  struct IsScalar
+      : std::integral_constant<bool, std::is_same<T, bool>::value ||
+                                         std::is_same<T, int32_t>::value ||
+                                         std::is_same<T, uint32_t>::value ||
+                                         std::is_same<T, double>::value> {};
+
+  ~NativeWrap() {
+    for (Tracker* block : tracker_blocks_) delete[] block;
+  }
+
+  static size_t SizeOfObject(Handle obj) {
+    if constexpr (SizeOf != nullptr) {
+      return SizeOf(obj);
+    } else {
+      return 0;
+    }
+  }
+
+  static v8::Local<v8::String> NewString(v8::Isolate* isolate,
+                                         const std::string& value) {
+    return v8::String::NewFromUtf8(isolate, value.c_str()).ToLocalChecked();
+  }
+
+  void Track(v8::Isolate* isolate, Handle obj, v8::Local<v8::Object>& handle) {
+    if (free_trackers_ == nullptr) {
+      Tracker* block = new Tracker[kTrackerBlockSize];
+      for (size_t i = 0; i < kTrackerBlockSize; ++i) {
+        block[i].obj = nullptr;
+        block[i].owner = this;
+        block[i].next_free =
+            i + 1 < kTrackerBlockSize ? &block[i + 1] : nullptr;
+      }
+      tracker_blocks_.push_back(block);
+      free_trackers_ = block;
+      free_tracker_count_ = kTrackerBlockSize;
+    }
+
+    Tracker* t = free_trackers_;
+    free_trackers_ = t->next_free;
+    --free_tracker_count_;
+
+    t->obj = obj;
+    t->handle.Reset(isolate, handle);
+    t->handle.SetWeak(t, WeakCallback, v8::WeakCallbackType::kParameter);
+
+    handle->SetAlignedPointerInInternalField(kTrackerField, t);
+  }
+
+  void Release(Tracker* t) {
+    t->obj = nullptr;
+    t->next_free = free_trackers_;
+    free_trackers_ = t;
+    ++free_tracker_count_;
+  }
+
+  static void WeakCallback(const v8::WeakCallbackInfo<Tracker>& info) {
+    // Called during garbage collection, so only queues the tracker.
+
+    Tracker* t = info.GetParameter();
+    NativeWrap* owner = t->owner;
+
+    t->handle.Reset();
+
+    t->next_free = nullptr;
+    *owner->destroy_tail_ = t;
+    owner->destroy_tail_ = &t->next_free;
+
+    uv_idle_t* idle = &owner->destroy_idle_;
+    if (!uv_is_active(reinterpret_cast<uv_handle_t*>(idle)))
+      uv_idle_start(idle, DestroyCallback);
+  }
+
+  static void DestroyCallback(uv_idle_t* idle) {
+    // Destroys up to [destroy_budget_] queued objects, oldest first, and
+    // reports the memory released to V8 all at once.
+
+    NativeWrap* owner = static_cast<NativeWrap*>(idle->data);
+    int64_t released = 0;
+
+    for (size_t i = 0;
+         i < owner->destroy_budget_ && owner->destroy_queue_ != nullptr; ++i) {
+      Tracker* t = owner->destroy_queue_;
+      owner->destroy_queue_ = t->next_free;
+
+      released += static_cast<int64_t>(SizeOfObject(t->obj));
+      Destroy(t->obj);
+      owner->Release(t);
+      ++owner->collections_;
+    }
+
+    if (owner->destroy_queue_ == nullptr) {
+      owner->destroy_tail_ = &owner->destroy_queue_;
+      uv_idle_stop(idle);
+    }
+
+    if (released != 0)
+      owner->isolate_->AdjustAmountOfExternalAllocatedMemory(-released);
+  }
+
+  static void Cleanup(void* arg, void (*done)(void*), void* done_arg) {
+    // Called when the environment is torn down. Destroys the objects that
+    // are still alive or queued, then closes the idle handle and frees the
+    // instance once it is closed.
+
+    NativeWrap* owner = static_cast<NativeWrap*>(arg);
+
+    for (Tracker* block : owner->tracker_blocks_) {
+      for (size_t i = 0; i < kTrackerBlockSize; ++i) {
+        if (block[i].obj == nullptr) continue;
+
+        block[i].handle.Reset();
+        Destroy(block[i].obj);
+        block[i].obj = nullptr;
+      }
+    }
+
+    // Removing the hook from within the hook only releases the handle.
+
+    node::RemoveEnvironmentCleanupHook(std::move(owner->cleanup_hook_));
+
+    owner->cleanup_done_ = done;
+    owner->cleanup_done_arg_ = done_arg;
+    uv_close(reinterpret_cast<uv_handle_t*>(&owner->destroy_idle_),
+             [](uv_handle_t* handle) {
+               NativeWrap* owner = static_cast<NativeWrap*>(handle->data);
+               owner->cleanup_done_(owner->cleanup_done_arg_);
+               delete owner;
+             });
+  }
+
+  // Like NODE_SET_PROTOTYPE_METHOD but with an optional fast overload
+  // [c_function] of [callback]. Returns the template of the method.
+  v8::Local<v8::FunctionTemplate> SetPrototypeMethod(
+      const char* name, v8::FunctionCallback callback,
+      const v8::CFunction* c_function) {
+    v8::Local<v8::FunctionTemplate> tpl = factory_.Get(isolate_);
+    v8::Local<v8::Signature> signature = v8::Signature::New(isolate_, tpl);
+    v8::Local<v8::FunctionTemplate> method = v8::FunctionTemplate::New(
+        isolate_, callback, v8::Local<v8::Value>(), signature, 0,
+        v8::ConstructorBehavior::kThrow, v8::SideEffectType::kHasSideEffect,
+        c_function);
+    v8::Local<v8::String> method_name =
+        v8::String::NewFromUtf8(isolate_, name,
+                                v8::NewStringType::kInternalized)
+            .ToLocalChecked();
+    method->SetClassName(method_name);
+    tpl->PrototypeTemplate()->Set(method_name, method);
+    return method;
+  }
+
+  template <auto Method, typename R, typename... Params>
+  void SetMethod(const char* name, R (*)(Handle, Params...)) {
+    static_assert(std::is_void<R>::value || IsScalar<R>::value,
+                  "Methods must return void, bool, int32_t, uint32_t or "
+                  "double");
+    static_assert((IsScalar<Params>::value && ...),
+                  "Methods must take bool, int32_t, uint32_t or double");
+
+#ifdef NATIVE_WRAP_FAST_API
+    static const v8::CFunction c_function =
+        v8::CFunction::Make(FastCall<Method, R, Params...>);
+    SetPrototypeMethod(name, Call<Method, R, Params...>, &c_function);
+#else
+    SetPrototypeMethod(name, Call<Method, R, Params...>, nullptr);
+#endif
+  }
+
+  template <auto Method, typename R, typename... Params>
+  static void Call(const v8::FunctionCallbackInfo<v8::Value>& args) {
+    // The signature guarantees that the holder is an instance of the
+    // template. Setting the return value from a double stores it as a small
+    // integer where it fits, without allocating a v8::Number.
+
+    v8::Local<v8::Object> this_handle = args.Holder();
+    Handle obj = Unwrap(this_handle);
+    if (obj == nullptr) {
+      NativeWrap* owner = static_cast<NativeWrap*>(
+          this_handle->GetAlignedPointerFromInternalField(kBrandField));
+      owner->IsAliveOrThrow(args.GetIsolate(), this_handle);
+      return;
+    }
+
+    Invoke<Method, R, Params...>(args, obj,
+                                 std::index_sequence_for<Params...>());
+  }
+
+  template <auto Method, typename R, typename... Params, size_t... I>
+  static void Invoke(const v8::FunctionCallbackInfo<v8::Value>& args,
+                     Handle obj, std::index_sequence<I...>) {
+    std::tuple<Params...> params;
+    if constexpr (sizeof...(Params) != 0) {
+      v8::Local<v8::Context> context = args.GetIsolate()->GetCurrentContext();
+      if (!(FromValue(context, args[I], &std::get<I>(params)) && ...)) return;
+    }
+
+    if constexpr (std::is_void<R>::value) {
+      Method(obj, std::get<I>(params)...);
+    } else {
+      args.GetReturnValue().Set(Method(obj, std::get<I>(params)...));
+    }
+  }
+
+#ifdef NATIVE_WRAP_FAST_API
+  template <auto Method, typename R, typename... Params>
+  static R FastCall(v8::Local<v8::Object> receiver, Params... params,
+                    v8::FastApiCallbackOptions& options) {
+    // Only called by optimized code once the receiver has been checked
+    // against the signature, so no type check is needed here either. A fast
+    // call cannot throw, so a disposed receiver is left to the slow path.
+
+    Handle obj = Unwrap(receiver);
+    if (obj == nullptr) {
+      options.fallback = true;
+      return R();
+    }
+
+    return Method(obj, params...);
+  }
+#endif
+
+  // Convert the arguments of the slow path the way the fast path receives
+  // them. Return false if an exception is thrown.
+
+  static bool FromValue(v8::Local<v8::Context> context,
+                        v8::Local<v8::Value> value, bool* out) {
+    *out = value->BooleanValue(context->GetIsolate());
+    return true;
+  }
+
+  static bool FromValue(v8::Local<v8::Context> context,
+                        v8::Local<v8::Value> value, int32_t* out) {
+    return value->Int32Value(context).To(out);
+  }
+
+  static bool FromValue(v8::Local<v8::Context> context,
+                        v8::Local<v8::Value> value, uint32_t* out) {
+    return value->Uint32Value(context).To(out);
+  }
+
+  static bool FromValue(v8::Local<v8::Context> context,
+                        v8::Local<v8::Value> value, double* out) {
+    return value->NumberValue(context).To(out);
+  }
+
+  static void Dispose(const v8::FunctionCallbackInfo<v8::Value>& args) {
+    // Destroys the object now rather than once the V8 object has been
+    // garbage collected. Its tracker is released, so there is nothing left
+    // to do for the garbage collector. Calling it again does nothing.
+
+    v8::Local<v8::Object> this_handle = args.Holder();
+    Handle obj = Unwrap(this_handle);
+    if (obj == nullptr) return;
+
+    Tracker* t = static_cast<Tracker*>(
+        this_handle->GetAlignedPointerFromInternalField(kTrackerField));
+    this_handle->SetAlignedPointerInInternalField(kTrackerField, nullptr);
+    this_handle->SetAlignedPointerInInternalField(kHandleField, nullptr);
+
+    t->handle.Reset();
+    t->owner->Release(t);
+    ++t->owner->disposals_;
+
+    size_t size = SizeOfObject(obj);
+    Destroy(obj);
+    if (size != 0) {
+      args.GetIsolate()->AdjustAmountOfExternalAllocatedMemory(
+          -static_cast<int64_t>(size));
+    }
+  }
+
+  v8::Isolate* isolate_;
+  std::string class_name_;
+  v8::Global<v8::FunctionTemplate> factory_;
+
+  std::vector<Tracker*> tracker_blocks_;
+  Tracker* free_trackers_ = nullptr;
+  size_t free_tracker_count_ = 0;
+
+  Tracker* destroy_queue_ = nullptr;  // Oldest first.
+  Tracker** destroy_tail_ = &destroy_queue_;
+  size_t destroy_budget_ = 1000;
+  uint64_t disposals_ = 0;
+  uint64_t collections_ = 0;
+  uv_idle_t destroy_idle_;
+
+  node::AsyncCleanupHookHandle cleanup_hook_;
+  void (*cleanup_done_)(void*) = nullptr;
+  void* cleanup_done_arg_ = nullptr;
+};
+
+}  // namespace native_wrap
@@ -28,3 +28,247 @@ assert.throws(
   },
   /.*/
 );
+
+// Called often enough to be optimized. Builds against Node.js releases have
+// no fast overload (see native_wrap.hpp), so this runs the regular callback.
+
+var hot = wrap.createObject(0.5);
+for (var i = 0; i < 100000; ++i) hot.plusOne();
+assert.strictEqual(hot.plusOne(), 100001.5);
+
+assert.throws(
+  () => {
+    hot.plusOne.call({ value: 4 })
+  },
+  /.*/
+);
+
+// Optimized code gives the same results as interpreted code and throws for
+// disposed objects. This would call the fast overload, and check its
+// fallback to the regular callback, only in a build with
+// NATIVE_WRAP_EXPERIMENTAL_FAST_API; the fast path is not built by default.
+
+require('v8').setFlagsFromString('--allow-natives-syntax');
+var callPlusOne = new Function('obj', 'return obj.plusOne()');
+var optimizeOnNextCall = new Function('fn',
+  '%PrepareFunctionForOptimization(fn); fn(arguments[1]); ' +
+  '%OptimizeFunctionOnNextCall(fn)');
+
+var optimized = wrap.createObject(0);
+optimizeOnNextCall(callPlusOne, optimized);
+assert.strictEqual(callPlusOne(optimized), 2);
+assert.strictEqual(callPlusOne(optimized), 3);
+optimized.dispose();
+assert.throws(
+  () => {
+    callPlusOne(optimized)
+  },
+  /disposed/
+);
+
+var many = [wrap.createObject(1), wrap.createObject(2), wrap.createObject(3)];
+assert.deepStrictEqual(Array.from(wrap.plusOneMany(many)), [2, 3, 4]);
+
+var out = new Float64Array(4);
+assert.strictEqual(wrap.plusOneMany(many, out), out);
+assert.deepStrictEqual(Array.from(out), [3, 4, 5, 0]);
+
+assert.throws(
+  () => {
+    wrap.plusOneMany([many[0], { value: 4 }])
+  },
+  /.*/
+);
+assert.strictEqual(many[0].plusOne(), 4);
+
+assert.throws(
+  () => {
+    wrap.plusOneMany(many, new Float64Array(2))
+  },
+  /.*/
+);
+
+// Reading the elements can run getters, which must not be able to pull
+// <out> from under the call.
+
+var detaching = [wrap.createObject(1)];
+var detached = new Float64Array(2);
+Object.defineProperty(detaching, 1, {
+  get() {
+    structuredClone(detached.buffer, { transfer: [detached.buffer] });
+    return detaching[0];
+  }
+});
+assert.throws(
+  () => {
+    wrap.plusOneMany(detaching, detached)
+  },
+  /detached/
+);
+assert.strictEqual(detaching[0].plusOne(), 2);
+
+var disposing = [wrap.createObject(1)];
+var reused;
+Object.defineProperty(disposing, 1, {
+  get() {
+    disposing[0].dispose();
+    reused = wrap.createObject(100);
+    return reused;
+  }
+});
+assert.throws(
+  () => {
+    wrap.plusOneMany(disposing)
+  },
+  /disposed/
+);
+assert.strictEqual(reused.plusOne(), 101);
+
+var shrinking = [wrap.createObject(1), wrap.createObject(2),
+                 wrap.createObject(3)];
+Object.defineProperty(shrinking, 1, {
+  configurable: true,
+  get() {
+    shrinking.length = 1;
+    return shrinking[0];
+  }
+});
+assert.throws(
+  () => {
+    wrap.plusOneMany(shrinking)
+  },
+  /non-ThirdParty/
+);
+assert.strictEqual(shrinking[0].plusOne(), 2);
+
+var before = wrap.allocatorStats();
+var more = [wrap.createObject(1), wrap.createObject(2)];
+var after = wrap.allocatorStats();
+assert.strictEqual(after.used, before.used + 2);
+assert.ok(after.slabs >= 1 && after.slots >= after.used);
+
+wrap.setDestroyBudget(10);
+assert.throws(
+  () => {
+    wrap.setDestroyBudget(0)
+  },
+  /.*/
+);
+
+var disposable = wrap.createObject(1);
+assert.strictEqual(disposable.plusOne(), 2);
+disposable.dispose();
+disposable.dispose();
+assert.throws(
+  () => {
+    disposable.plusOne()
+  },
+  /disposed/
+);
+assert.throws(
+  () => {
+    wrap.plusOne(disposable)
+  },
+  /disposed/
+);
+assert.throws(
+  () => {
+    wrap.plusOneMany([disposable])
+  },
+  /disposed/
+);
+if (typeof Symbol.dispose === 'symbol') {
+  assert.strictEqual(disposable[Symbol.dispose], disposable.dispose);
+}
+
+// Each worker thread gets its own template and trackers, and the objects it
+// leaves behind are destroyed when it exits.
+
+const { Worker } = require('worker_threads');
+var worker = new Worker(`
+  const { parentPort, workerData } = require('worker_threads');
+  const wrap = require(workerData);
+  var objs = [wrap.createObject(1), wrap.createObject(2)];
+  parentPort.postMessage([objs[0].plusOne(), wrap.plusOne(objs[1])]);
+`, { eval: true, workerData: require.resolve('./build/Release/native_wrap') });
+worker.on('message', (results) => assert.deepStrictEqual(results, [2, 3]));
+worker.on('exit', (code) => assert.strictEqual(code, 0));
+
+// Objects are recognized by a brand rather than by their prototype.
+
+var reshaped = wrap.createObject(1);
+Object.setPrototypeOf(reshaped, Object.create(Object.getPrototypeOf(reshaped)));
+assert.strictEqual(wrap.plusOne(reshaped), 2);
+assert.strictEqual(reshaped.plusOne(), 3);
+assert.throws(
+  () => {
+    wrap.plusOne(Object.create(Object.getPrototypeOf(reshaped)))
+  },
+  TypeError
+);
+
+// Collected objects are destroyed exactly once, in batches after the garbage
+// collection, and their trackers are reused by the objects created next.
+
+function afterDestroying(callback) {
+  // Collects garbage until no more objects are destroyed.
+  var collected = wrap.trackerStats().collected;
+  global.gc();
+  setImmediate(() => setImmediate(() => {
+    if (wrap.trackerStats().collected == collected) {
+      callback();
+    } else {
+      afterDestroying(callback);
+    }
+  }));
+}
+
+if (global.gc) {
+  wrap.setDestroyBudget(100000);
+  afterDestroying(() => {
+    var allocated = wrap.allocatorStats();
+    var trackers = wrap.trackerStats();
+    var collectable = [];
+    for (var i = 0; i < 5000; ++i) collectable.push(wrap.createObject(i));
+    var tracked = wrap.trackerStats();
+    assert.strictEqual(tracked.free, trackers.free + tracked.trackers -
+                       trackers.trackers - 5000);
+    collectable = null;
+
+    afterDestroying(() => {
+      var collected = wrap.trackerStats();
+      assert.strictEqual(collected.collected, trackers.collected + 5000);
+      assert.strictEqual(collected.trackers, tracked.trackers);
+      assert.strictEqual(collected.free, tracked.free + 5000);
+      assert.strictEqual(wrap.allocatorStats().used, allocated.used);
+
+      var reused = [];
+      for (var i = 0; i < 5000; ++i) reused.push(wrap.createObject(i));
+      assert.strictEqual(wrap.trackerStats().trackers, tracked.trackers);
+      assert.strictEqual(wrap.trackerStats().free, tracked.free);
+      assert.strictEqual(reused[4999].plusOne(), 5000);
+
+      reused = null;
+      afterDestroying(checkExternalMemory);
+    });
+  });
+}
+
+// The native memory of the objects is reported to V8 while they are alive,
+// whether they are then disposed or collected.
+
+function checkExternalMemory() {
+  var external = wrap.externalMemory();
+  var size = wrap.allocatorStats().slotSize;
+  var objs = [];
+  for (var i = 0; i < 1000; ++i) objs.push(wrap.createObject(i));
+  assert.strictEqual(wrap.externalMemory(), external + 1000 * size);
+
+  for (var i = 0; i < 500; ++i) objs[i].dispose();
+  assert.strictEqual(wrap.externalMemory(), external + 500 * size);
+  objs = null;
+
+  afterDestroying(() => {
+    assert.strictEqual(wrap.externalMemory(), external);
+  });
+}
@@ -1,13 +1,29 @@
 #pragma once
 
+#include <stddef.h>
+
 namespace third_party {
 
 typedef void* handle_t;
 
+// Occupancy of the slabs that objects are allocated from.
+struct allocator_stats_t {
+  size_t slabs;  // Slabs allocated.
+  size_t slots;  // Objects that fit in them.
+  size_t used;   // Objects alive.
+  size_t slot_size;  // Bytes per object.
+};
+
 extern handle_t create(double value);
 
+// Must be called on the thread that created [handle].
 extern void destroy(handle_t handle);
 
 extern double plus_one(handle_t handle);
 
+// Bytes of native memory kept alive by the object, or 0 if unknown.
+extern size_t size_of(handle_t handle);
+
+extern void get_allocator_stats(allocator_stats_t* stats);
+
 }  // namespace third_party